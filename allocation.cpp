@@ -0,0 +1,165 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include "allocation.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+using namespace std;
+
+
+// Size of the huge pages that are requested (the usual size on x86-64 and ARM64)
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Bookkeeping of an array, stored in the ARRAY_ALIGNMENT bytes in front of it
+struct ArrayHeader {
+    void* base;                     // start of the allocation
+    size_t length;                  // its length in bytes
+    bool mapped;                    // allocated with mmap (explicit huge pages) rather than from the heap
+};
+
+
+static void* allocArray(size_t count, size_t size, int huge_pages) {
+    size_t bytes = count * size;
+    size_t length = bytes + ARRAY_ALIGNMENT;
+    void* base = NULL;
+    bool mapped = false;
+
+#ifdef __linux__
+    // Explicit huge pages come from the pool the administrator reserved, and transparent ones are only a hint
+    if(huge_pages == TSNE_HUGE_PAGES_EXPLICIT) {
+        size_t mapped_length = (length + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        base = mmap(NULL, mapped_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(base == MAP_FAILED) base = NULL;
+        else { length = mapped_length; mapped = true; }
+    }
+    if(base == NULL && huge_pages != TSNE_HUGE_PAGES_OFF && length >= HUGE_PAGE_SIZE) {
+        if(posix_memalign(&base, HUGE_PAGE_SIZE, length) != 0) base = NULL;
+        else madvise(base, length / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+    }
+#endif
+    if(base == NULL) {
+#ifdef _WIN32
+        base = _aligned_malloc(length, ARRAY_ALIGNMENT);
+#else
+        if(posix_memalign(&base, ARRAY_ALIGNMENT, length) != 0) base = NULL;
+#endif
+    }
+    if(base == NULL) return NULL;
+
+    ArrayHeader* header = (ArrayHeader*) base;
+    header->base = base;
+    header->length = length;
+    header->mapped = mapped;
+    char* array = (char*) base + ARRAY_ALIGNMENT;
+
+    // First touch: equal contiguous chunks per thread, as in the loops with schedule(static) over the points
+    const size_t page = 4096;
+    long long no_pages = (long long) ((bytes + page - 1) / page);
+    #pragma omp parallel for schedule(static)
+    for(long long p = 0; p < no_pages; p++) {
+        size_t offset = (size_t) p * page;
+        memset(array + offset, 0, min(page, bytes - offset));
+    }
+    return array;
+}
+
+static void freeArray(void* array) {
+    if(array == NULL) return;
+    ArrayHeader* header = (ArrayHeader*) ((char*) array - ARRAY_ALIGNMENT);
+#ifdef __linux__
+    if(header->mapped) {
+        munmap(header->base, header->length);
+        return;
+    }
+#endif
+#ifdef _WIN32
+    _aligned_free(header->base);
+#else
+    free(header->base);
+#endif
+}
+
+
+// The CPUs the process may run on, as they were before any thread was pinned
+#ifdef __linux__
+static const vector<int>& allowedCPUs() {
+    static vector<int> cpus;
+    static bool initialized = false;
+    #pragma omp critical(allowed_cpus)
+    if(!initialized) {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+            for(int c = 0; c < CPU_SETSIZE; c++) {
+                if(CPU_ISSET(c, &allowed)) cpus.push_back(c);
+            }
+        }
+        initialized = true;
+    }
+    return cpus;
+}
+#endif
+
+static bool pinThreads() {
+#if defined(__linux__) && defined(_OPENMP)
+    const vector<int>& cpus = allowedCPUs();
+    if(cpus.empty()) return false;
+    bool pinned = true;
+    #pragma omp parallel reduction(&&:pinned)
+    {
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &cpu);
+        pinned = (sched_setaffinity(0, sizeof(cpu), &cpu) == 0);
+    }
+    return pinned;
+#else
+    return false;
+#endif
+}
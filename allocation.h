@@ -0,0 +1,55 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#ifndef ALLOCATION_H
+#define ALLOCATION_H
+
+#include <stddef.h>
+
+
+// Alignment of the large arrays: a cache line, which also holds an AVX-512 register
+static const size_t ARRAY_ALIGNMENT = 64;
+
+// Allocates a zero-filled array of count elements of the given size for the optimizer, aligned to ARRAY_ALIGNMENT and
+// optionally on huge pages (one of TSNEHugePages, falling back to ordinary pages); the threads zero the array in the
+// static OpenMP partition, so on NUMA hosts every page ends up local to the thread that works on it. Returns NULL when
+// out of memory; release the array with freeArray
+static void* allocArray(size_t count, size_t size, int huge_pages);
+static void freeArray(void* array);
+
+// Pins every OpenMP thread to its own CPU of the ones the process may run on (thread i on the i-th of them), so the
+// static partitions keep their memory local; returns false where this is not supported
+static bool pinThreads();
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#include <stdio.h>
+#include <string.h>
+#include "checkpoint.h"
+
+
+template<typename T>
+CheckpointWriter<T>::CheckpointWriter(const char* filename) : filename(filename), beta(NULL), val_P(NULL), row_P(NULL), col_P(NULL), failed(false)
+{
+}
+
+template<typename T>
+CheckpointWriter<T>::~CheckpointWriter()
+{
+    wait();
+}
+
+
+// Starts writing a checkpoint (after the previous one is complete); the arrays that are not copied must stay unchanged
+// until the next call of write() or wait()
+template<typename T>
+void CheckpointWriter<T>::write(const CheckpointHeader& header, const T* Y, const T* uY, const T* gains, const T* mean_Y, const T* beta,
+                                const T* val_P, const unsigned int* row_P, const unsigned int* col_P)
+{
+    wait();
+    this->header = header;
+    size_t size = (size_t) header.n * header.no_dims;
+    state.resize(3 * size + header.no_dims);
+    memcpy(&state[0], Y, size * sizeof(T));
+    memcpy(&state[size], uY, size * sizeof(T));
+    memcpy(&state[2 * size], gains, size * sizeof(T));
+    memcpy(&state[3 * size], mean_Y, header.no_dims * sizeof(T));
+    this->beta = beta;
+    this->val_P = val_P;
+    this->row_P = row_P;
+    this->col_P = col_P;
+    worker = thread(&CheckpointWriter<T>::writeFile, this);
+}
+
+
+// Waits for the checkpoint in progress; returns false if any checkpoint so far could not be written
+template<typename T>
+bool CheckpointWriter<T>::wait()
+{
+    if(worker.joinable()) worker.join();
+    return !failed;
+}
+
+
+// Writes the checkpoint to a temporary file next to the target, and renames it over the target when it is complete,
+// so an interrupted write leaves the previous checkpoint intact
+template<typename T>
+void CheckpointWriter<T>::writeFile()
+{
+    string temp_filename = filename + ".tmp";
+    FILE *h;
+    if((h = fopen(temp_filename.c_str(), "wb")) == NULL) { failed = true; return; }
+    size_t N = header.n;
+    bool ok = fwrite(&header, sizeof(header), 1, h) == 1 &&
+              fwrite(&state[0], sizeof(T), state.size(), h) == state.size() &&
+              fwrite(beta, sizeof(T), N, h) == N &&
+              fwrite(val_P, sizeof(T), header.no_elem, h) == header.no_elem;
+    if(ok && !header.exact) {
+        ok = fwrite(row_P, sizeof(unsigned int), N + 1, h) == N + 1 &&
+             fwrite(col_P, sizeof(unsigned int), header.no_elem, h) == header.no_elem;
+    }
+    if(fclose(h) != 0) ok = false;
+#ifdef _WIN32
+    if(ok) remove(filename.c_str());
+#endif
+    if(!ok || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+        remove(temp_filename.c_str());
+        failed = true;
+    }
+}
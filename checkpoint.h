@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <thread>
+
+using namespace std;
+
+
+// Header of a checkpoint file; the arrays follow it in this order: Y, uY and gains (N x no_dims each), the mean of Y
+// (no_dims), the kernel precisions (N), the values of P, and for sparse P also its row offsets (N + 1) and column indices
+struct CheckpointHeader {
+    char magic[4];                  // "BHTC"
+    int version;                    // 2
+    int element_type;               // ELEMENT_FLOAT32 or ELEMENT_FLOAT64
+    int n;                          // number of datapoints
+    int no_dims;                    // output dimensionality
+    int exact;                      // 1 if P is a dense N x N matrix
+    int iter;                       // next iteration of the optimization
+    int lying;                      // 1 while the forces of P are still exaggerated (P itself is stored as computed)
+    double momentum;
+    unsigned long long no_elem;     // number of values of P
+};
+
+
+// Writes checkpoints of an optimization from a background thread: write() only copies the map and its optimizer state,
+// and replaces the file atomically once the checkpoint is complete
+template<typename T>
+class CheckpointWriter
+{
+    string filename;
+    CheckpointHeader header;
+    vector<T> state;                                // copy of Y, uY, gains and the mean of Y
+    const T* beta;                                  // these are not copied: they must not change until wait() returns
+    const T* val_P;
+    const unsigned int* row_P;
+    const unsigned int* col_P;
+    thread worker;
+    bool failed;
+
+public:
+    CheckpointWriter(const char* filename);
+    ~CheckpointWriter();
+    void write(const CheckpointHeader& header, const T* Y, const T* uY, const T* gains, const T* mean_Y, const T* beta,
+               const T* val_P, const unsigned int* row_P, const unsigned int* col_P);
+    bool wait();
+
+private:
+    void writeFile();
+};
+
+#endif
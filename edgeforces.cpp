@@ -0,0 +1,249 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "edgeforces.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EDGEFORCES_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+
+// Returns the widest instruction set that the CPU supports (detected once)
+static SIMDLevel detectSIMDLevel()
+{
+#ifdef EDGEFORCES_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+static SIMDLevel getSIMDLevel()
+{
+    static const SIMDLevel level = detectSIMDLevel();
+    return level;
+}
+
+static const char* getSIMDName(SIMDLevel level)
+{
+    switch(level) {
+        case SIMD_AVX512: return "AVX-512";
+        case SIMD_AVX2:   return "AVX2";
+        default:          return "scalar";
+    }
+}
+
+
+// Sums the forces of the edges [start, end) of point n
+template<typename T, int dimension>
+static inline void sumEdgeForces(const T* const coords[], const unsigned int* col_P, const T* val_P, unsigned int n,
+                                 unsigned int start, unsigned int end, T sum[])
+{
+    for(unsigned int i = start; i < end; i++) {
+        T buff[dimension];
+        T D = 1.0;
+        for(int d = 0; d < dimension; d++) buff[d] = coords[d][n] - coords[d][col_P[i]];
+        for(int d = 0; d < dimension; d++) D += buff[d] * buff[d];
+        D = val_P[i] / D;
+        for(int d = 0; d < dimension; d++) sum[d] += D * buff[d];
+    }
+}
+
+// Scalar kernel for the rows [first, last)
+template<typename T, int dimension>
+static void edgeForcesScalar(const T* const coords[], const unsigned int* row_P, const unsigned int* col_P, const T* val_P,
+                             unsigned int first, unsigned int last, T pos_f[])
+{
+    for(unsigned int n = first; n < last; n++) {
+        T sum[dimension] = {};
+        sumEdgeForces<T, dimension>(coords, col_P, val_P, n, row_P[n], row_P[n + 1], sum);
+        for(int d = 0; d < dimension; d++) pos_f[n * dimension + d] += sum[d];
+    }
+}
+
+#ifdef EDGEFORCES_X86
+
+// AVX2 kernels (4 doubles or 8 floats per step)
+template<int dimension>
+__attribute__((target("avx2,fma")))
+static void edgeForcesAVX2(const double* const coords[], const unsigned int* row_P, const unsigned int* col_P, const double* val_P,
+                           unsigned int first, unsigned int last, double pos_f[])
+{
+    for(unsigned int n = first; n < last; n++) {
+        __m256d point[dimension], acc[dimension];
+        for(int d = 0; d < dimension; d++) { point[d] = _mm256_set1_pd(coords[d][n]); acc[d] = _mm256_setzero_pd(); }
+        unsigned int i = row_P[n];
+        for(; i + 4 <= row_P[n + 1]; i += 4) {
+            __m128i index = _mm_loadu_si128((const __m128i*) (col_P + i));
+            __m256d buff[dimension];
+            __m256d D = _mm256_set1_pd(1.0);
+            for(int d = 0; d < dimension; d++) {
+                buff[d] = _mm256_sub_pd(point[d], _mm256_i32gather_pd(coords[d], index, 8));
+                D = _mm256_fmadd_pd(buff[d], buff[d], D);
+            }
+            D = _mm256_div_pd(_mm256_loadu_pd(val_P + i), D);
+            for(int d = 0; d < dimension; d++) acc[d] = _mm256_fmadd_pd(D, buff[d], acc[d]);
+        }
+        double sum[dimension];
+        for(int d = 0; d < dimension; d++) {
+            __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc[d]), _mm256_extractf128_pd(acc[d], 1));
+            sum[d] = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+        }
+        sumEdgeForces<double, dimension>(coords, col_P, val_P, n, i, row_P[n + 1], sum);
+        for(int d = 0; d < dimension; d++) pos_f[n * dimension + d] += sum[d];
+    }
+}
+
+template<int dimension>
+__attribute__((target("avx2,fma")))
+static void edgeForcesAVX2(const float* const coords[], const unsigned int* row_P, const unsigned int* col_P, const float* val_P,
+                           unsigned int first, unsigned int last, float pos_f[])
+{
+    for(unsigned int n = first; n < last; n++) {
+        __m256 point[dimension], acc[dimension];
+        for(int d = 0; d < dimension; d++) { point[d] = _mm256_set1_ps(coords[d][n]); acc[d] = _mm256_setzero_ps(); }
+        unsigned int i = row_P[n];
+        for(; i + 8 <= row_P[n + 1]; i += 8) {
+            __m256i index = _mm256_loadu_si256((const __m256i*) (col_P + i));
+            __m256 buff[dimension];
+            __m256 D = _mm256_set1_ps(1.0f);
+            for(int d = 0; d < dimension; d++) {
+                buff[d] = _mm256_sub_ps(point[d], _mm256_i32gather_ps(coords[d], index, 4));
+                D = _mm256_fmadd_ps(buff[d], buff[d], D);
+            }
+            D = _mm256_div_ps(_mm256_loadu_ps(val_P + i), D);
+            for(int d = 0; d < dimension; d++) acc[d] = _mm256_fmadd_ps(D, buff[d], acc[d]);
+        }
+        float sum[dimension];
+        for(int d = 0; d < dimension; d++) {
+            __m128 half = _mm_add_ps(_mm256_castps256_ps128(acc[d]), _mm256_extractf128_ps(acc[d], 1));
+            half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+            sum[d] = _mm_cvtss_f32(_mm_add_ss(half, _mm_movehdup_ps(half)));
+        }
+        sumEdgeForces<float, dimension>(coords, col_P, val_P, n, i, row_P[n + 1], sum);
+        for(int d = 0; d < dimension; d++) pos_f[n * dimension + d] += sum[d];
+    }
+}
+
+// AVX-512 kernels (8 doubles or 16 floats per step)
+template<int dimension>
+__attribute__((target("avx512f")))
+static void edgeForcesAVX512(const double* const coords[], const unsigned int* row_P, const unsigned int* col_P, const double* val_P,
+                             unsigned int first, unsigned int last, double pos_f[])
+{
+    for(unsigned int n = first; n < last; n++) {
+        __m512d point[dimension], acc[dimension];
+        for(int d = 0; d < dimension; d++) { point[d] = _mm512_set1_pd(coords[d][n]); acc[d] = _mm512_setzero_pd(); }
+        unsigned int i = row_P[n];
+        for(; i + 8 <= row_P[n + 1]; i += 8) {
+            __m256i index = _mm256_loadu_si256((const __m256i*) (col_P + i));
+            __m512d buff[dimension];
+            __m512d D = _mm512_set1_pd(1.0);
+            for(int d = 0; d < dimension; d++) {
+                buff[d] = _mm512_sub_pd(point[d], _mm512_i32gather_pd(index, coords[d], 8));
+                D = _mm512_fmadd_pd(buff[d], buff[d], D);
+            }
+            D = _mm512_div_pd(_mm512_loadu_pd(val_P + i), D);
+            for(int d = 0; d < dimension; d++) acc[d] = _mm512_fmadd_pd(D, buff[d], acc[d]);
+        }
+        double sum[dimension];
+        for(int d = 0; d < dimension; d++) sum[d] = _mm512_reduce_add_pd(acc[d]);
+        sumEdgeForces<double, dimension>(coords, col_P, val_P, n, i, row_P[n + 1], sum);
+        for(int d = 0; d < dimension; d++) pos_f[n * dimension + d] += sum[d];
+    }
+}
+
+template<int dimension>
+__attribute__((target("avx512f")))
+static void edgeForcesAVX512(const float* const coords[], const unsigned int* row_P, const unsigned int* col_P, const float* val_P,
+                             unsigned int first, unsigned int last, float pos_f[])
+{
+    for(unsigned int n = first; n < last; n++) {
+        __m512 point[dimension], acc[dimension];
+        for(int d = 0; d < dimension; d++) { point[d] = _mm512_set1_ps(coords[d][n]); acc[d] = _mm512_setzero_ps(); }
+        unsigned int i = row_P[n];
+        for(; i + 16 <= row_P[n + 1]; i += 16) {
+            __m512i index = _mm512_loadu_si512((const void*) (col_P + i));
+            __m512 buff[dimension];
+            __m512 D = _mm512_set1_ps(1.0f);
+            for(int d = 0; d < dimension; d++) {
+                buff[d] = _mm512_sub_ps(point[d], _mm512_i32gather_ps(index, coords[d], 4));
+                D = _mm512_fmadd_ps(buff[d], buff[d], D);
+            }
+            D = _mm512_div_ps(_mm512_loadu_ps(val_P + i), D);
+            for(int d = 0; d < dimension; d++) acc[d] = _mm512_fmadd_ps(D, buff[d], acc[d]);
+        }
+        float sum[dimension];
+        for(int d = 0; d < dimension; d++) sum[d] = _mm512_reduce_add_ps(acc[d]);
+        sumEdgeForces<float, dimension>(coords, col_P, val_P, n, i, row_P[n + 1], sum);
+        for(int d = 0; d < dimension; d++) pos_f[n * dimension + d] += sum[d];
+    }
+}
+
+#endif
+
+
+// Computes the attractive forces with the kernel of the given instruction set (or the widest one below it that we have)
+template<typename T, int dimension>
+void computeEdgeForces(const unsigned int* row_P, const unsigned int* col_P, const T* val_P, const T* Y, unsigned int N,
+                       T pos_f[], T soa[], SIMDLevel level)
+{
+
+    // Copy the embedding into one array per dimension, so the kernels can gather coordinates
+    const T* coords[dimension];
+    for(int d = 0; d < dimension; d++) coords[d] = &soa[(size_t) d * N];
+    #pragma omp parallel for schedule(static)
+    for(unsigned int n = 0; n < N; n++) {
+        for(int d = 0; d < dimension; d++) soa[(size_t) d * N + n] = Y[n * dimension + d];
+    }
+
+    // Process the rows in blocks
+    const unsigned int block_size = 256;
+    const unsigned int no_blocks = (N + block_size - 1) / block_size;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(unsigned int b = 0; b < no_blocks; b++) {
+        unsigned int first = b * block_size;
+        unsigned int last = (first + block_size < N) ? first + block_size : N;
+#ifdef EDGEFORCES_X86
+        if(level >= SIMD_AVX512) { edgeForcesAVX512<dimension>(coords, row_P, col_P, val_P, first, last, pos_f); continue; }
+        if(level >= SIMD_AVX2)   { edgeForcesAVX2<dimension>(coords, row_P, col_P, val_P, first, last, pos_f); continue; }
+#endif
+        edgeForcesScalar<T, dimension>(coords, row_P, col_P, val_P, first, last, pos_f);
+    }
+}
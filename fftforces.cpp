@@ -0,0 +1,449 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <cmath>
+#include <algorithm>
+#include "fftforces.h"
+
+
+// Definitions of the constants that are passed by reference (to min and max)
+template<typename T, int dimension> const int FFTForces<T, dimension>::terms;
+template<typename T, int dimension> const int FFTForces<T, dimension>::max_interp_points;
+
+
+// Returns the smallest length of at least n whose only prime factors are 2, 3 and 5
+static int getFFTLength(int n)
+{
+    for(int length = max(n, 1); ; length++) {
+        int rem = length;
+        while(rem % 2 == 0) rem /= 2;
+        while(rem % 3 == 0) rem /= 3;
+        while(rem % 5 == 0) rem /= 5;
+        if(rem == 1) return length;
+    }
+}
+
+
+// Sets up the interpolation scheme (2 to 8 nodes per box and dimension; more nodes give more accurate forces)
+template<typename T, int dimension>
+FFTForces<T, dimension>::FFTForces(int interp_points)
+{
+    this->interp_points = max(2, min(interp_points, max_interp_points));
+    boxes = 0; grid_size = 0; fft_size = 0;
+    min_coord = .0; box_width = 1.0;
+
+    // The nodes sit at the centers of interp_points equal sub-intervals of every box
+    for(int k = 0; k < this->interp_points; k++) {
+        denominators[k] = 1.0;
+        for(int m = 0; m < this->interp_points; m++) {
+            if(m != k) denominators[k] *= (double) (k - m) / this->interp_points;
+        }
+    }
+}
+
+
+// Fills neg_f with sum_j q_ij^2 (y_i - y_j) for every point i, and returns the normalization sum_{i != j} q_ij
+template<typename T, int dimension>
+double FFTForces<T, dimension>::computeNonEdgeForces(const T* Y, unsigned int N, T neg_f[])
+{
+    setupGrid(Y, N);
+    spreadCharges(Y, N);
+    convolve();
+
+    // Combine the potentials of the different charges
+    double sum_Q = .0;
+    #pragma omp parallel for schedule(static) reduction(+:sum_Q)
+    for(unsigned int n = 0; n < N; n++) {
+        const T* point = Y + n * dimension;
+        double phi[terms];
+        gatherPotentials(point, phi);
+
+        // Since 1 / (1 + |y_i - y_j|^2) = (1 + |y_i|^2 - 2 y_i y_j + |y_j|^2) / (1 + |y_i - y_j|^2)^2, the squared kernel
+        // applied to the charges also gives the normalization term
+        double sq_norm = .0, dot = .0;
+        for(int d = 0; d < dimension; d++) {
+            neg_f[n * dimension + d] = (T) (point[d] * phi[0] - phi[d + 1]);
+            sq_norm += (double) point[d] * point[d];
+            dot += point[d] * phi[d + 1];
+        }
+        sum_Q += (1.0 + sq_norm) * phi[0] - 2.0 * dot + phi[dimension + 1];
+    }
+    return sum_Q - N;                                               // remove the interactions of the points with themselves
+}
+
+
+// Width of the grid boxes at the last call of computeNonEdgeForces (the forces lose accuracy beyond unit width)
+template<typename T, int dimension>
+double FFTForces<T, dimension>::getBoxWidth() const
+{
+    return box_width;
+}
+
+
+// Fits the grid around the map and recomputes the Fourier transform of the kernel on it
+template<typename T, int dimension>
+void FFTForces<T, dimension>::setupGrid(const T* Y, unsigned int N)
+{
+
+    // Find the bounding cube of the map
+    double min_Y = Y[0], max_Y = Y[0];
+    for(unsigned int i = 1; i < N * dimension; i++) {
+        min_Y = min(min_Y, (double) Y[i]);
+        max_Y = max(max_Y, (double) Y[i]);
+    }
+    double span = max_Y - min_Y;
+    if(span <= .0) span = 1.0;
+
+    // Use boxes of at most unit width (and at least a minimum number of boxes), and zero-pad the grid to twice its size,
+    // rounded up to the next length with factors 2, 3 and 5 only; the padded grid is capped at 2048 nodes per side in 2D
+    // and 256 in 3D (341 and 42 boxes with three nodes per box), so wider maps get wider boxes and less accurate forces
+    // (see getBoxWidth)
+    int min_boxes = (dimension == 2) ? 50 : 16;
+    int max_fft_size = (dimension == 2) ? 2048 : 256;
+    boxes = min(max(min_boxes, (int) ceil(span)), max_fft_size / (2 * interp_points));
+    grid_size = boxes * interp_points;
+    int new_fft_size = getFFTLength(2 * grid_size);
+    min_coord = min_Y;
+    box_width = span / boxes;
+
+    // Compute twiddle factors and the passes of the FFT when its length changes
+    int fft_points = 1, grid_points = 1;
+    for(int d = 0; d < dimension; d++) { fft_points *= new_fft_size; grid_points *= grid_size; }
+    if(new_fft_size != fft_size) {
+        fft_size = new_fft_size;
+        roots.resize(fft_size);
+        for(int k = 0; k < fft_size; k++) roots[k] = polar(1.0, -2.0 * M_PI * k / fft_size);
+        radices.clear();
+        int rem = fft_size;
+        const int factors[4] = {4, 2, 3, 5};
+        for(int f = 0; f < 4; f++) {
+            while(rem % factors[f] == 0) { radices.push_back(factors[f]); rem /= factors[f]; }
+        }
+        kernel_hat.resize(fft_points);
+        buffer.resize(fft_points);
+    }
+    charges.resize(terms * grid_points);
+    potentials.resize(terms * grid_points);
+
+    // Evaluate the squared kernel for all offsets between grid nodes (negative offsets wrap around)
+    double spacing = box_width / interp_points;
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < fft_points; i++) {
+        double sq_dist = .0;
+        int rem = i;
+        for(int d = 0; d < dimension; d++) {
+            int offset = rem % fft_size;
+            rem /= fft_size;
+            if(offset > fft_size / 2) offset -= fft_size;
+            sq_dist += (offset * spacing) * (offset * spacing);
+        }
+        double q = 1.0 / (1.0 + sq_dist);
+        buffer[i] = Complex(q * q, .0);
+    }
+    transform(false, false);
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < fft_points; i++) kernel_hat[i] = buffer[i].real();
+}
+
+
+// Computes the interpolation weights of a point, and returns the grid index of the first node of its box
+template<typename T, int dimension>
+int FFTForces<T, dimension>::getWeights(const T* point, double weights[][max_interp_points]) const
+{
+    int index = 0;
+    for(int d = 0; d < dimension; d++) {
+        double pos = (point[d] - min_coord) / box_width;
+        int box = min(max((int) pos, 0), boxes - 1);
+        double t = pos - box;
+        for(int k = 0; k < interp_points; k++) {
+            double w = 1.0;
+            for(int m = 0; m < interp_points; m++) {
+                if(m != k) w *= t - (m + .5) / interp_points;
+            }
+            weights[d][k] = w / denominators[k];
+        }
+        index = index * grid_size + box * interp_points;
+    }
+    return index;
+}
+
+
+// Interpolates the charges of all points onto the grid nodes
+template<typename T, int dimension>
+void FFTForces<T, dimension>::spreadCharges(const T* Y, unsigned int N)
+{
+
+    // Sort the points by their box in the first dimension, so slabs of boxes can be filled in parallel
+    slab_begin.assign(boxes + 1, 0);
+    order.resize(N);
+    for(unsigned int n = 0; n < N; n++) {
+        int box = min(max((int) ((Y[n * dimension] - min_coord) / box_width), 0), boxes - 1);
+        slab_begin[box + 1]++;
+    }
+    for(int b = 0; b < boxes; b++) slab_begin[b + 1] += slab_begin[b];
+    vector<unsigned int> offset(slab_begin.begin(), slab_begin.end() - 1);
+    for(unsigned int n = 0; n < N; n++) {
+        int box = min(max((int) ((Y[n * dimension] - min_coord) / box_width), 0), boxes - 1);
+        order[offset[box]++] = n;
+    }
+
+    int grid_points = (int) (charges.size() / terms);
+    fill(charges.begin(), charges.end(), .0);
+
+    int corners = 1;
+    for(int d = 0; d < dimension; d++) corners *= interp_points;
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int b = 0; b < boxes; b++) {
+        double weights[dimension][max_interp_points];
+        for(unsigned int i = slab_begin[b]; i < slab_begin[b + 1]; i++) {
+            const T* point = Y + order[i] * dimension;
+            int first = getWeights(point, weights);
+
+            double q[terms];
+            q[0] = 1.0; q[dimension + 1] = .0;
+            for(int d = 0; d < dimension; d++) {
+                q[d + 1] = point[d];
+                q[dimension + 1] += (double) point[d] * point[d];
+            }
+
+            // Add the charges to all nodes of the box
+            for(int c = 0; c < corners; c++) {
+                int rem = c, index = 0;
+                double w = 1.0;
+                for(int d = 0; d < dimension; d++) {
+                    int k = rem % interp_points;
+                    rem /= interp_points;
+                    w *= weights[d][k];
+                    index = index * grid_size + k;
+                }
+                for(int t = 0; t < terms; t++) charges[t * grid_points + first + index] += w * q[t];
+            }
+        }
+    }
+}
+
+
+// Convolves the charges of every term with the kernel to obtain the potentials at the grid nodes
+template<typename T, int dimension>
+void FFTForces<T, dimension>::convolve()
+{
+    int grid_points = (int) (charges.size() / terms);
+    double scale = 1.0 / buffer.size();
+
+    // The kernel is real, so two terms are convolved at once as the real and imaginary parts of the buffer
+    for(int t = 0; t < terms; t += 2) {
+        const double* real = &charges[t * grid_points];
+        const double* imag = (t + 1 < terms) ? &charges[(t + 1) * grid_points] : NULL;
+
+        // Embed the charges in the zero-padded grid
+        fill(buffer.begin(), buffer.end(), Complex(.0, .0));
+        #pragma omp parallel for schedule(static)
+        for(int g = 0; g < grid_points; g++) {
+            int rem = g, index = 0, stride = 1;
+            for(int d = 0; d < dimension; d++) {
+                index += (rem % grid_size) * stride;
+                rem /= grid_size;
+                stride *= fft_size;
+            }
+            buffer[index] = Complex(real[g], imag == NULL ? .0 : imag[g]);
+        }
+
+        // Multiply with the kernel in the frequency domain
+        transform(false, true);
+        #pragma omp parallel for schedule(static)
+        for(int i = 0; i < (int) buffer.size(); i++) buffer[i] *= kernel_hat[i] * scale;
+        transform(true, true);
+
+        // Read the potentials back from the grid
+        #pragma omp parallel for schedule(static)
+        for(int g = 0; g < grid_points; g++) {
+            int rem = g, index = 0, stride = 1;
+            for(int d = 0; d < dimension; d++) {
+                index += (rem % grid_size) * stride;
+                rem /= grid_size;
+                stride *= fft_size;
+            }
+            potentials[t * grid_points + g] = buffer[index].real();
+            if(imag != NULL) potentials[(t + 1) * grid_points + g] = buffer[index].imag();
+        }
+    }
+}
+
+
+// Interpolates the potentials of every term at a point
+template<typename T, int dimension>
+void FFTForces<T, dimension>::gatherPotentials(const T* point, double phi[]) const
+{
+    double weights[dimension][max_interp_points];
+    int first = getWeights(point, weights);
+    int grid_points = (int) (potentials.size() / terms);
+
+    int corners = 1;
+    for(int d = 0; d < dimension; d++) corners *= interp_points;
+
+    for(int t = 0; t < terms; t++) phi[t] = .0;
+    for(int c = 0; c < corners; c++) {
+        int rem = c, index = 0;
+        double w = 1.0;
+        for(int d = 0; d < dimension; d++) {
+            int k = rem % interp_points;
+            rem /= interp_points;
+            w *= weights[d][k];
+            index = index * grid_size + k;
+        }
+        for(int t = 0; t < terms; t++) phi[t] += w * potentials[t * grid_points + first + index];
+    }
+}
+
+
+// Applies the multi-dimensional FFT to the buffer, one dimension at a time; with padded set, only the grid corner of
+// the input is nonzero (forward) or only the grid corner of the output is needed (inverse), and lines that are known
+// to be zero or unused are skipped. Lines along the higher dimensions are copied in blocks of neighboring lines, so
+// every cache line of the buffer is read once per block, and the inverse FFT conjugates its input and output
+template<typename T, int dimension>
+void FFTForces<T, dimension>::transform(bool inverse, bool padded)
+{
+    const int block = 8;
+    int lines = (int) (buffer.size() / fft_size);
+    int stride = 1;
+    for(int d = 0; d < dimension; d++) {
+        int block_lines = min(block, stride);
+        int blocks_per_slab = (stride + block_lines - 1) / block_lines;
+        int blocks = (lines / stride) * blocks_per_slab;
+        #pragma omp parallel
+        {
+            vector<Complex> line((size_t) block * fft_size), work(fft_size);
+            bool used[block];
+            #pragma omp for schedule(static)
+            for(int b = 0; b < blocks; b++) {
+
+                // Lines along dimension d start at every index whose coordinate d is zero
+                int first = (b % blocks_per_slab) * block_lines;
+                int count = min(block_lines, stride - first);
+                int start = (b / blocks_per_slab) * stride * fft_size + first;
+                bool any = false;
+                for(int k = 0; k < count; k++) {
+                    used[k] = true;
+                    if(padded) {
+                        int rem = start + k;
+                        for(int e = 0; e < dimension; e++, rem /= fft_size) {
+                            if(e != d && rem % fft_size >= grid_size && (inverse ? e < d : e > d)) used[k] = false;
+                        }
+                    }
+                    any = any || used[k];
+                }
+                if(!any) continue;
+
+                for(int i = 0; i < fft_size; i++) {
+                    const Complex* source = &buffer[start + (size_t) i * stride];
+                    for(int k = 0; k < count; k++) line[(size_t) k * fft_size + i] = inverse ? conj(source[k]) : source[k];
+                }
+                for(int k = 0; k < count; k++) {
+                    if(used[k]) fft(&line[(size_t) k * fft_size], &work[0]);
+                }
+                for(int i = 0; i < fft_size; i++) {
+                    Complex* target = &buffer[start + (size_t) i * stride];
+                    for(int k = 0; k < count; k++) {
+                        if(used[k]) target[k] = inverse ? conj(line[(size_t) k * fft_size + i]) : line[(size_t) k * fft_size + i];
+                    }
+                }
+            }
+        }
+        stride *= fft_size;
+    }
+}
+
+
+// In-place forward FFT of length fft_size (unnormalized), as one self-sorting (Stockham) pass per factor in radices,
+// which alternate between data and work
+template<typename T, int dimension>
+void FFTForces<T, dimension>::fft(Complex* data, Complex* work) const
+{
+    const Complex minus_i(.0, -1.0);
+    const Complex sin3(.0, -sqrt(.75));                             // -i sin(2 pi / 3)
+    Complex* x = data;
+    Complex* y = work;
+    int length = fft_size, stride = 1;
+    for(size_t r = 0; r < radices.size(); r++) {
+        int radix = radices[r];
+        int m = length / radix;
+        int root_step = fft_size / length;
+        for(int q = 0; q < m; q++) {
+            Complex w[5];
+            for(int j = 1; j < radix; j++) w[j] = roots[q * j * root_step];
+            for(int s = 0; s < stride; s++) {
+
+                // DFT of length radix over the elements q, q + m, ..., followed by the twiddle factors of this pass
+                const Complex* a = x + s + stride * q;
+                Complex* b = y + s + stride * radix * q;
+                int gap = stride * m;
+                if(radix == 4) {
+                    Complex t0 = a[0] + a[2 * gap], t1 = a[0] - a[2 * gap];
+                    Complex t2 = a[gap] + a[3 * gap], t3 = (a[gap] - a[3 * gap]) * minus_i;
+                    b[0] = t0 + t2;
+                    b[stride] = (t1 + t3) * w[1];
+                    b[2 * stride] = (t0 - t2) * w[2];
+                    b[3 * stride] = (t1 - t3) * w[3];
+                }
+                else if(radix == 2) {
+                    Complex a0 = a[0], a1 = a[gap];
+                    b[0] = a0 + a1;
+                    b[stride] = (a0 - a1) * w[1];
+                }
+                else if(radix == 3) {
+                    Complex sum = a[gap] + a[2 * gap];
+                    Complex middle = a[0] - .5 * sum;
+                    Complex diff = (a[gap] - a[2 * gap]) * sin3;
+                    b[0] = a[0] + sum;
+                    b[stride] = (middle + diff) * w[1];
+                    b[2 * stride] = (middle - diff) * w[2];
+                }
+                else {
+                    for(int j = 0; j < radix; j++) {
+                        Complex sum = a[0];
+                        for(int k = 1; k < radix; k++) sum += a[k * gap] * roots[(j * k % radix) * (fft_size / radix)];
+                        b[j * stride] = (j == 0) ? sum : sum * w[j];
+                    }
+                }
+            }
+        }
+        swap(x, y);
+        length = m;
+        stride *= radix;
+    }
+    if(x != data) copy(x, x + fft_size, data);
+}
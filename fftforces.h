@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#ifndef FFTFORCES_H
+#define FFTFORCES_H
+
+#include <complex>
+#include <vector>
+
+using namespace std;
+
+
+// Repulsive t-SNE forces obtained by interpolating the squared Student-t kernel on a regular grid and convolving with FFTs
+template<typename T, int dimension>
+class FFTForces
+{
+    typedef complex<double> Complex;
+
+    static const int terms = dimension + 2;         // charges 1, y_1 .. y_dimension and |y|^2
+    static const int max_interp_points = 8;
+
+    // Grid layout (the same in every dimension)
+    int interp_points;                              // interpolation nodes per box
+    int boxes;                                      // boxes per dimension
+    int grid_size;                                  // interpolation nodes per dimension
+    int fft_size;                                   // zero-padded FFT length per dimension (factors 2, 3 and 5 only)
+    double min_coord;
+    double box_width;
+    double denominators[max_interp_points];         // denominators of the Lagrange basis polynomials
+
+    // Buffers that are reused across iterations
+    vector<unsigned int> slab_begin;                // points sorted by their box in the first dimension
+    vector<unsigned int> order;
+    vector<double> charges;                         // terms x grid_size^dimension
+    vector<double> potentials;
+    vector<double> kernel_hat;                      // FFT of the kernel on the padded grid (real, as the kernel is even)
+    vector<Complex> buffer;
+    vector<Complex> roots;                          // twiddle factors of the 1D FFT
+    vector<int> radices;                            // factors of fft_size, one per pass of the 1D FFT
+
+public:
+    FFTForces(int interp_points = 3);
+    double computeNonEdgeForces(const T* Y, unsigned int N, T neg_f[]);
+    double getBoxWidth() const;
+
+private:
+    void setupGrid(const T* Y, unsigned int N);
+    int getWeights(const T* point, double weights[][max_interp_points]) const;
+    void spreadCharges(const T* Y, unsigned int N);
+    void convolve();
+    void gatherPotentials(const T* point, double phi[]) const;
+    void transform(bool inverse, bool padded);
+    void fft(Complex* data, Complex* work) const;
+};
+
+#endif
@@ -0,0 +1,224 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <limits>
+#include "kdtree.h"
+
+
+// Orders point indices by one coordinate
+template<typename T, int dimension>
+struct CoordinateLess {
+    const T* data;
+    int split;
+    CoordinateLess(const T* data, int split) : data(data), split(split) {}
+    bool operator()(unsigned int a, unsigned int b) const { return data[a * dimension + split] < data[b * dimension + split]; }
+};
+
+
+template<typename T, int dimension>
+KDTree<T, dimension>::KDTree() : data(NULL), N(0)
+{
+}
+
+template<typename T, int dimension>
+KDTree<T, dimension>::KDTree(T* inp_data, unsigned int inp_N) : data(NULL), N(0)
+{
+    build(inp_data, inp_N);
+}
+
+
+// Builds the tree over the current data (the top of the tree is split by one thread, the subtrees below in parallel)
+template<typename T, int dimension>
+void KDTree<T, dimension>::build(T* inp_data, unsigned int inp_N)
+{
+    data = inp_data;
+    N = inp_N;
+    if(N == 0) { nodes.clear(); return; }
+    nodes.resize(2 * N - 1);
+    perm.resize(N);
+    for(unsigned int n = 0; n < N; n++) perm[n] = n;
+
+    #pragma omp parallel
+    #pragma omp single
+    buildNode(0, 0, N);
+}
+
+// The nodes do not follow the points, so the tree is always rebuilt (returns false, as SPTree::refit does when it rebuilds)
+template<typename T, int dimension>
+bool KDTree<T, dimension>::refit(T* inp_data, unsigned int inp_N, double /*max_moved_fraction*/)
+{
+    build(inp_data, inp_N);
+    return false;
+}
+
+
+// Builds the subtree of the points perm[start, end) at the given node; its 2 * (end - start) - 1 nodes follow in
+// depth-first order, so the two halves can be built independently
+template<typename T, int dimension>
+void KDTree<T, dimension>::buildNode(unsigned int node, unsigned int start, unsigned int end)
+{
+    unsigned int size = end - start;
+    Node& current = nodes[node];
+    current.cum_size = size;
+    current.skip = node + 2 * size - 1;
+    if(size == 1) {
+        current.index = perm[start];
+        for(int d = 0; d < dimension; d++) current.center_of_mass[d] = data[perm[start] * dimension + d];
+        current.max_width = .0;
+        return;
+    }
+    current.index = N;
+
+    // Split at the median of the longest side of the bounding box
+    T min_Y[dimension], max_Y[dimension];
+    for(int d = 0; d < dimension; d++) { min_Y[d] = numeric_limits<T>::max(); max_Y[d] = -numeric_limits<T>::max(); }
+    for(unsigned int i = start; i < end; i++) {
+        const T* point = data + perm[i] * dimension;
+        for(int d = 0; d < dimension; d++) {
+            if(point[d] < min_Y[d]) min_Y[d] = point[d];
+            if(point[d] > max_Y[d]) max_Y[d] = point[d];
+        }
+    }
+    int split = 0;
+    for(int d = 1; d < dimension; d++) {
+        if(max_Y[d] - min_Y[d] > max_Y[split] - min_Y[split]) split = d;
+    }
+    current.max_width = (T) .5 * (max_Y[split] - min_Y[split]);
+    unsigned int middle = start + size / 2;
+    nth_element(perm.begin() + start, perm.begin() + middle, perm.begin() + end, CoordinateLess<T, dimension>(data, split));
+
+    // Build both halves, and combine their centers of mass
+    unsigned int left = node + 1, right = node + 2 * (middle - start);
+    if(size >= TASK_SIZE) {
+        #pragma omp task
+        buildNode(left, start, middle);
+        buildNode(right, middle, end);
+        #pragma omp taskwait
+    }
+    else {
+        buildNode(left, start, middle);
+        buildNode(right, middle, end);
+    }
+    for(int d = 0; d < dimension; d++) {
+        current.center_of_mass[d] = (T) (((double) nodes[left].cum_size * nodes[left].center_of_mass[d] +
+                                          (double) nodes[right].cum_size * nodes[right].center_of_mass[d]) / size);
+    }
+}
+
+
+template<typename T, int dimension>
+unsigned int KDTree<T, dimension>::getNodeCount() const
+{
+    return (unsigned int) nodes.size();
+}
+
+// The depth of the tree (the median splits keep it at about log2(N))
+template<typename T, int dimension>
+unsigned int KDTree<T, dimension>::getDepth() const
+{
+    unsigned int depth = 0;
+    for(unsigned int size = N; size > 1; size = (size + 1) / 2) depth++;
+    return depth + 1;
+}
+
+
+// Compute non-edge forces on a point of the tree (returns its contribution to the normalization term)
+template<typename T, int dimension>
+double KDTree<T, dimension>::computeNonEdgeForces(unsigned int point_index, T theta, T neg_f[]) const
+{
+    return computePointForces(data + point_index * dimension, point_index, theta, neg_f);
+}
+
+// Compute non-edge forces on a point that is not in the tree (such as a new point placed into a fixed map)
+template<typename T, int dimension>
+double KDTree<T, dimension>::computeNonEdgeForces(const T* point, T theta, T neg_f[]) const
+{
+    return computePointForces(point, N, theta, neg_f);
+}
+
+// Compute non-edge forces on all points (returns the normalization term); the points are visited in the order of the
+// leaves, so neighboring threads walk similar parts of the tree
+template<typename T, int dimension>
+double KDTree<T, dimension>::computeNonEdgeForces(T theta, T neg_f[])
+{
+    double sum_Q = .0;
+    #pragma omp parallel for schedule(guided) reduction(+:sum_Q)
+    for(int i = 0; i < (int) N; i++) {
+        unsigned int n = perm[i];
+        sum_Q += computePointForces(data + n * dimension, n, theta, neg_f + n * dimension);
+    }
+    return sum_Q;
+}
+
+
+// Walks the tree for a single point, skipping the leaf of point_index (N for points outside the tree)
+template<typename T, int dimension>
+double KDTree<T, dimension>::computePointForces(const T* point, unsigned int point_index, T theta, T neg_f[]) const
+{
+    double resultSum = .0;
+    T localbuff[dimension];
+    const unsigned int no_nodes = (unsigned int) nodes.size();
+    T theta_sq = theta * theta;
+
+    // Walk the nodes in depth-first order; accepting a node as a summary skips its subtree
+    unsigned int i = 0;
+    while(i < no_nodes) {
+        const Node& node = nodes[i];
+        bool is_leaf = (node.skip == i + 1);
+
+        // Make sure that we spend no time on self-interactions
+        if(is_leaf && node.index == point_index) { i = node.skip; continue; }
+
+        // Compute distance between point and center-of-mass
+        T D = .0;
+        for(int d = 0; d < dimension; d++) localbuff[d] = point[d] - node.center_of_mass[d];
+        for(int d = 0; d < dimension; d++) D += localbuff[d] * localbuff[d];
+
+        // Check whether we can use this node as a "summary"
+        if(is_leaf || node.max_width * node.max_width < theta_sq * D) {
+
+            // Compute and add t-SNE force between point and current node
+            D = 1 / (1 + D);
+            T mult = node.cum_size * D;
+            resultSum += mult;
+            mult *= D;
+            for(int d = 0; d < dimension; d++) neg_f[d] += mult * localbuff[d];
+            i = node.skip;
+        }
+        else i++;
+    }
+    return resultSum;
+}
@@ -0,0 +1,87 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#ifndef KDTREE_H
+#define KDTREE_H
+
+#include <vector>
+
+using namespace std;
+
+
+// Space-partitioning tree for the repulsive forces of maps with more than three dimensions: every node splits its
+// points at the median of the longest side of their bounding box, so the tree has 2N - 1 nodes whatever the
+// dimensionality (an SPTree node has 2^dimension children). Offers the forces of SPTree on single points; the
+// incremental refit and the dual-tree traversal are not available, and fall back to a rebuild and a pass over all points.
+template<typename T, int dimension>
+class KDTree
+{
+
+    // A single node of the tree, in depth-first order as in SPTree
+    struct Node {
+        T center_of_mass[dimension];
+        T max_width;                                // half the longest side of the bounding box (SPTree cells also store half-widths)
+        unsigned int cum_size;
+        unsigned int skip;                          // first node after this subtree (own index + 1 for leaves)
+        unsigned int index;                         // point stored in a leaf
+    };
+
+    // Subtrees of at least this many points are built as separate tasks
+    static const unsigned int TASK_SIZE = 4096;
+
+    // Data underlying this tree
+    T* data;
+    unsigned int N;
+
+    // All nodes of the tree, and the points in the order of the leaves (both reused by subsequent builds)
+    vector<Node> nodes;
+    vector<unsigned int> perm;
+
+public:
+    KDTree();
+    KDTree(T* inp_data, unsigned int N);
+    void build(T* inp_data, unsigned int N);
+    bool refit(T* inp_data, unsigned int N, double max_moved_fraction);
+    unsigned int getNodeCount() const;
+    unsigned int getDepth() const;
+    double computeNonEdgeForces(unsigned int point_index, T theta, T neg_f[]) const;
+    double computeNonEdgeForces(const T* point, T theta, T neg_f[]) const;
+    double computeNonEdgeForces(T theta, T neg_f[]);
+
+private:
+    void buildNode(unsigned int node, unsigned int start, unsigned int end);
+    double computePointForces(const T* point, unsigned int point_index, T theta, T neg_f[]) const;
+};
+
+#endif
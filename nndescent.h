@@ -0,0 +1,328 @@
+/*
+ *
+ * Copyright (c) 2014, Laurens van der Maaten (Delft University of Technology)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. All advertising materials mentioning features or use of this software
+ *    must display the following acknowledgement:
+ *    This product includes software developed by the Delft University of Technology.
+ * 4. Neither the name of the Delft University of Technology nor the names of
+ *    its contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY LAURENS VAN DER MAATEN ''AS IS'' AND ANY EXPRESS
+ * OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO
+ * EVENT SHALL LAURENS VAN DER MAATEN BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ */
+
+
+
+#ifndef NNDESCENT_H
+#define NNDESCENT_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+// Approximate k-nearest-neighbor graph over the row indices of a data set. Random-projection trees give the initial
+// neighbors, which NN-descent then refines by comparing the neighbors of neighbors. Like VpTree, it only asks the
+// Distance functor for squared distances between rows.
+template<typename T, typename Distance>
+class NNDescent
+{
+public:
+
+    // Constructor (the distance functor refers to the caller's data, which must outlive the graph)
+    NNDescent(const Distance& distance) : _distance(distance), _N(0), _K(0) {}
+
+    // Builds the graph of the K nearest neighbors of rows 0..N-1 (more trees and iterations give a higher recall)
+    void create(int N, int K, int trees, int iterations, unsigned int seed)
+    {
+        _N = N;
+        _K = K;
+        _heap.assign((size_t) N * K, Entry());
+        _sizes.assign(N, 0);
+
+        // Random-projection trees: neighbors within the same leaf become the initial candidates
+        int leaf_size = std::max(K + 1, 32);
+        std::vector<std::vector<int> > items(trees);
+        std::vector<std::vector<std::pair<int, int> > > leaves(trees);
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(int t = 0; t < trees; t++) {
+            unsigned int state = seed + 0x9E3779B9u * (t + 1);
+            buildLeaves(items[t], leaves[t], leaf_size, state);
+        }
+        for(int t = 0; t < trees; t++) {
+            const std::vector<int>& tree_items = items[t];
+            const std::vector<std::pair<int, int> >& tree_leaves = leaves[t];
+
+            // The leaves of one tree are disjoint, so they can update their heaps in parallel
+            #pragma omp parallel for schedule(dynamic, 16)
+            for(int l = 0; l < (int) tree_leaves.size(); l++) {
+                for(int i = tree_leaves[l].first; i < tree_leaves[l].second; i++) {
+                    for(int j = i + 1; j < tree_leaves[l].second; j++) {
+                        T dist = _distance(tree_items[i], tree_items[j]);
+                        push(tree_items[i], tree_items[j], dist);
+                        push(tree_items[j], tree_items[i], dist);
+                    }
+                }
+            }
+            std::vector<int>().swap(items[t]);
+        }
+
+        // Points that ended up in small leaves start out with random neighbors
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for(int n = 0; n < N; n++) {
+            unsigned int state = seed ^ (0x85EBCA6Bu * (n + 1));
+            for(int attempt = 0; _sizes[n] < std::min(K, N - 1) && attempt < 4 * K; attempt++) {
+                int m = (int) (nextRandom(state) % N);
+                if(m != n) push(n, m, _distance(n, m));
+            }
+            for(int m = 0; _sizes[n] < std::min(K, N - 1) && m < N; m++) {
+                if(m != n) push(n, m, _distance(n, m));
+            }
+        }
+
+        // NN-descent: refine until an iteration changes (almost) nothing
+        for(int iter = 0; iter < iterations; iter++) {
+            if(refine(seed + iter) <= 0.001 * N * K) break;
+        }
+    }
+
+    // Copies the neighbors of row n (sorted by increasing squared distance) to buffers of size K, and returns how many
+    // neighbors there are (K unless the data set is too small)
+    int getNeighbors(int n, int* indices, T* distances) const
+    {
+        int size = _sizes[n];
+        std::vector<Entry> entries(_heap.begin() + (size_t) n * _K, _heap.begin() + (size_t) n * _K + size);
+        std::sort(entries.begin(), entries.end());
+        for(int k = 0; k < size; k++) {
+            indices[k] = entries[k].index;
+            distances[k] = entries[k].dist;
+        }
+        return size;
+    }
+
+private:
+    Distance _distance;
+    int _N, _K;
+
+    // One neighbor in the heap of a point (is_new marks neighbors that did not take part in a local join yet)
+    struct Entry
+    {
+        T dist;
+        int index;
+        unsigned char is_new;
+
+        Entry() : dist(std::numeric_limits<T>::max()), index(-1), is_new(0) {}
+        bool operator<(const Entry& o) const { return dist < o.dist || (dist == o.dist && index < o.index); }
+    };
+
+    // A candidate neighbor found by a local join, to be added to the heap of target
+    struct Update
+    {
+        int target, index;
+        T dist;
+        Update(int target, int index, T dist) : target(target), index(index), dist(dist) {}
+    };
+
+    std::vector<Entry> _heap;           // N max-heaps of K entries on the distances
+    std::vector<int> _sizes;
+
+    static unsigned int nextRandom(unsigned int& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    static int getThreads()
+    {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    // Largest distance in the heap of point n (or infinity while the heap is not full)
+    T getWorst(int n) const
+    {
+        return (_sizes[n] < _K) ? std::numeric_limits<T>::max() : _heap[(size_t) n * _K].dist;
+    }
+
+    // Adds m to the heap of n unless it is already there or farther than all current neighbors; returns whether it was added
+    bool push(int n, int m, T dist)
+    {
+        Entry* heap = &_heap[(size_t) n * _K];
+        int& size = _sizes[n];
+        if(size == _K && dist >= heap[0].dist) return false;
+        for(int k = 0; k < size; k++) {
+            if(heap[k].index == m) return false;
+        }
+        Entry entry;
+        entry.dist = dist;
+        entry.index = m;
+        entry.is_new = 1;
+
+        // Sift up a new entry, or sift down the entry that replaces the farthest neighbor
+        int i;
+        if(size < _K) {
+            i = size++;
+            while(i > 0 && heap[(i - 1) / 2].dist < dist) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+            }
+        }
+        else {
+            i = 0;
+            while(true) {
+                int largest = 2 * i + 1;
+                if(largest >= size) break;
+                if(largest + 1 < size && heap[largest + 1].dist > heap[largest].dist) largest++;
+                if(heap[largest].dist <= dist) break;
+                heap[i] = heap[largest];
+                i = largest;
+            }
+        }
+        heap[i] = entry;
+        return true;
+    }
+
+    // Splits the points recursively at the perpendicular bisector of two random points, and records the leaves
+    void buildLeaves(std::vector<int>& items, std::vector<std::pair<int, int> >& leaves, int leaf_size, unsigned int& state) const
+    {
+        items.resize(_N);
+        for(int n = 0; n < _N; n++) items[n] = n;
+        std::vector<std::pair<int, int> > stack(1, std::pair<int, int>(0, _N));
+        while(!stack.empty()) {
+            int lower = stack.back().first, upper = stack.back().second;
+            stack.pop_back();
+            if(upper - lower <= leaf_size) {
+                leaves.push_back(std::pair<int, int>(lower, upper));
+                continue;
+            }
+
+            // Choose two different points and move the points that are closer to the first one to the front
+            int a = items[lower + nextRandom(state) % (upper - lower)];
+            int b = items[lower + nextRandom(state) % (upper - lower)];
+            int middle = lower;
+            if(a != b) {
+                for(int i = lower; i < upper; i++) {
+                    T dist_a = _distance(items[i], a);
+                    T dist_b = _distance(items[i], b);
+                    if(dist_a < dist_b || (dist_a == dist_b && (nextRandom(state) & 1))) std::swap(items[i], items[middle++]);
+                }
+            }
+
+            // Split duplicates (or an unlucky choice) in the middle instead
+            if(middle == lower || middle == upper) middle = (lower + upper) / 2;
+            stack.push_back(std::pair<int, int>(lower, middle));
+            stack.push_back(std::pair<int, int>(middle, upper));
+        }
+    }
+
+    // Adds a candidate to a fixed-size list, replacing earlier ones at random once it is full; returns whether it was kept
+    static bool addCandidate(int* list, int& count, int& seen, int max_candidates, int candidate, unsigned int& state)
+    {
+        seen++;
+        if(count < max_candidates) { list[count++] = candidate; return true; }
+        int slot = (int) (nextRandom(state) % seen);
+        if(slot < max_candidates) { list[slot] = candidate; return true; }
+        return false;
+    }
+
+    // Runs one iteration of NN-descent, and returns the number of changes to the heaps
+    long refine(unsigned int seed)
+    {
+        const int max_candidates = std::min(_K, 15);
+        unsigned int state = seed * 0x27D4EB2Fu + 1;
+
+        // Collect the new and old neighbors of every point, including reverse neighbors
+        std::vector<int> new_list((size_t) _N * max_candidates), old_list((size_t) _N * max_candidates);
+        std::vector<int> new_count(_N, 0), old_count(_N, 0), new_seen(_N, 0), old_seen(_N, 0);
+        for(int n = 0; n < _N; n++) {
+            Entry* heap = &_heap[(size_t) n * _K];
+            for(int k = 0; k < _sizes[n]; k++) {
+                int m = heap[k].index;
+                if(heap[k].is_new) {
+                    if(addCandidate(&new_list[(size_t) n * max_candidates], new_count[n], new_seen[n], max_candidates, m, state)) heap[k].is_new = 0;
+                    addCandidate(&new_list[(size_t) m * max_candidates], new_count[m], new_seen[m], max_candidates, n, state);
+                }
+                else {
+                    addCandidate(&old_list[(size_t) n * max_candidates], old_count[n], old_seen[n], max_candidates, m, state);
+                    addCandidate(&old_list[(size_t) m * max_candidates], old_count[m], old_seen[m], max_candidates, n, state);
+                }
+            }
+        }
+
+        // Local joins: compare new candidates with each other and with the old ones. The points are processed in
+        // batches, in which every thread files its updates by target first, so the heaps can be updated without locks.
+        const int threads = getThreads();
+        const int batch_size = 256 * threads;
+        std::vector<std::vector<Update> > updates((size_t) threads * threads);
+        long changes = 0;
+        for(int first = 0; first < _N; first += batch_size) {
+            int last = std::min(first + batch_size, _N);
+            #pragma omp parallel
+            {
+#ifdef _OPENMP
+                int thread = omp_get_thread_num();
+#else
+                int thread = 0;
+#endif
+                #pragma omp for schedule(dynamic, 16)
+                for(int n = first; n < last; n++) {
+                    const int* new_n = &new_list[(size_t) n * max_candidates];
+                    const int* old_n = &old_list[(size_t) n * max_candidates];
+                    for(int i = 0; i < new_count[n]; i++) {
+                        int u = new_n[i];
+                        for(int j = 0; j < new_count[n] + old_count[n]; j++) {
+                            int v = (j < new_count[n]) ? new_n[j] : old_n[j - new_count[n]];
+                            if((j < new_count[n] && j <= i) || u == v) continue;
+                            T dist = _distance(u, v);
+                            if(dist < getWorst(u)) updates[(size_t) thread * threads + u % threads].push_back(Update(u, v, dist));
+                            if(dist < getWorst(v)) updates[(size_t) thread * threads + v % threads].push_back(Update(v, u, dist));
+                        }
+                    }
+                }
+            }
+
+            // Apply the updates (every thread owns the targets in one residue class)
+            #pragma omp parallel for schedule(static, 1) reduction(+:changes)
+            for(int target_class = 0; target_class < threads; target_class++) {
+                for(int thread = 0; thread < threads; thread++) {
+                    std::vector<Update>& list = updates[(size_t) thread * threads + target_class];
+                    for(size_t i = 0; i < list.size(); i++) changes += push(list[i].target, list[i].index, list[i].dist);
+                    list.clear();
+                }
+            }
+        }
+        return changes;
+    }
+};
+
+#endif
@@ -35,8 +35,26 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <limits>
 #include "sptree.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+
+// Number of threads that parallel regions will use
+static inline int getThreadCount()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
 
 
 // Constructs cell
@@ -49,13 +67,6 @@ Cell<T, dimension>::Cell(T* inp_corner, T* inp_width) {
     for(int d = 0; d < dimension; d++) setWidth( d,  inp_width[d]);
 }
 
-// Destructs cell
-
-template<typename T, int dimension>
-Cell<T, dimension>::~Cell() {
-}
-
-
 template<typename T, int dimension>
 T Cell<T, dimension>::getCorner(unsigned int d)  const{
     return corner[d];
@@ -87,206 +98,668 @@ bool Cell<T, dimension>::containsPoint(T point[]) const
     return true;
 }
 
+// Checks whether a point lies in a cell that is enlarged by the given fraction of its width on every side
+template<typename T, int dimension>
+bool Cell<T, dimension>::containsPoint(T point[], T slack) const
+{
+    for(int d = 0; d < dimension; d++) {
+        if(corner[d] - (1 + slack) * width[d] > point[d]) return false;
+        if(corner[d] + (1 + slack) * width[d] < point[d]) return false;
+    }
+    return true;
+}
+
+
+// Default constructor for SPTree (the tree is empty until build() is called)
+template<typename T, int dimension>
+SPTree<T, dimension>::SPTree()
+{
+    init();
+}
+
 
-// Default constructor for SPTree -- build tree, too!
+// Constructor for SPTree -- build tree, too!
 template<typename T, int dimension>
 SPTree<T, dimension>::SPTree(T* inp_data, unsigned int N)
 {
-    unsigned int D = dimension;
-    // Compute mean, width, and height of current map (boundaries of SPTree)
-    int nD = 0;
-    T mean_Y[dimension], min_Y[dimension], max_Y[dimension];
+    init();
+    build(inp_data, N);
+}
 
-    for(unsigned int d = 0; d < D; d++)  min_Y[d] =  DBL_MAX;
-    for(unsigned int d = 0; d < D; d++)  max_Y[d] = -DBL_MAX;
 
-    for(unsigned int n = 0; n < N; n++) {
-        for(unsigned int d = 0; d < D; d++) {
-            mean_Y[d] += inp_data[n * D + d];
-            if(inp_data[nD + d] < min_Y[d]) min_Y[d] = inp_data[nD + d];
-            if(inp_data[nD + d] > max_Y[d]) max_Y[d] = inp_data[nD + d];
-        }
-        nD += D;
-    }
-    for(int d = 0; d < D; d++) mean_Y[d] /= (T) N;
+// Main initialization function
+template<typename T, int dimension>
+void SPTree<T, dimension>::init()
+{
+    data = NULL;
+    N = 0;
+    initArena(tree);
+    initArena(spare);
+    perm = NULL;
+    scratch = NULL;
+    old_perm = NULL;
+    point_capacity = 0;
+}
 
-    // Construct SPTree
-    T width[dimension];
-    for(int d = 0; d < D; d++) width[d] = fmax(max_Y[d] - mean_Y[d], mean_Y[d] - min_Y[d]) + 1e-5;
-    init(NULL, inp_data, mean_Y, width);
-    fill(N);
+
+// Destructor for SPTree
+template<typename T, int dimension>
+SPTree<T, dimension>::~SPTree()
+{
+    freeArena(tree);
+    freeArena(spare);
+    for(unsigned int i = 0; i < task_arenas.size(); i++) freeArena(task_arenas[i]);
+    free(perm);
+    free(scratch);
+    free(old_perm);
 }
 
 
-// Constructor for SPTree with particular size and parent -- build the tree, too!
+// Update the data underlying this tree
 template<typename T, int dimension>
-SPTree<T, dimension>::SPTree(T* inp_data, unsigned int N, T* inp_corner, T* inp_width)
+void SPTree<T, dimension>::setData(T* inp_data)
 {
-    init(NULL, inp_data, inp_corner, inp_width);
-    fill(N);
+    data = inp_data;
 }
 
 
-// Constructor for SPTree with particular size (do not fill the tree)
 template<typename T, int dimension>
-SPTree<T, dimension>::SPTree(T* inp_data, T* inp_corner, T* inp_width)
+void SPTree<T, dimension>::initArena(NodeArena& arena)
 {
-    init(NULL, inp_data, inp_corner, inp_width);
+    arena.nodes = NULL;
+    arena.boundary = NULL;
+    arena.begin = NULL;
+    arena.size = 0;
+    arena.capacity = 0;
 }
 
 
-// Constructor for SPTree with particular size and parent (do not fill tree)
 template<typename T, int dimension>
-SPTree<T, dimension>::SPTree(SPTree<T, dimension>* inp_parent, T* inp_data, T* inp_corner, T* inp_width) {
-    init(inp_parent, inp_data, inp_corner, inp_width);
+void SPTree<T, dimension>::freeArena(NodeArena& arena)
+{
+    free(arena.nodes);
+    free(arena.boundary);
+    free(arena.begin);
+    initArena(arena);
 }
 
 
-// Constructor for SPTree with particular size and parent -- build the tree, too!
+// Make sure an arena can hold at least the specified number of nodes
 template<typename T, int dimension>
-SPTree<T, dimension>::SPTree(SPTree<T, dimension>* inp_parent, T* inp_data, unsigned int N, T* inp_corner, T* inp_width)
+void SPTree<T, dimension>::reserveNodes(NodeArena& arena, unsigned int size)
 {
-    init(inp_parent, inp_data, inp_corner, inp_width);
-    fill(N);
+    if(size <= arena.capacity) return;
+    unsigned int new_capacity = (arena.capacity > 0) ? arena.capacity : 64;
+    while(new_capacity < size) new_capacity *= 2;
+    arena.nodes    = (Node*) realloc(arena.nodes, new_capacity * sizeof(Node));
+    arena.boundary = (Cell<T, dimension>*) realloc(arena.boundary, new_capacity * sizeof(Cell<T, dimension>));
+    arena.begin    = (unsigned int*) realloc(arena.begin, new_capacity * sizeof(unsigned int));
+    if(arena.nodes == NULL || arena.boundary == NULL || arena.begin == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    arena.capacity = new_capacity;
 }
 
 
-// Main initialization function
+// Make sure the point permutation can hold the specified number of points
 template<typename T, int dimension>
-void SPTree<T, dimension>::init(SPTree<T, dimension>* inp_parent, T* inp_data, T* inp_corner, T* inp_width)
+void SPTree<T, dimension>::reservePoints(unsigned int size)
+{
+    if(size <= point_capacity) return;
+    free(perm);
+    free(scratch);
+    free(old_perm);
+    perm     = (unsigned int*) malloc(size * sizeof(unsigned int));
+    scratch  = (unsigned int*) malloc(size * sizeof(unsigned int));
+    old_perm = (unsigned int*) malloc(size * sizeof(unsigned int));
+    if(perm == NULL || scratch == NULL || old_perm == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    point_capacity = size;
+}
+
+
+// Build SPTree on dataset (reuses the memory of any previous build)
+template<typename T, int dimension>
+void SPTree<T, dimension>::build(T* inp_data, unsigned int inp_N, T margin)
 {
-    parent = inp_parent;
-    int D = dimension;
-    no_children = 2;
-    for(unsigned int d = 1; d < D; d++) no_children *= 2;
     data = inp_data;
-    is_leaf = true;
-    size = 0;
-    cum_size = 0;
+    N = inp_N;
+    tree.size = 0;
+    if(N == 0) return;
+
+    // Compute mean, width, and height of current map (boundaries of SPTree), in parallel over chunks of points
+    const int no_chunks = getThreadCount();
+    const unsigned int chunk_size = (N + no_chunks - 1) / no_chunks;
+    T* chunk_stats = (T*) malloc(no_chunks * 3 * dimension * sizeof(T));
+    if(chunk_stats == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < no_chunks; c++) {
+        T* sum_Y = chunk_stats + c * 3 * dimension;
+        T* min_Y = sum_Y + dimension;
+        T* max_Y = min_Y + dimension;
+        for(unsigned int d = 0; d < dimension; d++) sum_Y[d] = .0;
+        for(unsigned int d = 0; d < dimension; d++) min_Y[d] =  numeric_limits<T>::max();
+        for(unsigned int d = 0; d < dimension; d++) max_Y[d] = -numeric_limits<T>::max();
+        unsigned int end = (c + 1) * chunk_size < N ? (c + 1) * chunk_size : N;
+        for(unsigned int n = c * chunk_size; n < end; n++) {
+            const T* point = data + n * dimension;
+            for(unsigned int d = 0; d < dimension; d++) {
+                sum_Y[d] += point[d];
+                if(point[d] < min_Y[d]) min_Y[d] = point[d];
+                if(point[d] > max_Y[d]) max_Y[d] = point[d];
+            }
+        }
+    }
+    T mean_Y[dimension], min_Y[dimension], max_Y[dimension];
+    for(unsigned int d = 0; d < dimension; d++) mean_Y[d] = .0;
+    for(unsigned int d = 0; d < dimension; d++)  min_Y[d] =  numeric_limits<T>::max();
+    for(unsigned int d = 0; d < dimension; d++)  max_Y[d] = -numeric_limits<T>::max();
+    for(int c = 0; c < no_chunks; c++) {
+        const T* stats = chunk_stats + c * 3 * dimension;
+        for(unsigned int d = 0; d < dimension; d++) {
+            mean_Y[d] += stats[d];
+            if(stats[dimension + d] < min_Y[d]) min_Y[d] = stats[dimension + d];
+            if(stats[2 * dimension + d] > max_Y[d]) max_Y[d] = stats[2 * dimension + d];
+        }
+    }
+    for(unsigned int d = 0; d < dimension; d++) mean_Y[d] /= (T) N;
+    free(chunk_stats);
 
-    for(unsigned int d = 0; d < D; d++) boundary.setCorner(d, inp_corner[d]);
-    for(unsigned int d = 0; d < D; d++) boundary.setWidth( d, inp_width[d]);
+    // Construct SPTree
+    T width[dimension];
+    T max_width = .0;
+    for(unsigned int d = 0; d < dimension; d++) {
+        width[d] = margin * (max<T>(max_Y[d] - mean_Y[d], mean_Y[d] - min_Y[d]) + (T) 1e-5);
+        max_width = (max_width > width[d]) ? max_width : width[d];
+    }
+    reservePoints(N);
+    #pragma omp parallel for schedule(static)
+    for(int n = 0; n < (int) N; n++) perm[n] = n;
+    Cell<T, dimension> root(mean_Y, width);
+
+    // Small trees (or a single thread) are built directly
+    const unsigned int task_size = N / (8 * no_chunks);
+    if(no_chunks == 1 || task_size < 1024) {
+        reserveNodes(tree, 2 * N + 1);
+        buildNode(tree, root, max_width, 0, N);
+        return;
+    }
+
+    // Split the top of the tree in parallel until the remaining subtrees are small enough to be built as independent tasks
+    plan.clear();
+    planNode(root, max_width, 0, N, task_size);
+    assemble();
+}
 
-    children = (SPTree<T, dimension>**) malloc(no_children * sizeof(SPTree<T, dimension>*));
-    for(unsigned int i = 0; i < no_children; i++) children[i] = NULL;
 
-    for(unsigned int d = 0; d < D; d++) center_of_mass[d] = .0;
+// Updates the tree after the data has moved, keeping the cells of the previous build: points that strayed too far
+// from their leaf are re-inserted and the centers of mass are recomputed bottom-up. Points may stay up to half a leaf
+// width outside their leaf cell; since that slack halves relative to the cell size with every level up the tree, the
+// opening criterion is left as is. Falls back to a full build (and returns false) if more than the given fraction of
+// the points has to be re-inserted, or if a point left the root cell.
+template<typename T, int dimension>
+bool SPTree<T, dimension>::refit(T* inp_data, unsigned int inp_N, double max_moved_fraction)
+{
+    const T slack = .5;                 // points may stray this fraction of their leaf's width before they are re-inserted
+    const T margin = 1.1;               // headroom of the root cell when the tree is rebuilt, so the growing map stays inside
+    if(tree.size == 0 || inp_N != N || max_moved_fraction <= .0) {
+        build(inp_data, inp_N, margin);
+        return false;
+    }
+    data = inp_data;
+
+    // Find the points that left their leaf; leaves whose duplicates drifted apart give up all their points
+    point_moved.assign(N, 0);
+    unsigned int no_moved = 0;
+    #pragma omp parallel for schedule(static) reduction(+:no_moved)
+    for(int i = 0; i < (int) tree.size; i++) {
+        if(tree.nodes[i].skip != (unsigned int) i + 1) continue;
+        unsigned int start = tree.begin[i];
+        unsigned int end = start + tree.nodes[i].cum_size;
+        bool split = (end - start > 1 && !isDuplicateRange(start, end));
+        for(unsigned int n = start; n < end; n++) {
+            if(split || !tree.boundary[i].containsPoint(data + perm[n] * dimension, slack)) {
+                point_moved[perm[n]] = 1;
+                no_moved++;
+            }
+        }
+    }
+    if((double) no_moved > max_moved_fraction * (double) N) {
+        build(inp_data, inp_N, margin);
+        return false;
+    }
 
+    if(no_moved > 0) {
+
+        // Remove the moved points from their old paths
+        new_cum_size.resize(tree.size);
+        for(unsigned int i = 0; i < tree.size; i++) new_cum_size[i] = tree.nodes[i].cum_size;
+        touched.assign(tree.size, 0);
+        for(unsigned int i = 0; i < tree.size; i++) {
+            if(tree.nodes[i].skip != i + 1) continue;
+            unsigned int removed = 0;
+            for(unsigned int n = tree.begin[i]; n < tree.begin[i] + tree.nodes[i].cum_size; n++) removed += point_moved[perm[n]];
+            if(removed == 0) continue;
+            for(unsigned int node = 0; ; node = findChild(node, i)) {
+                new_cum_size[node] -= removed;
+                touched[node] = 1;
+                if(node == i) break;
+            }
+        }
+
+        // Find where the moved points go in the remaining tree
+        insertions.clear();
+        for(unsigned int n = 0; n < N; n++) {
+            if(point_moved[n] && !scheduleInsertion(n)) {
+                build(inp_data, inp_N, margin);
+                return false;
+            }
+        }
+        sort(insertions.begin(), insertions.end());
+
+        // Lay out the updated tree (untouched subtrees are copied as a block)
+        swap(perm, old_perm);
+        spare.size = 0;
+        reserveNodes(spare, tree.size + 2 * no_moved);
+        unsigned int pos = 0;
+        relayoutNode(0, pos);
+        swap(tree, spare);
+    }
+
+    refitCenters();
+    return true;
 }
 
 
-// Destructor for SPTree
+// Returns the octant of the parent that a child occupies
 template<typename T, int dimension>
-SPTree<T, dimension>::~SPTree()
+unsigned int SPTree<T, dimension>::getOctant(unsigned int parent, unsigned int child) const
 {
-    for(unsigned int i = 0; i < no_children; i++) {
-        if(children[i] != NULL) delete children[i];
+    T corner[dimension];
+    for(unsigned int d = 0; d < dimension; d++) corner[d] = tree.boundary[child].getCorner(d);
+    return getChildIndex(tree.boundary[parent], corner);
+}
+
+
+// Returns the child of a node whose subtree contains the specified descendant
+template<typename T, int dimension>
+unsigned int SPTree<T, dimension>::findChild(unsigned int node, unsigned int descendant) const
+{
+    unsigned int child = node + 1;
+    while(tree.nodes[child].skip <= descendant) child = tree.nodes[child].skip;
+    return child;
+}
+
+
+// Descends the tree (ignoring nodes that lost all their points) to find where a moved point is re-inserted
+template<typename T, int dimension>
+bool SPTree<T, dimension>::scheduleInsertion(unsigned int point)
+{
+    const unsigned int no_children = 1u << dimension;
+    T* coords = data + point * dimension;
+    if(!tree.boundary[0].containsPoint(coords) || new_cum_size[0] == 0) return false;
+
+    unsigned int node = 0;
+    while(true) {
+        new_cum_size[node]++;
+        touched[node] = 1;
+
+        // Leaves absorb the point and are rebuilt with it
+        if(tree.nodes[node].skip == node + 1) {
+            Insertion insertion = { node, no_children, point };
+            insertions.push_back(insertion);
+            return true;
+        }
+
+        // Descend into the matching child, or create it if it is (or will become) empty
+        unsigned int octant = getChildIndex(tree.boundary[node], coords);
+        unsigned int next = node;
+        for(unsigned int child = node + 1; child < tree.nodes[node].skip; child = tree.nodes[child].skip) {
+            if(new_cum_size[child] > 0 && getOctant(node, child) == octant) { next = child; break; }
+        }
+        if(next == node) {
+            Insertion insertion = { node, octant, point };
+            insertions.push_back(insertion);
+            return true;
+        }
+        node = next;
     }
-    free(children);
 }
 
 
-// Update the data underlying this tree
+// Appends the points of an old leaf that did not move to the new permutation
 template<typename T, int dimension>
-void SPTree<T, dimension>::setData(T* inp_data)
+unsigned int SPTree<T, dimension>::appendRemainingPoints(unsigned int node, unsigned int pos)
 {
-    data = inp_data;
+    for(unsigned int n = tree.begin[node]; n < tree.begin[node] + tree.nodes[node].cum_size; n++) {
+        if(!point_moved[old_perm[n]]) perm[pos++] = old_perm[n];
+    }
+    return pos;
 }
 
 
-// Get the parent of the current tree
+// Returns the first scheduled insertion below the specified node and octant
 template<typename T, int dimension>
-SPTree<T, dimension>* SPTree<T, dimension>::getParent()
+unsigned int SPTree<T, dimension>::findInsertions(unsigned int node, unsigned int octant) const
 {
-    return parent;
+    Insertion key = { node, octant, 0 };
+    return lower_bound(insertions.begin(), insertions.end(), key) - insertions.begin();
 }
 
 
-// Insert a point into the SPTree
+// Copies an old subtree into the spare arena in depth-first order, applying the removals and insertions
 template<typename T, int dimension>
-bool SPTree<T, dimension>::insert(unsigned int new_index)
+void SPTree<T, dimension>::relayoutNode(unsigned int node, unsigned int& pos)
 {
-    // Ignore objects which do not belong in this quad tree
-    T* point = data + new_index * dimension;
-    if(!boundary.containsPoint(point))
-        return false;
+    const unsigned int no_children = 1u << dimension;
+    const Node* nodes = tree.nodes;
+
+    // Untouched subtrees only need their indices shifted
+    if(!touched[node]) {
+        unsigned int count = nodes[node].skip - node;
+        unsigned int offset = spare.size;
+        reserveNodes(spare, spare.size + count);
+        memcpy(spare.nodes + offset, nodes + node, count * sizeof(Node));
+        memcpy(spare.boundary + offset, tree.boundary + node, count * sizeof(Cell<T, dimension>));
+        for(unsigned int i = 0; i < count; i++) {
+            spare.nodes[offset + i].skip = spare.nodes[offset + i].skip - node + offset;
+            spare.begin[offset + i] = tree.begin[node + i] - tree.begin[node] + pos;
+        }
+        memcpy(perm + pos, old_perm + tree.begin[node], nodes[node].cum_size * sizeof(unsigned int));
+        pos += nodes[node].cum_size;
+        spare.size += count;
+        return;
+    }
 
-    // Online update of cumulative size and center-of-mass
-    cum_size++;
-    T mult1 = (T) (cum_size - 1) / (T) cum_size;
-    T mult2 = 1.0 / (T) cum_size;
-    for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] *= mult1;
-    for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] += mult2 * point[d];
+    // Leaves that absorb moved points are rebuilt with them
+    unsigned int cursor = findInsertions(node, no_children);
+    if(cursor < insertions.size() && insertions[cursor].node == node) {
+        unsigned int start = pos;
+        pos = appendRemainingPoints(node, pos);
+        for(; cursor < insertions.size() && insertions[cursor].node == node; cursor++) perm[pos++] = insertions[cursor].point;
+        buildNode(spare, tree.boundary[node], nodes[node].max_width, start, pos);
+        return;
+    }
+
+    // Copy the node itself
+    unsigned int copy = spare.size++;
+    reserveNodes(spare, spare.size);
+    spare.nodes[copy] = nodes[node];
+    spare.boundary[copy] = tree.boundary[node];
+    spare.begin[copy] = pos;
 
-    // If there is space in this quad tree and it is a leaf, add the object here
-    if(is_leaf && size < QT_NODE_CAPACITY) {
-        index[size] = new_index;
-        size++;
-        return true;
+    // Lay out the remaining points or children, merging in new children in octant order
+    if(nodes[node].skip == node + 1) pos = appendRemainingPoints(node, pos);
+    else {
+        unsigned int child = node + 1;
+        for(unsigned int octant = 0; octant < no_children; octant++) {
+            if(child < nodes[node].skip && getOctant(node, child) == octant) {
+                if(new_cum_size[child] > 0) relayoutNode(child, pos);
+                child = nodes[child].skip;
+            }
+            cursor = findInsertions(node, octant);
+            if(cursor < insertions.size() && insertions[cursor].node == node && insertions[cursor].octant == octant) {
+                unsigned int start = pos;
+                for(; cursor < insertions.size() && insertions[cursor].node == node && insertions[cursor].octant == octant; cursor++) {
+                    perm[pos++] = insertions[cursor].point;
+                }
+                buildNode(spare, getChildCell(tree.boundary[node], octant), .5 * nodes[node].max_width, start, pos);
+            }
+        }
     }
+    spare.nodes[copy].cum_size = pos - spare.begin[copy];
+    spare.nodes[copy].index = perm[spare.begin[copy]];
+    spare.nodes[copy].skip = spare.size;
+}
 
-    // Don't add duplicates for now (this is not very nice)
-    bool any_duplicate = false;
-    for(unsigned int n = 0; n < size; n++) {
-        bool duplicate = true;
-        for(unsigned int d = 0; d < dimension; d++) {
-            if(point[d] != data[index[n] * dimension + d]) { duplicate = false; break; }
+
+// Recomputes all centers of mass bottom-up from the current data
+template<typename T, int dimension>
+void SPTree<T, dimension>::refitCenters()
+{
+    Node* nodes = tree.nodes;
+
+    // Leaves hold a single point (or duplicates of it)
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < (int) tree.size; i++) {
+        if(nodes[i].skip != (unsigned int) i + 1) continue;
+        const T* point = data + nodes[i].index * dimension;
+        for(unsigned int d = 0; d < dimension; d++) nodes[i].center_of_mass[d] = point[d];
+    }
+
+    // Children follow their parent, so a reverse sweep sees them first
+    for(int i = (int) tree.size - 1; i >= 0; i--) {
+        if(nodes[i].skip == (unsigned int) i + 1) continue;
+        double center_of_mass[dimension];
+        for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] = .0;
+        for(unsigned int child = i + 1; child < nodes[i].skip; child = nodes[child].skip) {
+            double mult = nodes[child].cum_size;
+            for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] += mult * nodes[child].center_of_mass[d];
         }
-        any_duplicate = any_duplicate | duplicate;
+        for(unsigned int d = 0; d < dimension; d++) nodes[i].center_of_mass[d] = (T) (center_of_mass[d] / nodes[i].cum_size);
     }
-    if(any_duplicate) return true;
+}
 
-    // Otherwise, we need to subdivide the current cell
-    if(is_leaf) subdivide();
 
-    // Find out where the point can be inserted
-    for(unsigned int i = 0; i < no_children; i++) {
-        if(children[i]->insert(new_index)) return true;
+// Returns the child of a cell that a point falls in (bit d is set for the lower half along dimension d)
+template<typename T, int dimension>
+unsigned int SPTree<T, dimension>::getChildIndex(const Cell<T, dimension>& cell, const T* point) const
+{
+    unsigned int child = 0;
+    for(unsigned int d = 0; d < dimension; d++) {
+        if(point[d] < cell.getCorner(d)) child |= (1u << d);
     }
+    return child;
+}
+
 
-    // Otherwise, the point cannot be inserted (this should never happen)
-    return false;
+// Checks whether all points in a range of the permutation coincide
+template<typename T, int dimension>
+bool SPTree<T, dimension>::isDuplicateRange(unsigned int start, unsigned int end) const
+{
+    const T* first = data + perm[start] * dimension;
+    for(unsigned int i = start + 1; i < end; i++) {
+        const T* point = data + perm[i] * dimension;
+        for(unsigned int d = 0; d < dimension; d++) {
+            if(point[d] != first[d]) return false;
+        }
+    }
+    return true;
 }
 
 
-// Create four children which fully divide this cell into four quads of equal area
+// Recursively builds the subtree holding perm[start..end) into an arena and returns the index of its root
 template<typename T, int dimension>
-void SPTree<T, dimension>::subdivide() {
+unsigned int SPTree<T, dimension>::buildNode(NodeArena& arena, const Cell<T, dimension>& cell, T max_width, unsigned int start, unsigned int end)
+{
+    const unsigned int no_children = 1u << dimension;
+
+    // Append the node (the arrays may move, so only refer to it by index)
+    unsigned int node = arena.size++;
+    reserveNodes(arena, arena.size);
+    arena.boundary[node] = cell;
+    arena.begin[node] = start;
+    arena.nodes[node].max_width = max_width;
+    arena.nodes[node].cum_size = end - start;
+    arena.nodes[node].index = perm[start];
+
+    double center_of_mass[dimension];                // accumulated in double, so large nodes keep float maps accurate
+    for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] = .0;
+
+    // Leaves hold a single point (or a set of duplicates, which we do not split)
+    if(end - start == 1 || isDuplicateRange(start, end)) {
+        for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] = data[perm[start] * dimension + d];
+    }
+    else {
+
+        // Stable counting sort of the points over the children
+        unsigned int offset[(1u << dimension) + 1];
+        for(unsigned int i = 0; i <= no_children; i++) offset[i] = 0;
+        for(unsigned int i = start; i < end; i++) offset[getChildIndex(cell, data + perm[i] * dimension) + 1]++;
+        for(unsigned int i = 0; i < no_children; i++) offset[i + 1] += offset[i];
+        unsigned int fill[(1u << dimension)];
+        for(unsigned int i = 0; i < no_children; i++) fill[i] = start + offset[i];
+        for(unsigned int i = start; i < end; i++) scratch[fill[getChildIndex(cell, data + perm[i] * dimension)]++] = perm[i];
+        for(unsigned int i = start; i < end; i++) perm[i] = scratch[i];
+
+        // Recursively build the non-empty children, in the same order as they were always visited
+        for(unsigned int i = 0; i < no_children; i++) {
+            if(offset[i] == offset[i + 1]) continue;
+            unsigned int child = buildNode(arena, getChildCell(cell, i), .5 * max_width, start + offset[i], start + offset[i + 1]);
+            double mult = arena.nodes[child].cum_size;
+            for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] += mult * arena.nodes[child].center_of_mass[d];
+        }
+        for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] /= (double) (end - start);
+    }
+
+    for(unsigned int d = 0; d < dimension; d++) arena.nodes[node].center_of_mass[d] = (T) center_of_mass[d];
+    arena.nodes[node].skip = arena.size;
+    return node;
+}
+
 
-    // Create new children
+// Returns the cell of the specified child
+template<typename T, int dimension>
+Cell<T, dimension> SPTree<T, dimension>::getChildCell(const Cell<T, dimension>& cell, unsigned int child) const
+{
     T new_corner[dimension];
     T new_width[dimension];
+    for(unsigned int d = 0; d < dimension; d++) {
+        new_width[d] = .5 * cell.getWidth(d);
+        if((child >> d) & 1) new_corner[d] = cell.getCorner(d) - .5 * cell.getWidth(d);
+        else                 new_corner[d] = cell.getCorner(d) + .5 * cell.getWidth(d);
+    }
+    return Cell<T, dimension>(new_corner, new_width);
+}
+
+
+// Stable counting sort of perm[start..end) over the children of a cell, in parallel over chunks of points
+template<typename T, int dimension>
+void SPTree<T, dimension>::partition(const Cell<T, dimension>& cell, unsigned int start, unsigned int end, unsigned int* child_offset)
+{
+    const unsigned int no_children = 1u << dimension;
+    const int no_chunks = getThreadCount();
+    const unsigned int chunk_size = (end - start + no_chunks - 1) / no_chunks;
+    chunk_offsets.assign(no_chunks * no_children, 0);
+    unsigned int* offsets = &chunk_offsets[0];
+
+    // Count the points per chunk and child
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < no_chunks; c++) {
+        unsigned int chunk_end = start + (c + 1) * chunk_size < end ? start + (c + 1) * chunk_size : end;
+        for(unsigned int i = start + c * chunk_size; i < chunk_end; i++) {
+            offsets[c * no_children + getChildIndex(cell, data + perm[i] * dimension)]++;
+        }
+    }
+
+    // Turn the counts into scatter offsets (children first, then chunks, which keeps the sort stable)
+    unsigned int pos = start;
     for(unsigned int i = 0; i < no_children; i++) {
-        unsigned int div = 1;
-        for(unsigned int d = 0; d < dimension; d++) {
-            new_width[d] = .5 * boundary.getWidth(d);
-            if((i / div) % 2 == 1) new_corner[d] = boundary.getCorner(d) - .5 * boundary.getWidth(d);
-            else                   new_corner[d] = boundary.getCorner(d) + .5 * boundary.getWidth(d);
-            div *= 2;
+        child_offset[i] = pos - start;
+        for(int c = 0; c < no_chunks; c++) {
+            unsigned int count = offsets[c * no_children + i];
+            offsets[c * no_children + i] = pos;
+            pos += count;
         }
-        children[i] = new SPTree<T, dimension>(this, data, new_corner, new_width);
     }
+    child_offset[no_children] = end - start;
 
-    // Move existing points to correct children
-    for(unsigned int i = 0; i < size; i++) {
-        bool success = false;
-        for(unsigned int j = 0; j < no_children; j++) {
-            if(!success) success = children[j]->insert(index[i]);
+    // Scatter the points and copy them back
+    #pragma omp parallel for schedule(static)
+    for(int c = 0; c < no_chunks; c++) {
+        unsigned int chunk_end = start + (c + 1) * chunk_size < end ? start + (c + 1) * chunk_size : end;
+        for(unsigned int i = start + c * chunk_size; i < chunk_end; i++) {
+            scratch[offsets[c * no_children + getChildIndex(cell, data + perm[i] * dimension)]++] = perm[i];
         }
-        index[i] = -1;
     }
+    #pragma omp parallel for schedule(static)
+    for(int i = (int) start; i < (int) end; i++) perm[i] = scratch[i];
+}
 
-    // Empty parent node
-    size = 0;
-    is_leaf = false;
+
+// Splits the top levels of the tree and records them, followed by the subtrees that remain to be built, in depth-first order
+template<typename T, int dimension>
+void SPTree<T, dimension>::planNode(const Cell<T, dimension>& cell, T max_width, unsigned int start, unsigned int end, unsigned int task_size)
+{
+    const unsigned int no_children = 1u << dimension;
+    unsigned int entry = plan.size();
+    plan.push_back(BuildStep());
+    plan[entry].cell = cell;
+    plan[entry].max_width = max_width;
+    plan[entry].start = start;
+    plan[entry].end = end;
+    plan[entry].is_task = (end - start <= task_size || isDuplicateRange(start, end));
+
+    if(!plan[entry].is_task) {
+        unsigned int offset[(1u << dimension) + 1];
+        partition(cell, start, end, offset);
+        for(unsigned int i = 0; i < no_children; i++) {
+            if(offset[i] == offset[i + 1]) continue;
+            planNode(getChildCell(cell, i), .5 * max_width, start + offset[i], start + offset[i + 1], task_size);
+        }
+    }
+    plan[entry].subtree_end = plan.size();
 }
 
 
-// Build SPTree on dataset
+// Builds the planned subtrees concurrently and stitches them together with the top levels into one depth-first array
 template<typename T, int dimension>
-void SPTree<T, dimension>::fill(unsigned int N)
+void SPTree<T, dimension>::assemble()
 {
-    for(unsigned int i = 0; i < N; i++) insert(i);
+    // Build every task into an arena of its own
+    vector<unsigned int> tasks;
+    for(unsigned int i = 0; i < plan.size(); i++) {
+        if(plan[i].is_task) tasks.push_back(i);
+    }
+    while(task_arenas.size() < tasks.size()) {
+        task_arenas.push_back(NodeArena());
+        initArena(task_arenas.back());
+    }
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int t = 0; t < (int) tasks.size(); t++) {
+        const BuildStep& step = plan[tasks[t]];
+        task_arenas[t].size = 0;
+        reserveNodes(task_arenas[t], 2 * (step.end - step.start) + 1);
+        buildNode(task_arenas[t], step.cell, step.max_width, step.start, step.end);
+    }
+
+    // Determine where every plan entry ends up in the final array
+    unsigned int no_nodes = 0;
+    for(unsigned int i = 0, t = 0; i < plan.size(); i++) {
+        plan[i].offset = no_nodes;
+        no_nodes += plan[i].is_task ? task_arenas[t++].size : 1;
+    }
+    reserveNodes(tree, no_nodes);
+    tree.size = no_nodes;
+
+    // Copy the subtrees, shifting their skip indices
+    #pragma omp parallel for schedule(dynamic, 1)
+    for(int t = 0; t < (int) tasks.size(); t++) {
+        const NodeArena& arena = task_arenas[t];
+        unsigned int offset = plan[tasks[t]].offset;
+        memcpy(tree.nodes + offset, arena.nodes, arena.size * sizeof(Node));
+        memcpy(tree.boundary + offset, arena.boundary, arena.size * sizeof(Cell<T, dimension>));
+        memcpy(tree.begin + offset, arena.begin, arena.size * sizeof(unsigned int));
+        for(unsigned int i = 0; i < arena.size; i++) tree.nodes[offset + i].skip += offset;
+    }
+
+    // Fill in the top-level nodes bottom-up, so that their children are complete
+    for(int i = (int) plan.size() - 1; i >= 0; i--) {
+        const BuildStep& step = plan[i];
+        if(step.is_task) continue;
+        unsigned int node = step.offset;
+        tree.boundary[node] = step.cell;
+        tree.begin[node] = step.start;
+        tree.nodes[node].max_width = step.max_width;
+        tree.nodes[node].cum_size = step.end - step.start;
+        tree.nodes[node].index = perm[step.start];
+        tree.nodes[node].skip = (step.subtree_end < plan.size()) ? plan[step.subtree_end].offset : no_nodes;
+
+        double center_of_mass[dimension];
+        for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] = .0;
+        for(unsigned int child = node + 1; child < tree.nodes[node].skip; child = tree.nodes[child].skip) {
+            double mult = tree.nodes[child].cum_size;
+            for(unsigned int d = 0; d < dimension; d++) center_of_mass[d] += mult * tree.nodes[child].center_of_mass[d];
+        }
+        for(unsigned int d = 0; d < dimension; d++) tree.nodes[node].center_of_mass[d] = (T) (center_of_mass[d] / (step.end - step.start));
+    }
 }
 
 
@@ -294,119 +767,228 @@ void SPTree<T, dimension>::fill(unsigned int N)
 template<typename T, int dimension>
 bool SPTree<T, dimension>::isCorrect()
 {
-    for(unsigned int n = 0; n < size; n++) {
-        T* point = data + index[n] * dimension;
-        if(!boundary.containsPoint(point)) return false;
-    }
-    if(!is_leaf) {
-        bool correct = true;
-        for(int i = 0; i < no_children; i++) correct = correct && children[i]->isCorrect();
-        return correct;
+    for(unsigned int i = 0; i < tree.size; i++) {
+        for(unsigned int n = tree.begin[i]; n < tree.begin[i] + tree.nodes[i].cum_size; n++) {
+            if(!tree.boundary[i].containsPoint(data + perm[n] * dimension)) return false;
+        }
     }
-    else return true;
+    return true;
 }
 
 
-
-// Build a list of all indices in SPTree
+// Build a list of all indices in SPTree (in depth-first order)
 template<typename T, int dimension>
 void SPTree<T, dimension>::getAllIndices(unsigned int* indices)
 {
-    getAllIndices(indices, 0);
+    for(unsigned int n = 0; n < N; n++) indices[n] = perm[n];
 }
 
 
-// Build a list of all indices in SPTree
 template<typename T, int dimension>
-unsigned int SPTree<T, dimension>::getAllIndices(unsigned int* indices, unsigned int loc)
-{
+unsigned int SPTree<T, dimension>::getDepth() {
+    if(tree.size == 0) return 0;
+    return getDepth(0);
+}
 
-    // Gather indices in current quadrant
-    for(unsigned int i = 0; i < size; i++) indices[loc + i] = index[i];
-    loc += size;
 
-    // Gather indices in children
-    if(!is_leaf) {
-        for(int i = 0; i < no_children; i++) loc = children[i]->getAllIndices(indices, loc);
+template<typename T, int dimension>
+unsigned int SPTree<T, dimension>::getDepth(unsigned int node) const {
+    unsigned int depth = 0;
+    for(unsigned int child = node + 1; child < tree.nodes[node].skip; child = tree.nodes[child].skip) {
+        unsigned int child_depth = getDepth(child);
+        if(child_depth > depth) depth = child_depth;
     }
-    return loc;
+    return 1 + depth;
 }
 
 
 template<typename T, int dimension>
-unsigned int SPTree<T, dimension>::getDepth() {
-    if(is_leaf) return 1;
-    int depth = 0;
-    for(unsigned int i = 0; i < no_children; i++) depth = fmax(depth, children[i]->getDepth());
-    return 1 + depth;
+unsigned int SPTree<T, dimension>::getNodeCount() const {
+    return tree.size;
 }
 
 
 // Compute non-edge forces using Barnes-Hut algorithm
 template<typename T, int dimension>
-T SPTree<T, dimension>::computeNonEdgeForces(unsigned int point_index, T theta, T neg_f[]) const
+double SPTree<T, dimension>::computeNonEdgeForces(unsigned int point_index, T theta, T neg_f[]) const
 {
-    T resultSum = 0;
-    T localbuff[dimension];
-    // Make sure that we spend no time on empty nodes or self-interactions
-    if(cum_size == 0 || (is_leaf && size == 1 && index[0] == point_index)) return resultSum;
+    return computePointForces(data + point_index * dimension, point_index, theta, neg_f);
+}
 
-    // Compute distance between point and center-of-mass
-    T D = .0;
-    unsigned int ind = point_index * dimension;
-    for(unsigned int d = 0; d < dimension; d++) localbuff[d] = data[ind + d] - center_of_mass[d];
-    for(unsigned int d = 0; d < dimension; d++) D += localbuff[d] * localbuff[d];
 
-    // Check whether we can use this node as a "summary"
-    T max_width = 0.0;
-    T cur_width;
-    for(unsigned int d = 0; d < dimension; d++) {
-        cur_width = boundary.getWidth(d);
-        max_width = (max_width > cur_width) ? max_width : cur_width;
-    }
+// Compute non-edge forces on a point that is not in the tree (such as a new point placed into a fixed map)
+template<typename T, int dimension>
+double SPTree<T, dimension>::computeNonEdgeForces(const T* point, T theta, T neg_f[]) const
+{
+    return computePointForces(point, N, theta, neg_f);
+}
 
-    if(is_leaf || max_width / sqrt(D) < theta) {
-        // Compute and add t-SNE force between point and current node
-        D = 1.0 / (1.0 + D);
-        T mult = cum_size * D;
-        resultSum += mult;
-        mult *= D;
-        for(unsigned int d = 0; d < dimension; d++) neg_f[d] += mult * localbuff[d];
-    }
-    else {
-        // Recursively apply Barnes-Hut to children
-        for(unsigned int i = 0; i < no_children; i++) {
-            resultSum += children[i]->computeNonEdgeForces(point_index, theta, neg_f);
+
+// Walks the tree for a single point, skipping the leaf of point_index (N for points outside the tree)
+template<typename T, int dimension>
+double SPTree<T, dimension>::computePointForces(const T* point, unsigned int point_index, T theta, T neg_f[]) const
+{
+    double resultSum = .0;
+    T localbuff[dimension];
+    const Node* nodes = tree.nodes;
+    const unsigned int no_nodes = tree.size;
+    T theta_sq = theta * theta;
+
+    // Walk the nodes in depth-first order; accepting a node as a summary skips its subtree
+    unsigned int i = 0;
+    while(i < no_nodes) {
+        const Node& node = nodes[i];
+        bool is_leaf = (node.skip == i + 1);
+
+        // Make sure that we spend no time on self-interactions
+        if(is_leaf && node.index == point_index) { i = node.skip; continue; }
+
+        // Compute distance between point and center-of-mass
+        T D = .0;
+        for(unsigned int d = 0; d < dimension; d++) localbuff[d] = point[d] - node.center_of_mass[d];
+        for(unsigned int d = 0; d < dimension; d++) D += localbuff[d] * localbuff[d];
+
+        // Check whether we can use this node as a "summary"
+        if(is_leaf || node.max_width * node.max_width < theta_sq * D) {
+
+            // Compute and add t-SNE force between point and current node
+            D = 1 / (1 + D);
+            T mult = node.cum_size * D;
+            resultSum += mult;
+            mult *= D;
+            for(unsigned int d = 0; d < dimension; d++) neg_f[d] += mult * localbuff[d];
+            i = node.skip;
         }
+        else i++;
     }
-
     return resultSum;
 }
 
 
-// Computes edge forces
+// Computes the non-edge forces of all points at once with a dual-tree traversal: cells that are far apart interact as
+// a whole, and the forces a cell receives are pushed down to its points with a first-order expansion around its
+// center-of-mass (returns the normalization term of all points)
 template<typename T, int dimension>
-void SPTree<T, dimension>::computeEdgeForces(unsigned int* row_P, unsigned int* col_P, T* val_P, int N, T pos_f[]) const
+double SPTree<T, dimension>::computeNonEdgeForces(T theta, T neg_f[])
 {
-    #pragma omp parallel for schedule(static)
-    for(unsigned int n = 0; n < N; n++) {
-        unsigned int ind1 = n*dimension;
+    const Node* nodes = tree.nodes;
+    const unsigned int no_nodes = tree.size;
+    if(no_nodes == 0) return .0;
+    const unsigned int stride = dimension + dimension * dimension;
+    node_sum_Q.assign(no_nodes, .0);
+    node_forces.assign((size_t) no_nodes * stride, .0);
+
+    // Split the top of the tree into target subtrees that are handled in parallel (each one only writes to its own nodes)
+    const unsigned int no_targets = 8 * getThreadCount();
+    targets.assign(1, 0);
+    bool expanded = true;
+    while(targets.size() < no_targets && expanded) {
+        expanded = false;
+        unsigned int count = targets.size();
+        for(unsigned int t = 0; t < count; t++) {
+            unsigned int node = targets[t];
+            if(nodes[node].skip == node + 1) continue;
+            targets[t] = node + 1;
+            for(unsigned int child = nodes[node + 1].skip; child < nodes[node].skip; child = nodes[child].skip) targets.push_back(child);
+            expanded = true;
+        }
+    }
+
+    // Let every target subtree interact with the whole tree, and push the forces down to its points
+    T theta_sq = theta * theta;
+    double resultSum = .0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:resultSum)
+    for(unsigned int t = 0; t < targets.size(); t++) {
+        computeCellForces(targets[t], 0, theta_sq);
+
+        // Every node holds the normalization term, the force and its Jacobian at its center-of-mass
+        unsigned int subtree_end = nodes[targets[t]].skip;
+        for(unsigned int i = targets[t]; i < subtree_end; i++) {
+            double sum_Q = node_sum_Q[i];
+            const T* force = &node_forces[(size_t) i * stride];
+            const T* jacobian = force + dimension;
+            if(nodes[i].skip != i + 1) {
+                for(unsigned int child = i + 1; child < nodes[i].skip; child = nodes[child].skip) {
+                    double& child_sum_Q = node_sum_Q[child];
+                    T* child_force = &node_forces[(size_t) child * stride];
+                    T* child_jacobian = child_force + dimension;
+                    T shift[dimension];
+                    for(unsigned int d = 0; d < dimension; d++) shift[d] = nodes[child].center_of_mass[d] - nodes[i].center_of_mass[d];
+                    child_sum_Q += sum_Q;
+                    for(unsigned int d = 0; d < dimension; d++) {
+                        child_sum_Q -= 2 * force[d] * shift[d];
+                        child_force[d] += force[d];
+                        for(unsigned int e = 0; e < dimension; e++) child_force[d] += jacobian[d * dimension + e] * shift[e];
+                    }
+                    for(unsigned int d = 0; d < dimension * dimension; d++) child_jacobian[d] += jacobian[d];
+                }
+            }
+            else {
+                for(unsigned int n = tree.begin[i]; n < tree.begin[i] + nodes[i].cum_size; n++) {
+                    for(unsigned int d = 0; d < dimension; d++) neg_f[perm[n] * dimension + d] += force[d];
+                }
+                resultSum += nodes[i].cum_size * sum_Q;
+            }
+        }
+    }
+    return resultSum;
+}
 
-        for(unsigned int i = row_P[n]; i < row_P[n + 1]; i++) {
 
-            T localbuff[dimension];
+// Adds the forces that the points of the source node exert on the points of the target node (recursively)
+template<typename T, int dimension>
+void SPTree<T, dimension>::computeCellForces(unsigned int target, unsigned int source, T theta_sq)
+{
+    const Node* nodes = tree.nodes;
+    const Node& node_t = nodes[target];
+    const Node& node_s = nodes[source];
+    bool is_leaf_t = (node_t.skip == target + 1);
+    bool is_leaf_s = (node_s.skip == source + 1);
+    double& sum_Q = node_sum_Q[target];
+    T* force = &node_forces[(size_t) target * (dimension + dimension * dimension)];
+    T* jacobian = force + dimension;
+
+    // A cell interacts with itself through all pairs of its children (duplicates in a leaf are at distance zero)
+    if(target == source) {
+        if(is_leaf_t) sum_Q += node_t.cum_size - 1;
+        else {
+            for(unsigned int child_t = target + 1; child_t < node_t.skip; child_t = nodes[child_t].skip) {
+                for(unsigned int child_s = source + 1; child_s < node_s.skip; child_s = nodes[child_s].skip) {
+                    computeCellForces(child_t, child_s, theta_sq);
+                }
+            }
+        }
+        return;
+    }
 
-            // Compute pairwise distance and Q-value
-            T D = 1.0;
-            unsigned int ind2 = col_P[i] * dimension;
-            for(unsigned int d = 0; d < dimension; d++) localbuff[d] = data[ind1 + d] - data[ind2 + d];
-            for(unsigned int d = 0; d < dimension; d++) D += localbuff[d] * localbuff[d];
-            D = val_P[i] / D;
+    // Compute distance between the centers-of-mass
+    T localbuff[dimension];
+    T D = .0;
+    for(unsigned int d = 0; d < dimension; d++) localbuff[d] = node_t.center_of_mass[d] - node_s.center_of_mass[d];
+    for(unsigned int d = 0; d < dimension; d++) D += localbuff[d] * localbuff[d];
 
-            // Sum positive force
-            for(unsigned int d = 0; d < dimension; d++) pos_f[ind1 + d] += D * localbuff[d];
+    // Check whether the cells are far enough apart to interact as a whole (the points of a leaf coincide)
+    T width_t = is_leaf_t ? .0 : node_t.max_width;
+    T width_s = is_leaf_s ? .0 : node_s.max_width;
+    if((is_leaf_t && is_leaf_s) || (width_t + width_s) * (width_t + width_s) < theta_sq * D) {
+        D = 1 / (1 + D);
+        T mult = node_s.cum_size * D;
+        sum_Q += mult;
+        mult *= D;
+        for(unsigned int d = 0; d < dimension; d++) {
+            force[d] += mult * localbuff[d];
+            jacobian[d * dimension + d] += mult;
+            for(unsigned int e = 0; e < dimension; e++) jacobian[d * dimension + e] -= 4.0 * mult * D * localbuff[d] * localbuff[e];
         }
+        return;
+    }
 
+    // Otherwise, split the wider cell
+    if(is_leaf_s || (!is_leaf_t && width_t > width_s)) {
+        for(unsigned int child = target + 1; child < node_t.skip; child = nodes[child].skip) computeCellForces(child, source, theta_sq);
+    }
+    else {
+        for(unsigned int child = source + 1; child < node_s.skip; child = nodes[child].skip) computeCellForces(target, child, theta_sq);
     }
 }
 
@@ -415,25 +997,28 @@ void SPTree<T, dimension>::computeEdgeForces(unsigned int* row_P, unsigned int*
 template<typename T, int dimension>
 void SPTree<T, dimension>::print()
 {
-    if(cum_size == 0) {
+    if(tree.size == 0) {
         printf("Empty node\n");
         return;
     }
+    print(0);
+}
+
 
-    if(is_leaf) {
+template<typename T, int dimension>
+void SPTree<T, dimension>::print(unsigned int node) const
+{
+    const Node* nodes = tree.nodes;
+    if(nodes[node].skip == node + 1) {
         printf("Leaf node; data = [");
-        for(int i = 0; i < size; i++) {
-            T* point = data + index[i] * dimension;
-            for(int d = 0; d < dimension; d++) printf("%f, ", point[d]);
-            printf(" (index = %d)", index[i]);
-            if(i < size - 1) printf("\n");
-            else printf("]\n");
-        }
+        T* point = data + nodes[node].index * dimension;
+        for(int d = 0; d < dimension; d++) printf("%f, ", point[d]);
+        printf(" (index = %d, size = %d)]\n", nodes[node].index, nodes[node].cum_size);
     }
     else {
         printf("Intersection node with center-of-mass = [");
-        for(int d = 0; d < dimension; d++) printf("%f, ", center_of_mass[d]);
+        for(int d = 0; d < dimension; d++) printf("%f, ", nodes[node].center_of_mass[d]);
         printf("]; children are:\n");
-        for(int i = 0; i < no_children; i++) children[i]->print();
+        for(unsigned int child = node + 1; child < nodes[node].skip; child = nodes[child].skip) print(child);
     }
 }
@@ -34,6 +34,8 @@
 #ifndef SPTREE_H
 #define SPTREE_H
 
+#include <vector>
+
 using namespace std;
 
 
@@ -47,65 +49,128 @@ class Cell {
 public:
     Cell();
     Cell(T* inp_corner, T* inp_width);
-    ~Cell();
 
     T getCorner(unsigned int d) const;
     T getWidth(unsigned int d) const;
     void setCorner(unsigned int d, T val);
     void setWidth(unsigned int d, T val);
     bool containsPoint(T point[]) const;
+    bool containsPoint(T point[], T slack) const;
 };
 
 template<typename T, int dimension>
 class SPTree
 {
 
-    // Fixed constants
-    static const unsigned int QT_NODE_CAPACITY = 1;
-
-    // Properties of this node in the tree
-    SPTree<T, dimension>* parent;
-    bool is_leaf;
-    unsigned int size;
-    unsigned int cum_size;
-
-    // Axis-aligned bounding box stored as a center with half-dimensions to represent the boundaries of this quad tree
-    Cell<T, dimension> boundary;
-
-    // Indices in this space-partitioning tree node, corresponding center-of-mass, and list of all children
+    // A single node of the tree; only the fields needed during traversal are kept here
+    struct Node {
+        T center_of_mass[dimension];
+        T max_width;
+        unsigned int cum_size;
+        unsigned int skip;                          // first node after this subtree (own index + 1 for leaves)
+        unsigned int index;                         // point stored in a leaf (duplicates are folded into it)
+    };
+
+    // Growable storage for a sequence of nodes in depth-first order
+    struct NodeArena {
+        Node* nodes;
+        Cell<T, dimension>* boundary;               // only needed while building
+        unsigned int* begin;                        // first entry of the node in perm
+        unsigned int size;
+        unsigned int capacity;
+    };
+
+    // One entry of the top-level build plan (top-level nodes are split in parallel, subtrees below are built as tasks)
+    struct BuildStep {
+        Cell<T, dimension> cell;
+        T max_width;
+        unsigned int start, end;
+        bool is_task;
+        unsigned int subtree_end;                   // first plan entry after this subtree
+        unsigned int offset;                        // index of the entry's (first) node in the final tree
+    };
+
+    // Data underlying this tree
     T* data;
-    T center_of_mass[dimension];
-    unsigned int index[QT_NODE_CAPACITY];
-
-    // Children
-    SPTree<T, dimension>** children;
-    unsigned int no_children;
+    unsigned int N;
+
+    // All nodes of the tree, reused by subsequent builds
+    NodeArena tree;
+
+    // Point indices ordered such that every node covers a contiguous range
+    unsigned int* perm;
+    unsigned int* scratch;
+    unsigned int* old_perm;
+    unsigned int point_capacity;
+
+    // Buffers of the parallel build, also reused by subsequent builds
+    vector<BuildStep> plan;
+    vector<NodeArena> task_arenas;
+    vector<unsigned int> chunk_offsets;
+
+    // A point that has to be re-inserted below a node (octant == 2^dimension for leaves that absorb the point)
+    struct Insertion {
+        unsigned int node, octant, point;
+        bool operator<(const Insertion& o) const {
+            if(node != o.node) return node < o.node;
+            if(octant != o.octant) return octant < o.octant;
+            return point < o.point;
+        }
+    };
+
+    // Buffers of the incremental refit, also reused across iterations
+    NodeArena spare;
+    vector<unsigned int> new_cum_size;
+    vector<unsigned char> touched;
+    vector<unsigned char> point_moved;
+    vector<Insertion> insertions;
+
+    // Buffers of the dual-tree traversal: the normalization term (summed in double precision), and the force and its
+    // Jacobian that every point of a node receives
+    vector<double> node_sum_Q;
+    vector<T> node_forces;
+    vector<unsigned int> targets;
 
 public:
+    SPTree();
     SPTree(T* inp_data, unsigned int N);
-    SPTree(T* inp_data, T* inp_corner, T* inp_width);
-    SPTree(T* inp_data, unsigned int N, T* inp_corner, T* inp_width);
-    SPTree(SPTree<T, dimension>* inp_parent, T* inp_data, unsigned int N, T* inp_corner, T* inp_width);
-    SPTree(SPTree<T, dimension>* inp_parent, T* inp_data, T* inp_corner, T* inp_width);
     ~SPTree();
+    void build(T* inp_data, unsigned int N, T margin = 1.0);
+    bool refit(T* inp_data, unsigned int N, double max_moved_fraction);
     void setData(T* inp_data);
-    SPTree<T, dimension>* getParent();
-    void construct(Cell<T, dimension> boundary);
-    bool insert(unsigned int new_index);
-    void subdivide();
     bool isCorrect();
-    void rebuildTree();
     void getAllIndices(unsigned int* indices);
     unsigned int getDepth();
-    T computeNonEdgeForces(unsigned int point_index, T theta, T neg_f[]) const;
-    void computeEdgeForces(unsigned int* row_P, unsigned int* col_P, T* val_P, int N, T pos_f[]) const;
+    unsigned int getNodeCount() const;
+    double computeNonEdgeForces(unsigned int point_index, T theta, T neg_f[]) const;
+    double computeNonEdgeForces(const T* point, T theta, T neg_f[]) const;
+    double computeNonEdgeForces(T theta, T neg_f[]);
     void print();
 
 private:
-    void init(SPTree<T, dimension>* inp_parent, T* inp_data, T* inp_corner, T* inp_width);
-    void fill(unsigned int N);
-    unsigned int getAllIndices(unsigned int* indices, unsigned int loc);
-    bool isChild(unsigned int test_index, unsigned int start, unsigned int end);
+    void init();
+    static void initArena(NodeArena& arena);
+    static void freeArena(NodeArena& arena);
+    static void reserveNodes(NodeArena& arena, unsigned int size);
+    void reservePoints(unsigned int size);
+    unsigned int buildNode(NodeArena& arena, const Cell<T, dimension>& cell, T max_width, unsigned int start, unsigned int end);
+    void planNode(const Cell<T, dimension>& cell, T max_width, unsigned int start, unsigned int end, unsigned int task_size);
+    void partition(const Cell<T, dimension>& cell, unsigned int start, unsigned int end, unsigned int* child_offset);
+    void assemble();
+    unsigned int getOctant(unsigned int parent, unsigned int child) const;
+    unsigned int findChild(unsigned int node, unsigned int descendant) const;
+    bool scheduleInsertion(unsigned int point);
+    unsigned int findInsertions(unsigned int node, unsigned int octant) const;
+    void relayoutNode(unsigned int node, unsigned int& pos);
+    unsigned int appendRemainingPoints(unsigned int node, unsigned int pos);
+    void refitCenters();
+    unsigned int getChildIndex(const Cell<T, dimension>& cell, const T* point) const;
+    Cell<T, dimension> getChildCell(const Cell<T, dimension>& cell, unsigned int child) const;
+    bool isDuplicateRange(unsigned int start, unsigned int end) const;
+    double computePointForces(const T* point, unsigned int point_index, T theta, T neg_f[]) const;
+    void computeCellForces(unsigned int target, unsigned int source, T theta_sq);
+    unsigned int getDepth(unsigned int node) const;
+    void print(unsigned int node) const;
 };
 
 #endif
@@ -34,6 +34,189 @@
 #ifndef TSNE_H
 #define TSNE_H
 
+#include <string>
+#include <type_traits>
+#include "vptree.h"
+#include "sptree.h"
+#include "kdtree.h"
+#include "fftforces.h"
+
+
+// Methods for the repulsive forces of approximate t-SNE
+enum TSNERepulsion {
+    TSNE_REPULSION_BARNES_HUT = 0,      // space-partitioning tree with accuracy theta
+    TSNE_REPULSION_FFT = 1,             // interpolation on a regular grid with FFT convolutions (for large data sets)
+    TSNE_REPULSION_DUAL_TREE = 2        // space-partitioning tree, with cells that are far apart interacting as a whole
+};
+
+// Methods for the nearest neighbors of approximate t-SNE
+enum TSNENeighbors {
+    TSNE_NEIGHBORS_EXACT = 0,           // vantage-point tree search
+    TSNE_NEIGHBORS_APPROXIMATE = 1      // random-projection trees refined by NN-descent (for high-dimensional data)
+};
+
+// Distances between the rows of sparse input (dense input always uses the Euclidean distance)
+enum TSNEMetric {
+    TSNE_METRIC_EUCLIDEAN = 0,          // Euclidean distance between the rows as given
+    TSNE_METRIC_COSINE = 1              // one minus the cosine similarity of the rows
+};
+
+// Pages of the large arrays of the optimization (the map state, the forces and the sparse P matrix)
+enum TSNEHugePages {
+    TSNE_HUGE_PAGES_OFF = 0,            // ordinary pages
+    TSNE_HUGE_PAGES_TRANSPARENT = 1,    // ask the kernel for transparent huge pages
+    TSNE_HUGE_PAGES_EXPLICIT = 2        // huge pages from the reserved pool (transparent ones if it is empty)
+};
+
+// Wall-clock time spent in the phases of a t-SNE run, in seconds (filled in when TSNEOptions.stats is set)
+struct TSNEStats {
+    double centering;           // normalizing the input (sparse input: scaling the rows to unit length for cosine distances)
+    double knn;                 // nearest neighbor search (approximate t-SNE)
+    double calibration;         // calibrating the Gaussian kernels to the perplexity (exact t-SNE: also the distances)
+    double symmetrization;      // symmetrizing and normalizing the input similarities
+    double tree_build;          // building or refitting the space-partitioning tree
+    double attractive;          // attractive forces along the input similarities
+    double repulsive;           // repulsive forces (exact t-SNE: the whole gradient, which is computed in one pass)
+    double update;              // gradient update of the map
+    double error;               // error evaluation for the progress reports
+    double total;               // the whole run
+    int iterations;             // iterations performed by this run (fewer than max_iter after resuming)
+};
+
+// State of a t-SNE run after an iteration, as passed to TSNEOptions.callback
+struct TSNEProgress {
+    int iteration;
+    double gradient_norm;       // norm of the gradient of this iteration (including the early exaggeration)
+    double error;               // most recent error estimate (see cost_interval), or a negative value before the first
+    int error_iteration;        // iteration the error was estimated at
+    const void* Y;              // N x no_dims map in the element type of the optimization (float with single_precision);
+                                // read-only, and not yet centered (the mean is subtracted at the end of the run)
+    int element_type;           // ELEMENT_FLOAT32 or ELEMENT_FLOAT64
+    int n;
+    int no_dims;
+};
+
+// Called after every iteration; a nonzero return value stops the run (which then returns its current map)
+typedef int (*TSNECallback)(const TSNEProgress* progress, void* user_data);
+
+// Optional settings of a t-SNE run (start from tsne_default_options and change what you need)
+struct TSNEOptions {
+    double refit_threshold;     // after early exaggeration, keep the tree of the previous iteration unless more than
+                                // this fraction of the points left their cell (0 rebuilds the tree every iteration)
+    int repulsion;              // one of TSNERepulsion (theta = 0 still selects exact t-SNE)
+    int fft_interp_points;      // interpolation nodes per grid box and dimension of TSNE_REPULSION_FFT (2 to 8)
+    int neighbors;              // one of TSNENeighbors
+    int knn_trees;              // random-projection trees of TSNE_NEIGHBORS_APPROXIMATE (more trees: higher recall, slower)
+    int knn_iterations;         // maximum rounds of NN-descent of TSNE_NEIGHBORS_APPROXIMATE
+    int knn_recall_sample;      // points whose approximate neighbors are checked against exact search (reported when verbose)
+    const char* model_file;     // if not NULL, the run saves its normalized input, map and kernel precisions to this file,
+                                // so new points can be placed into the map later (see tsne_load_model)
+    const char* checkpoint_file;    // if not NULL, the state of the optimization is saved to this file (in the background)
+    int checkpoint_interval;        // iterations between checkpoints
+    const char* resume_file;        // if not NULL, the optimization continues from this checkpoint instead of starting over
+    const char* affinity_cache;     // if not NULL, an existing directory in which the input similarities of approximate
+                                    // t-SNE are cached, so later runs on the same data and perplexity skip computing them
+    int single_precision;           // if nonzero, double data is optimized in float (sums such as the normalization term and
+                                    // the error are still accumulated in double); saved models and checkpoints are in float
+    int cost_interval;              // iterations between progress reports, each with the error of the map (0 reports progress
+                                    // every 50 iterations without evaluating the error)
+    TSNEStats* stats;               // if not NULL, receives the wall-clock time of every phase of the run
+    TSNECallback callback;          // if not NULL, called after every iteration (and can stop the run)
+    void* callback_data;            // passed to the callback as is
+    double grad_tolerance;          // after early exaggeration, stop once the gradient norm falls below this fraction of
+                                    // the largest norm seen since (0 never stops on the gradient)
+    double kl_tolerance;            // after early exaggeration, stop once the error decreased by less than this fraction
+                                    // between two progress reports (0 never stops on the error; needs cost_interval > 0)
+    int huge_pages;                 // one of TSNEHugePages
+    int pin_threads;                // if nonzero, every OpenMP thread is pinned to its own CPU (for the rest of the process),
+                                    // so the pages each thread touches first stay on its NUMA node
+};
+
+extern "C" void tsne_default_options(TSNEOptions* options);
+
+// One optimization of a batch (see run_tSNE_batch): its settings, and the map and status it produces
+struct TSNEBatchRun {
+    double perplexity;
+    double theta;                   // runs with theta = 0 (exact t-SNE) compute their own input similarities
+    int rand_seed;
+    int out_dims;                   // 2 to 10
+    int max_iter;
+    void* Y;                        // N x out_dims output, in the element type of the batch
+    int result;                     // 0 on success, as returned by run_tSNE
+    TSNEStats stats;                // wall-clock time of the phases of this run
+};
+
+// Element types of the binary file formats
+enum TSNEElementType {
+    ELEMENT_FLOAT32 = 1,
+    ELEMENT_FLOAT64 = 2
+};
+
+// Header of a cached set of input similarities (the values, the kernel precisions, the row offsets and the column
+// indices of the symmetrized and normalized P follow it)
+struct AffinityCacheHeader {
+    char magic[4];                  // "BHTP"
+    int version;                    // 1
+    int element_type;               // ELEMENT_FLOAT32 or ELEMENT_FLOAT64
+    int n;                          // number of datapoints
+    unsigned long long key;         // hash of the input and the settings (also part of the file name)
+    unsigned long long no_elem;     // number of values of P
+};
+
+// Header of a model file (the arrays of TSNEModel follow it in the element type of the run, see TSNE::saveModel)
+struct TSNEModelHeader {
+    char magic[4];                  // "BHTM"
+    int version;                    // 1
+    int element_type;               // ELEMENT_FLOAT32 or ELEMENT_FLOAT64
+    int n;                          // number of reference points
+    int d;                          // input dimensionality
+    int no_dims;                    // output dimensionality
+    double perplexity;
+    double theta;
+    double scale;                   // the centered reference data was divided by this
+};
+
+// A saved embedding, loaded once and then used to place any number of batches of new points
+struct TSNEModelFile;
+extern "C" TSNEModelFile* tsne_load_model(const char* filename, bool verbose);
+extern "C" void tsne_free_model(TSNEModelFile* model);
+
+// Largest map dimensionality with a compiled instantiation of TSNE (maps of two to this many dimensions are supported)
+static const int TSNE_MAX_OUT_DIMS = 10;
+
+// Space-partitioning tree of a map with OUTDIM dimensions: SPTree cells have 2^OUTDIM children, which only pays off
+// for maps of up to three dimensions, while KDTree always splits in two
+template<typename T, int OUTDIM>
+struct TSNETree {
+    typedef typename conditional<(OUTDIM <= 3), SPTree<T, OUTDIM>, KDTree<T, OUTDIM> >::type type;
+};
+
+
+// The parts of a model file, with the search structures that are restored from it
+template<typename T, int OUTDIM>
+struct TSNEModel {
+    int N, D;
+    T perplexity, theta, scale;
+    const T* mean;                                  // mean of the reference data (D entries)
+    const T* beta;                                  // precisions of the Gaussian kernels of the reference points
+    const T* Y;                                     // final map of the reference points
+    const T* X;                                     // reference data, centered and divided by scale
+    VpTree<T, EuclideanDistance<T> >* index;        // neighbor search over X
+    typename TSNETree<T, OUTDIM>::type* map_tree;   // repulsive forces of the (fixed) reference map
+    T* map_Y;                                       // writable copy of Y that map_tree refers to
+};
+
+// Symmetrized and normalized input similarities of approximate t-SNE, computed once and shared read-only by the runs of
+// a batch with the same perplexity (or computed from sparse input)
+template<typename T>
+struct TSNEAffinities {
+    T perplexity;
+    unsigned int* row_P;
+    unsigned int* col_P;
+    T* val_P;
+    T* beta;                                        // precisions of the Gaussian kernels of the rows
+};
+
 
 template<typename T>
 static inline T sign(T x) { return (x == .0 ? .0 : (x < .0 ? -1.0 : 1.0)); }
@@ -46,20 +229,53 @@ template<typename T, int OUTDIM>
 class TSNE
 {
 public:
-    static int run(T* X, int N, int D, T* Y, T perplexity, T theta, int rand_seed,
-             bool skip_random_init, bool verbose, int max_iter=1000, int stop_lying_iter=250, int mom_switch_iter=250);
+    static int run(const T* inp_X, int N, int D, T* Y, T perplexity, T theta, int rand_seed,
+             bool skip_random_init, bool verbose, int max_iter=1000, int stop_lying_iter=250, int mom_switch_iter=250,
+             const TSNEOptions* options=NULL, const TSNEAffinities<T>* affinities=NULL);
+    static void computeAffinities(const T* inp_X, int N, int D, TSNEAffinities<T>* affinities, int no_affinities, bool verbose,
+                                  const TSNEOptions& opts);
+    static void computeSparseAffinities(const unsigned int* row_ptr, const unsigned int* col_idx, const T* values, int N, int metric,
+                                        TSNEAffinities<T>* affinities, bool verbose, const TSNEOptions& opts, TSNEStats* stats = NULL);
+    static void freeAffinities(TSNEAffinities<T>* affinities);
+    static int transform(const TSNEModel<T, OUTDIM>* model, const T* inp_X, int N, T* Y, T perplexity, int max_iter, bool verbose);
+    static TSNEModel<T, OUTDIM>* loadModel(const char* contents);
+    static void freeModel(TSNEModel<T, OUTDIM>* model);
 
 
 private:
-    static void computeGradient(T* P, unsigned int* inp_row_P, unsigned int* inp_col_P, T* inp_val_P, T* Y, int N, T* dC, T theta);
-    static void computeExactGradient(T* P, T* Y, int N, T* dC);
-    static T evaluateError(T* P, T* Y, int N);
-    static T evaluateError(unsigned int* row_P, unsigned int* col_P, T* val_P, T* Y, int N, T theta);
-    static void zeroMean(T* X, int N, int D);
-    static void computeGaussianPerplexity(T* X, int N, int D, T* P, T perplexity);
-    static void computeGaussianPerplexity(T* X, int N, int D, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, T perplexity, int K, bool verbose);
-    static void computeSquaredEuclideanDistance(T* X, int N, int D, T* DD);
-    static void symmetrizeMatrix(unsigned int** _row_P, unsigned int** _col_P, T** _val_P, int N);
+    template<typename U, int DIM> friend class TSNEBench;     // times the phases one by one (tsne_bench.cpp)
+
+    typedef typename TSNETree<T, OUTDIM>::type Tree;
+
+    // Tile sizes of the exact gradient and error (rows per task, and columns of the map that stay in cache)
+    static const int EXACT_TILE_ROWS = 32;
+    static const int EXACT_TILE_COLS = 2048;
+
+    // Smallest data set that uses the FFT repulsion (its grid costs about as much as Barnes-Hut at 30,000 points)
+    static const int FFT_MIN_POINTS = 10000;
+
+    static void updateTree(Tree* tree, T* Y, int N, double refit_threshold);
+    static void computeGradient(Tree* tree, FFTForces<T, OUTDIM>* fft, bool dual_tree, unsigned int* inp_row_P, unsigned int* inp_col_P, T* inp_val_P, T* Y, int N, T* dC, T theta, T exaggeration, T* pos_f, T* neg_f, double* cross_entropy = NULL, TSNEStats* stats = NULL);
+    static double computeNonEdgeForces(Tree* tree, FFTForces<T, OUTDIM>* fft, bool dual_tree, T* Y, int N, T theta, T* neg_f);
+    static void computeExactGradient(T* P, T* Y, int N, T* dC, T exaggeration);
+    static double evaluateError(T* P, T* Y, int N, T exaggeration);
+    static double updateMap(T* Y, const T* dY, T* uY, T* gains, int N, T momentum, T eta, T* mean_Y);
+    static void zeroMean(T* X, int N, int D, T* mean = NULL);
+    static void computeGaussianPerplexity(T* X, int N, int D, T* P, T perplexity, T* beta);
+    static void computeGaussianPerplexity(T* X, int N, int D, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, T perplexity, int K, bool verbose, const TSNEOptions& opts, T* beta, TSNEStats* stats = NULL);
+    template<typename Distance>
+    static void computeNeighbors(const Distance& distance, int N, int K, bool verbose, const TSNEOptions& opts, unsigned int** _row_P, unsigned int** _col_P, T** _dist_P);
+    static void calibrateRows(const unsigned int* row_P, const T* dist_P, int N, T perplexity, T* val_P, T* beta);
+    template<typename Distance>
+    static T measureRecall(const Distance& distance, int N, unsigned int* row_P, unsigned int* col_P, int samples);
+    static T computeGaussianRow(const T* dist_sq, int K, T perplexity, T* cur_P);
+    static void sortRows(const unsigned int* row_P, unsigned int* col_P, T* val_P, int N);
+    static void symmetrizeMatrix(unsigned int** _row_P, unsigned int** _col_P, T** _val_P, int N, int huge_pages);
+    static string getAffinityCacheFile(const char* directory, const T* X, int N, int D, T perplexity, const TSNEOptions& opts);
+    static bool loadAffinities(const char* filename, int N, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, T* beta, int huge_pages);
+    static bool saveAffinities(const char* filename, int N, const unsigned int* row_P, const unsigned int* col_P, const T* val_P, const T* beta);
+    static bool readCheckpoint(const char* filename, int N, bool exact, T* Y, T* uY, T* gains, T* mean_Y, T* beta, T** P, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, int* iter, T* momentum, bool* lying, int huge_pages, bool verbose);
+    static bool saveModel(const char* filename, const T* X, int N, int D, const T* mean, T scale, const T* beta, const T* Y, T perplexity, T theta);
 
 };
 
@@ -0,0 +1,351 @@
+#include "tsne_core.cpp"
+#include <omp.h>
+#include <string>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+
+// Scalability benchmark: generates Gaussian-mixture data sets, runs the phases of approximate t-SNE one by one with
+// each of the given thread counts, and prints one CSV line per phase (wall time, throughput and peak resident memory)
+// Usage: tsne_bench [--sizes N,...] [--dims D,...] [--threads T,...] [--clusters C] [--iterations I] [--perplexity P]
+//                   [--theta THETA] [--out-dims 2|3|5|10] [--repulsion bh|dual|fft] [--neighbors exact|approximate]
+//                   [--float] [--pin-threads] [--huge-pages off|transparent|explicit] [--seed S] [--output FILE]
+struct BenchOptions {
+    vector<int> sizes;
+    vector<int> dims;
+    vector<int> threads;
+    int clusters;
+    int iterations;                 // optimizer iterations timed per data set and thread count
+    double perplexity;
+    double theta;
+    int out_dims;
+    bool single_precision;
+    int seed;
+    TSNEOptions tsne;
+    FILE* output;
+};
+
+
+// Resets the peak resident memory of the process (where the kernel allows it), so every phase reports its own peak
+static void resetPeakMemory() {
+#ifndef _WIN32
+    FILE* h = fopen("/proc/self/clear_refs", "w");
+    if(h == NULL) return;
+    fputs("5", h);
+    fclose(h);
+#endif
+}
+
+// Returns the peak resident memory in megabytes (since the last reset, or since the start of the process)
+static double peakMemory() {
+#ifndef _WIN32
+    FILE* h = fopen("/proc/self/status", "r");
+    if(h != NULL) {
+        char line[256];
+        long kb = -1;
+        while(fgets(line, sizeof(line), h) != NULL) {
+            if(strncmp(line, "VmHWM:", 6) == 0) { kb = atol(line + 6); break; }
+        }
+        fclose(h);
+        if(kb >= 0) return kb / 1024.0;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;
+#else
+    return .0;
+#endif
+}
+
+static vector<int> parseList(const char* arg) {
+    vector<int> list;
+    for(const char* p = arg; *p != '\0'; ) {
+        list.push_back(atoi(p));
+        while(*p != '\0' && *p != ',') p++;
+        if(*p == ',') p++;
+    }
+    return list;
+}
+
+
+template<typename U, int DIM>
+class TSNEBench
+{
+public:
+    typedef TSNE<U, DIM> Engine;
+
+    // Benchmarks one data set with every thread count (returns false if the normalization term fails the sanity check)
+    static bool run(const U* X, const int* labels, int N, int D, const BenchOptions& bench) {
+        bool ok = true;
+        for(size_t t = 0; t < bench.threads.size(); t++) {
+            int threads = bench.threads[t];
+            omp_set_num_threads(threads);
+            srand((unsigned int) bench.seed);
+            U* X_copy = (U*) malloc((size_t) N * D * sizeof(U));
+            if(X_copy == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+            memcpy(X_copy, X, (size_t) N * D * sizeof(U));
+            int K = (int) (3 * bench.perplexity);
+
+            // Input similarities: neighbor search, calibration of the kernels and symmetrization
+            unsigned int* row_P = NULL; unsigned int* col_P = NULL; U* dist_P = NULL;
+            double start = phaseStart();
+            Engine::computeNeighbors(EuclideanDistance<U>(X_copy, D), N, K, false, bench.tsne, &row_P, &col_P, &dist_P);
+            report(bench, "knn", N, D, threads, omp_get_wtime() - start, N, "points/s");
+
+            U* val_P = (U*) malloc((size_t) N * K * sizeof(U));
+            if(val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+            start = phaseStart();
+            Engine::calibrateRows(row_P, dist_P, N, (U) bench.perplexity, val_P, NULL);
+            report(bench, "calibration", N, D, threads, omp_get_wtime() - start, N, "points/s");
+            free(dist_P); dist_P = NULL;
+            free(X_copy); X_copy = NULL;
+
+            start = phaseStart();
+            Engine::symmetrizeMatrix(&row_P, &col_P, &val_P, N, bench.tsne.huge_pages);
+            report(bench, "symmetrization", N, D, threads, omp_get_wtime() - start, row_P[N], "nonzeros/s");
+            double sum_P = .0;
+            for(unsigned int i = 0; i < row_P[N]; i++) sum_P += val_P[i];
+            for(unsigned int i = 0; i < row_P[N]; i++) val_P[i] /= sum_P;
+
+            // Optimizer iterations on a map that already shows the clusters (a freshly initialized map would give
+            // unrealistically shallow trees)
+            int huge_pages = bench.tsne.huge_pages;
+            U* Y = (U*) allocArray((size_t) N * DIM, sizeof(U), huge_pages);
+            U* dY = (U*) allocArray((size_t) N * DIM, sizeof(U), huge_pages);
+            U* uY = (U*) allocArray((size_t) N * DIM, sizeof(U), huge_pages);
+            U* gains = (U*) allocArray((size_t) N * DIM, sizeof(U), huge_pages);
+            U* pos_f = (U*) allocArray((size_t) N * DIM, sizeof(U), huge_pages);
+            U* neg_f = (U*) allocArray((size_t) N * DIM, sizeof(U), huge_pages);
+            if(Y == NULL || dY == NULL || uY == NULL || gains == NULL || pos_f == NULL || neg_f == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+            U centers[64][DIM];
+            for(int c = 0; c < 64; c++) {
+                for(int d = 0; d < DIM; d++) centers[c][d] = randn<U>() * 20;
+            }
+            for(int n = 0; n < N; n++) {
+                for(int d = 0; d < DIM; d++) Y[n * DIM + d] = centers[labels[n] % 64][d] + randn<U>();
+            }
+            #pragma omp parallel for schedule(static)
+            for(int i = 0; i < N * DIM; i++) gains[i] = 1.0;
+            U mean_Y[DIM];
+            for(int d = 0; d < DIM; d++) mean_Y[d] = .0;
+
+            bool use_fft = (bench.tsne.repulsion == TSNE_REPULSION_FFT && DIM <= 3);
+            bool dual_tree = (bench.tsne.repulsion == TSNE_REPULSION_DUAL_TREE);
+            typename Engine::Tree* tree = use_fft ? NULL : new typename Engine::Tree();
+            FFTForces<U, DIM>* fft = use_fft ? new FFTForces<U, DIM>(bench.tsne.fft_interp_points) : NULL;
+            double tree_time = .0, attractive_time = .0, repulsive_time = .0, update_time = .0;
+            double tree_peak = .0, attractive_peak = .0, repulsive_peak = .0, update_peak = .0;
+            for(int iter = 0; iter < bench.iterations; iter++) {
+                if(tree != NULL) {
+                    start = phaseStart();
+                    Engine::updateTree(tree, Y, N, .0);
+                    tree_time += omp_get_wtime() - start; tree_peak = max(tree_peak, peakMemory());
+                }
+
+                start = phaseStart();
+                memset(pos_f, 0, (size_t) N * DIM * sizeof(U));
+                computeEdgeForces<U, DIM>(row_P, col_P, val_P, Y, N, pos_f, dY);
+                attractive_time += omp_get_wtime() - start; attractive_peak = max(attractive_peak, peakMemory());
+
+                start = phaseStart();
+                memset(neg_f, 0, (size_t) N * DIM * sizeof(U));
+                double sum_Q = Engine::computeNonEdgeForces(tree, fft, dual_tree, Y, N, (U) bench.theta, neg_f);
+                repulsive_time += omp_get_wtime() - start; repulsive_peak = max(repulsive_peak, peakMemory());
+
+                for(int i = 0; i < N * DIM; i++) dY[i] = pos_f[i] - neg_f[i] / sum_Q;
+                start = phaseStart();
+                Engine::updateMap(Y, dY, uY, gains, N, (U) .8, (U) 200, mean_Y);
+                update_time += omp_get_wtime() - start; update_peak = max(update_peak, peakMemory());
+            }
+            bool correct = checkNormalization(tree, fft, dual_tree, Y, N, D, threads, bench, neg_f);
+            double steps = (double) bench.iterations;
+            if(tree != NULL) reportPeak(bench, "tree", N, D, threads, tree_time, steps * N, "points/s", tree_peak);
+            reportPeak(bench, "attractive", N, D, threads, attractive_time, steps * row_P[N], "nonzeros/s", attractive_peak);
+            reportPeak(bench, "repulsive", N, D, threads, repulsive_time, steps * N, "points/s", repulsive_peak);
+            reportPeak(bench, "update", N, D, threads, update_time, steps * N, "points/s", update_peak);
+
+            // Clean up memory
+            delete tree;
+            delete fft;
+            freeArray(Y); freeArray(dY); freeArray(uY); freeArray(gains); freeArray(pos_f); freeArray(neg_f);
+            freeArray(row_P); freeArray(col_P); freeArray(val_P);
+            if(!correct) ok = false;
+        }
+        return ok;
+    }
+
+private:
+
+    // Relative error of the normalization term that the benchmarked engine may make on the final map
+    static const double SUM_Q_TOLERANCE;
+
+    // Checks the normalization term of the benchmarked engine on the final map against the exact one (estimated from an
+    // evenly spaced sample of the rows for large maps) and, for maps of up to three dimensions, against the other of the
+    // tree and the FFT engine; prints the failures to stderr (neg_f is used as scratch space)
+    static bool checkNormalization(typename Engine::Tree* tree, FFTForces<U, DIM>* fft, bool dual_tree, U* Y, int N, int D, int threads,
+                                   const BenchOptions& bench, U* neg_f) {
+        if(tree != NULL) Engine::updateTree(tree, Y, N, .0);
+        memset(neg_f, 0, (size_t) N * DIM * sizeof(U));
+        double sum_Q = Engine::computeNonEdgeForces(tree, fft, dual_tree, Y, N, (U) bench.theta, neg_f);
+
+        int no_rows = min(N, 2000);
+        double row_sum = .0;
+        #pragma omp parallel for schedule(static) reduction(+:row_sum)
+        for(int s = 0; s < no_rows; s++) {
+            int n = (int) ((long long) s * N / no_rows);
+            for(int m = 0; m < N; m++) {
+                if(m == n) continue;
+                double D_nm = .0;
+                for(int d = 0; d < DIM; d++) D_nm += ((double) Y[n * DIM + d] - Y[m * DIM + d]) * ((double) Y[n * DIM + d] - Y[m * DIM + d]);
+                row_sum += 1 / (1 + D_nm);
+            }
+        }
+        double exact_Q = row_sum * N / no_rows;
+        bool correct = checkSum((no_rows < N) ? "sampled exact" : "exact", sum_Q, exact_Q, N, D, threads);
+
+        // Maps of up to three dimensions can use either engine, so the other one gives an independent estimate
+        if(DIM <= 3) {
+            typename Engine::Tree* other_tree = (fft != NULL) ? new typename Engine::Tree() : NULL;
+            FFTForces<U, DIM>* other_fft = (fft != NULL) ? NULL : new FFTForces<U, DIM>(bench.tsne.fft_interp_points);
+            if(other_tree != NULL) Engine::updateTree(other_tree, Y, N, .0);
+            memset(neg_f, 0, (size_t) N * DIM * sizeof(U));
+            double other_Q = Engine::computeNonEdgeForces(other_tree, other_fft, false, Y, N, (U) bench.theta, neg_f);
+            correct = checkSum((fft != NULL) ? "tree" : "fft", sum_Q, other_Q, N, D, threads) && correct;
+            delete other_tree;
+            delete other_fft;
+        }
+        return correct;
+    }
+
+    static bool checkSum(const char* reference, double sum_Q, double reference_Q, int N, int D, int threads) {
+        double error = fabs(sum_Q - reference_Q) / reference_Q;
+        if(error <= SUM_Q_TOLERANCE) return true;
+        fprintf(stderr, "Sanity check failed for %d points in %d dimensions with %d threads: sum_Q is %g, the %s sum_Q is %g (relative error %.3f)\n",
+                N, D, threads, sum_Q, reference, reference_Q, error);
+        return false;
+    }
+
+    static double phaseStart() {
+        resetPeakMemory();
+        return omp_get_wtime();
+    }
+
+    static void report(const BenchOptions& bench, const char* phase, int N, int D, int threads, double seconds, double items, const char* unit) {
+        reportPeak(bench, phase, N, D, threads, seconds, items, unit, peakMemory());
+    }
+
+    static void reportPeak(const BenchOptions& bench, const char* phase, int N, int D, int threads, double seconds, double items, const char* unit, double peak_mb) {
+        fprintf(bench.output, "%s,%s,%d,%d,%d,%d,%.6f,%.6g,%s,%.1f\n", phase, sizeof(U) == sizeof(float) ? "float32" : "float64",
+                N, D, DIM, threads, seconds, seconds > 0 ? items / seconds : .0, unit, peak_mb);
+        fflush(bench.output);
+    }
+};
+
+template<typename U, int DIM>
+const double TSNEBench<U, DIM>::SUM_Q_TOLERANCE = .1;
+
+
+// Generates N points in D dimensions from a mixture of Gaussians (unit variance around well separated centers), and
+// runs the benchmark on them
+template<typename U>
+bool benchDataSet(int N, int D, const BenchOptions& bench) {
+    srand((unsigned int) bench.seed);
+    U* centers = (U*) malloc((size_t) bench.clusters * D * sizeof(U));
+    U* X = (U*) malloc((size_t) N * D * sizeof(U));
+    int* labels = (int*) malloc(N * sizeof(int));
+    if(centers == NULL || X == NULL || labels == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    for(int i = 0; i < bench.clusters * D; i++) centers[i] = randn<U>() * 5;
+    for(int n = 0; n < N; n++) {
+        labels[n] = rand() % bench.clusters;
+        for(int d = 0; d < D; d++) X[(size_t) n * D + d] = centers[labels[n] * D + d] + randn<U>();
+    }
+    free(centers);
+
+    bool ok;
+    switch(bench.out_dims) {
+        case 3: ok = TSNEBench<U, 3>::run(X, labels, N, D, bench); break;
+        case 5: ok = TSNEBench<U, 5>::run(X, labels, N, D, bench); break;
+        case 10: ok = TSNEBench<U, 10>::run(X, labels, N, D, bench); break;
+        default: ok = TSNEBench<U, 2>::run(X, labels, N, D, bench);
+    }
+    free(X);
+    free(labels);
+    return ok;
+}
+
+
+int main(int argc, char** argv) {
+
+    // Parse the options
+    BenchOptions bench;
+    bench.sizes = parseList("10000,100000,1000000");
+    bench.dims = parseList("10,50");
+    for(int t = 1; t < omp_get_max_threads(); t *= 2) bench.threads.push_back(t);
+    bench.threads.push_back(omp_get_max_threads());
+    bench.clusters = 10;
+    bench.iterations = 20;
+    bench.perplexity = 30;
+    bench.theta = .5;
+    bench.out_dims = 2;
+    bench.single_precision = false;
+    bench.seed = 42;
+    bench.output = stdout;
+    tsne_default_options(&bench.tsne);
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) bench.sizes = parseList(argv[++i]);
+        else if(strcmp(argv[i], "--dims") == 0 && i + 1 < argc) bench.dims = parseList(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc) bench.threads = parseList(argv[++i]);
+        else if(strcmp(argv[i], "--clusters") == 0 && i + 1 < argc) bench.clusters = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) bench.iterations = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--perplexity") == 0 && i + 1 < argc) bench.perplexity = atof(argv[++i]);
+        else if(strcmp(argv[i], "--theta") == 0 && i + 1 < argc) bench.theta = atof(argv[++i]);
+        else if(strcmp(argv[i], "--out-dims") == 0 && i + 1 < argc) bench.out_dims = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--repulsion") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "dual") == 0) bench.tsne.repulsion = TSNE_REPULSION_DUAL_TREE;
+            else if(strcmp(argv[i], "fft") == 0) bench.tsne.repulsion = TSNE_REPULSION_FFT;
+            else bench.tsne.repulsion = TSNE_REPULSION_BARNES_HUT;
+        }
+        else if(strcmp(argv[i], "--neighbors") == 0 && i + 1 < argc) {
+            i++;
+            bench.tsne.neighbors = (strcmp(argv[i], "approximate") == 0) ? TSNE_NEIGHBORS_APPROXIMATE : TSNE_NEIGHBORS_EXACT;
+        }
+        else if(strcmp(argv[i], "--float") == 0) bench.single_precision = true;
+        else if(strcmp(argv[i], "--pin-threads") == 0) bench.tsne.pin_threads = 1;
+        else if(strcmp(argv[i], "--huge-pages") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "transparent") == 0) bench.tsne.huge_pages = TSNE_HUGE_PAGES_TRANSPARENT;
+            else if(strcmp(argv[i], "explicit") == 0) bench.tsne.huge_pages = TSNE_HUGE_PAGES_EXPLICIT;
+            else bench.tsne.huge_pages = TSNE_HUGE_PAGES_OFF;
+        }
+        else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) bench.seed = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            bench.output = fopen(argv[++i], "w");
+            if(bench.output == NULL) { printf("Could not open output file %s.\n", argv[i]); return 1; }
+        }
+        else {
+            printf("Usage: %s [--sizes N,...] [--dims D,...] [--threads T,...] [--clusters C] [--iterations I] [--perplexity P] [--theta THETA] [--out-dims 2|3|5|10] [--repulsion bh|dual|fft] [--neighbors exact|approximate] [--float] [--pin-threads] [--huge-pages off|transparent|explicit] [--seed S] [--output FILE]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(bench.clusters < 1 || bench.iterations < 1 || bench.threads.empty()) { printf("Invalid benchmark settings.\n"); return 1; }
+    if(bench.tsne.pin_threads) {
+        int most_threads = *max_element(bench.threads.begin(), bench.threads.end());
+        omp_set_num_threads(most_threads);
+        if(!pinThreads()) printf("Warning: could not pin the threads.\n");
+    }
+
+    // One line per phase, data set and thread count
+    fprintf(bench.output, "phase,precision,points,dims,out_dims,threads,seconds,throughput,unit,peak_rss_mb\n");
+    bool ok = true;
+    for(size_t s = 0; s < bench.sizes.size(); s++) {
+        for(size_t d = 0; d < bench.dims.size(); d++) {
+            bool correct = bench.single_precision ? benchDataSet<float>(bench.sizes[s], bench.dims[d], bench)
+                                                  : benchDataSet<double>(bench.sizes[s], bench.dims[d], bench);
+            if(!correct) ok = false;
+        }
+    }
+    if(bench.output != stdout) fclose(bench.output);
+    return ok ? 0 : 1;
+}
@@ -1,37 +1,41 @@
 #include "tsne_core.cpp"
 
 
-// Function that loads data from a t-SNE file
-// Note: this function does a malloc that should be freed elsewhere
+// Header of a versioned data file (in version 1, the N x D data matrix follows it directly, in the given element type;
+// version 2 holds a sparse matrix, see SparseHeader); files without the magic have the original layout: N, D, theta,
+// perplexity, no_dims, max_iter, the data in doubles and optionally the random seed
+struct DataHeader {
+    char magic[4];                  // "BHTS"
+    int version;                    // 1 (dense) or 2 (sparse)
+    int element_type;               // ELEMENT_FLOAT32 or ELEMENT_FLOAT64
+    int n;                          // number of datapoints
+    int d;                          // original dimensionality
+    int no_dims;                    // output dimensionality
+    int max_iter;
+    int rand_seed;
+    double theta;                   // gradient accuracy
+    double perplexity;
+};
+
+// Follows the header of a sparse data file, and is followed by the matrix in compressed sparse row format: the nnz
+// non-zero values (in the element type of the file), the N + 1 row offsets and the nnz column indices (unsigned ints,
+// increasing within every row)
+struct SparseHeader {
+    unsigned int nnz;               // number of non-zeros
+    int metric;                     // TSNE_METRIC_EUCLIDEAN or TSNE_METRIC_COSINE
+};
+
+// The index arrays of a sparse data file, which the values are passed along with
+struct SparseIndices {
+    const unsigned int* row_ptr;
+    const unsigned int* col_idx;
+    int metric;
+};
+
+
+// Function that saves map to a t-SNE file (in the versioned format when the input was versioned)
 template<typename T>
-bool load_data(T** data, int* n, int* d, int* no_dims, int* max_iter, T* theta, T* perplexity, int* rand_seed) {
-
-	// Open file, read first 2 integers, allocate memory, and read the data
-    FILE *h;
-	if((h = fopen("data.dat", "r+b")) == NULL) {
-		printf("Error: could not open data file.\n");
-		return false;
-	}
-	fread(n, sizeof(int), 1, h);											// number of datapoints
-	fread(d, sizeof(int), 1, h);											// original dimensionality
-    fread(theta, sizeof(T), 1, h);										// gradient accuracy
-	fread(perplexity, sizeof(T), 1, h);								// perplexity
-	fread(no_dims, sizeof(int), 1, h);                                      // output dimensionality
-        fread(max_iter, sizeof(int), 1, h);
-	*data = (T*) malloc(*d * *n * sizeof(T));
-    if(*data == NULL) { printf("Memory allocation failed!\n"); exit(1); }
-    fread(*data, sizeof(T), *n * *d, h);                               // the data
-
-    *rand_seed = 0;
-    if(!feof(h)) fread(rand_seed, sizeof(int), 1, h);                       // random seed
-	fclose(h);
-    printf("Read the %i x %i data matrix successfully!\n", *n, *d);
-	return true;
-}
-
-// Function that saves map to a t-SNE file
-template<typename T>
-void save_data(T* data, int* landmarks, T* costs, int n, int d) {
+void save_data(T* data, int* landmarks, T* costs, int n, int d, bool versioned) {
 
 	// Open file, write first 2 integers and then the data
 	FILE *h;
@@ -39,6 +43,13 @@ void save_data(T* data, int* landmarks, T* costs, int n, int d) {
 		printf("Error: could not open data file.\n");
 		return;
 	}
+    if(versioned) {
+        int version = 1;
+        int element_type = (sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64;
+        fwrite("BHTS", 1, 4, h);
+        fwrite(&version, sizeof(int), 1, h);
+        fwrite(&element_type, sizeof(int), 1, h);
+    }
 	fwrite(&n, sizeof(int), 1, h);
 	fwrite(&d, sizeof(int), 1, h);
     fwrite(data, sizeof(T), n * d, h);
@@ -50,13 +61,15 @@ void save_data(T* data, int* landmarks, T* costs, int n, int d) {
 
 
 template<typename T>
-void run_tSNE_andSave(T *inputData, int N, int D, int no_dims, int max_iter, T theta, T perplexity, int rand_seed) {
+void run_tSNE_andSave(const T *inputData, int N, int D, int no_dims, int max_iter, T theta, T perplexity, int rand_seed, bool versioned,
+                      const TSNEOptions* options, const SparseIndices* sparse = NULL) {
 	// Allocate memory for the output
 	T* Y = (T*) malloc(N * no_dims * sizeof(T));
 	if(Y == NULL) { printf("Memory allocation failed!\n"); exit(1); }
 
 
-    int res = run_tSNE(inputData, Y, N, D, no_dims, max_iter, theta, perplexity, rand_seed, true);
+    int res = (sparse == NULL) ? run_tSNE(inputData, Y, N, D, no_dims, max_iter, theta, perplexity, rand_seed, true, options) :
+              run_tSNE_sparse(sparse->row_ptr, sparse->col_idx, inputData, Y, N, D, sparse->metric, no_dims, max_iter, theta, perplexity, rand_seed, true, options);
 
     if (res > 0)
         exit(res);
@@ -71,7 +84,7 @@ void run_tSNE_andSave(T *inputData, int N, int D, int no_dims, int max_iter, T t
 
 
 	// Save the results
-	save_data(Y, landmarks, costs, N, no_dims);
+	save_data(Y, landmarks, costs, N, no_dims, versioned);
 
     // Clean up the memory
 	free(Y); Y = NULL;
@@ -82,15 +95,104 @@ void run_tSNE_andSave(T *inputData, int N, int D, int no_dims, int max_iter, T t
 
 
 // Function that runs the Barnes-Hut implementation of t-SNE
-int main() {
+// Usage: bh_tsne [--checkpoint FILE] [--checkpoint-interval ITERATIONS] [--resume FILE] [--affinity-cache DIRECTORY] [--single-precision] [--cost-interval ITERATIONS] [--grad-tolerance FRACTION] [--kl-tolerance FRACTION] [--huge-pages off|transparent|explicit] [--pin-threads]
+int main(int argc, char** argv) {
+
+    // Parse the options
+    TSNEOptions options;
+    tsne_default_options(&options);
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) options.checkpoint_file = argv[++i];
+        else if(strcmp(argv[i], "--checkpoint-interval") == 0 && i + 1 < argc) options.checkpoint_interval = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--resume") == 0 && i + 1 < argc) options.resume_file = argv[++i];
+        else if(strcmp(argv[i], "--affinity-cache") == 0 && i + 1 < argc) options.affinity_cache = argv[++i];
+        else if(strcmp(argv[i], "--single-precision") == 0) options.single_precision = 1;
+        else if(strcmp(argv[i], "--cost-interval") == 0 && i + 1 < argc) options.cost_interval = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--grad-tolerance") == 0 && i + 1 < argc) options.grad_tolerance = atof(argv[++i]);
+        else if(strcmp(argv[i], "--kl-tolerance") == 0 && i + 1 < argc) options.kl_tolerance = atof(argv[++i]);
+        else if(strcmp(argv[i], "--huge-pages") == 0 && i + 1 < argc) {
+            i++;
+            if(strcmp(argv[i], "transparent") == 0) options.huge_pages = TSNE_HUGE_PAGES_TRANSPARENT;
+            else if(strcmp(argv[i], "explicit") == 0) options.huge_pages = TSNE_HUGE_PAGES_EXPLICIT;
+            else options.huge_pages = TSNE_HUGE_PAGES_OFF;
+        }
+        else if(strcmp(argv[i], "--pin-threads") == 0) options.pin_threads = 1;
+        else {
+            printf("Usage: %s [--checkpoint FILE] [--checkpoint-interval ITERATIONS] [--resume FILE] [--affinity-cache DIRECTORY] [--single-precision] [--cost-interval ITERATIONS] [--grad-tolerance FRACTION] [--kl-tolerance FRACTION] [--huge-pages off|transparent|explicit] [--pin-threads]\n", argv[0]);
+            return 1;
+        }
+    }
 
-    // Define some variables
-	int N, D, no_dims, max_iter, rand_seed;
-	double perplexity, theta, *data;
+    // Map the data file (the data matrix is used in place)
+    size_t size;
+    const char* contents = map_file("data.dat", &size);
+    if(contents == NULL) {
+		printf("Error: could not open data file.\n");
+		return 1;
+	}
 
-    // Read the parameters and the dataset
-	if(load_data<double>(&data, &N, &D, &no_dims, &max_iter, &theta, &perplexity, &rand_seed)) {
-         run_tSNE_andSave<double>(data, N, D, no_dims, max_iter, theta, perplexity, rand_seed);
-        free(data); data = NULL;
+    // Read the parameters, and run on the data in the type it was stored in
+    if(size >= sizeof(DataHeader) && memcmp(contents, "BHTS", 4) == 0) {
+        DataHeader header;
+        memcpy(&header, contents, sizeof(DataHeader));
+        size_t element_size = (header.element_type == ELEMENT_FLOAT32) ? sizeof(float) : sizeof(double);
+        SparseHeader sparse_header;
+        memset(&sparse_header, 0, sizeof(sparse_header));
+        if(header.version == 2 && size >= sizeof(DataHeader) + sizeof(SparseHeader)) memcpy(&sparse_header, contents + sizeof(DataHeader), sizeof(SparseHeader));
+        size_t data_size = (header.version == 2) ? sizeof(SparseHeader) + (size_t) sparse_header.nnz * (element_size + sizeof(unsigned int)) +
+                                                   ((size_t) header.n + 1) * sizeof(unsigned int)
+                                                 : (size_t) header.n * header.d * element_size;
+        if((header.version != 1 && header.version != 2) || (header.element_type != ELEMENT_FLOAT32 && header.element_type != ELEMENT_FLOAT64) ||
+           header.n < 0 || size < sizeof(DataHeader) + data_size) {
+            printf("Error: unsupported or truncated data file.\n");
+            unmap_file(contents, size);
+            return 1;
+        }
+        const char* data = contents + sizeof(DataHeader);
+        SparseIndices sparse;
+        if(header.version == 2) {
+            data += sizeof(SparseHeader);
+            sparse.row_ptr = (const unsigned int*) (data + (size_t) sparse_header.nnz * element_size);
+            sparse.col_idx = sparse.row_ptr + header.n + 1;
+            sparse.metric = sparse_header.metric;
+            if(sparse.row_ptr[header.n] != sparse_header.nnz) {
+                printf("Error: the row offsets do not match the number of non-zeros.\n");
+                unmap_file(contents, size);
+                return 1;
+            }
+            printf("Read the sparse %i x %i data matrix with %u non-zeros successfully!\n", header.n, header.d, sparse_header.nnz);
+        }
+        else printf("Read the %i x %i data matrix successfully!\n", header.n, header.d);
+        const SparseIndices* indices = (header.version == 2) ? &sparse : NULL;
+        if(header.element_type == ELEMENT_FLOAT32)
+            run_tSNE_andSave<float>((const float*) data, header.n, header.d, header.no_dims, header.max_iter, (float) header.theta, (float) header.perplexity, header.rand_seed, true, &options, indices);
+        else
+            run_tSNE_andSave<double>((const double*) data, header.n, header.d, header.no_dims, header.max_iter, header.theta, header.perplexity, header.rand_seed, true, &options, indices);
+    }
+    else {
+        const size_t header_size = 4 * sizeof(int) + 2 * sizeof(double);
+        int n, d, no_dims, max_iter, rand_seed = 0;
+        double theta, perplexity;
+        if(size < header_size) {
+            printf("Error: truncated data file.\n");
+            unmap_file(contents, size);
+            return 1;
+        }
+        memcpy(&n, contents, sizeof(int));                                          // number of datapoints
+        memcpy(&d, contents + sizeof(int), sizeof(int));                           // original dimensionality
+        memcpy(&theta, contents + 2 * sizeof(int), sizeof(double));               // gradient accuracy
+        memcpy(&perplexity, contents + 2 * sizeof(int) + sizeof(double), sizeof(double));
+        memcpy(&no_dims, contents + 2 * sizeof(int) + 2 * sizeof(double), sizeof(int));
+        memcpy(&max_iter, contents + 3 * sizeof(int) + 2 * sizeof(double), sizeof(int));
+        size_t data_end = header_size + (size_t) n * d * sizeof(double);
+        if(size < data_end) {
+            printf("Error: truncated data file.\n");
+            unmap_file(contents, size);
+            return 1;
+        }
+        if(size >= data_end + sizeof(int)) memcpy(&rand_seed, contents + data_end, sizeof(int));   // random seed
+        printf("Read the %i x %i data matrix successfully!\n", n, d);
+        run_tSNE_andSave<double>((const double*) (contents + header_size), n, d, no_dims, max_iter, theta, perplexity, rand_seed, false, &options);
     }
+    unmap_file(contents, size);
 }
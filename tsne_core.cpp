@@ -38,19 +38,157 @@
 #include <stdio.h>
 #include <cstring>
 #include <time.h>
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <chrono>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #include "vptree.h"
+#include "nndescent.h"
 #include "sptree.h"
 #include "tsne.h"
 #include "sptree.cpp"
+#include "kdtree.cpp"
+#include "fftforces.h"
+#include "fftforces.cpp"
+#include "edgeforces.h"
+#include "edgeforces.cpp"
+#include "checkpoint.h"
+#include "checkpoint.cpp"
+#include "allocation.h"
+#include "allocation.cpp"
 
 
 using namespace std;
 
+
+// Fills in the default settings of a run
+void tsne_default_options(TSNEOptions* options) {
+    options->refit_threshold = .0;
+    options->repulsion = TSNE_REPULSION_BARNES_HUT;
+    options->fft_interp_points = 3;
+    options->neighbors = TSNE_NEIGHBORS_EXACT;
+    options->knn_trees = 8;
+    options->knn_iterations = 10;
+    options->knn_recall_sample = 100;
+    options->model_file = NULL;
+    options->checkpoint_file = NULL;
+    options->checkpoint_interval = 50;
+    options->resume_file = NULL;
+    options->affinity_cache = NULL;
+    options->single_precision = 0;
+    options->cost_interval = 50;
+    options->stats = NULL;
+    options->callback = NULL;
+    options->callback_data = NULL;
+    options->grad_tolerance = .0;
+    options->kl_tolerance = .0;
+    options->huge_pages = TSNE_HUGE_PAGES_OFF;
+    options->pin_threads = 0;
+}
+
+
+// Maps a file into memory read-only, or reads it into memory where mapping is not available
+// Note: the result should be released with unmap_file
+const char* map_file(const char* filename, size_t* size) {
+#ifdef _WIN32
+    FILE *h;
+    if((h = fopen(filename, "rb")) == NULL) return NULL;
+    fseek(h, 0, SEEK_END);
+    *size = (size_t) ftell(h);
+    fseek(h, 0, SEEK_SET);
+    char* contents = (char*) malloc(*size);
+    if(contents == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    *size = fread(contents, 1, *size, h);
+    fclose(h);
+    return contents;
+#else
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return NULL; }
+    *size = (size_t) st.st_size;
+    void* contents = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(contents == MAP_FAILED) return NULL;
+    return (const char*) contents;
+#endif
+}
+
+void unmap_file(const char* contents, size_t size) {
+#ifdef _WIN32
+    free((void*) contents);
+#else
+    munmap((void*) contents, size);
+#endif
+}
+
+
+// Finalizer of a 64-bit hash (every input bit affects every output bit)
+static inline unsigned long long mixBits(unsigned long long x) {
+    x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// 64-bit hash of a block of memory (blocks of 1 MB are hashed in parallel and then combined in order)
+static unsigned long long hashBytes(const void* data, size_t size) {
+    const size_t chunk = 1 << 20;
+    const unsigned char* bytes = (const unsigned char*) data;
+    long long no_chunks = (long long) ((size + chunk - 1) / chunk);
+    vector<unsigned long long> hashes(no_chunks);
+    #pragma omp parallel for schedule(static)
+    for(long long c = 0; c < no_chunks; c++) {
+        const unsigned char* p = bytes + c * chunk;
+        size_t len = min(chunk, size - (size_t) c * chunk), i = 0;
+        unsigned long long h = mixBits(len);
+        for(; i + 8 <= len; i += 8) {
+            unsigned long long w;
+            memcpy(&w, p + i, 8);
+            h ^= w * 0x9e3779b97f4a7c15ULL;
+            h = ((h << 31) | (h >> 33)) * 0xbf58476d1ce4e5b9ULL;
+        }
+        for(; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ULL;
+        hashes[c] = mixBits(h);
+    }
+    unsigned long long h = mixBits(size);
+    for(long long c = 0; c < no_chunks; c++) h = mixBits(h ^ hashes[c]) + (unsigned long long) c;
+    return h;
+}
+
+// Monotonic wall-clock time in seconds (clock() would add up the CPU time of all threads)
+static double wallTime() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Releases the working memory of a run that stops early (any of the pointers may be NULL)
+template<typename T, typename Tree, int OUTDIM>
+static void freeRunState(T* dY, T* uY, T* gains, T* pos_f, T* neg_f, Tree* tree, FFTForces<T, OUTDIM>* fft,
+                         CheckpointWriter<T>* checkpoint, T* X, T* mean, T* beta) {
+    freeArray(dY); freeArray(uY); freeArray(gains); freeArray(pos_f); freeArray(neg_f);
+    delete tree;
+    delete fft;
+    delete checkpoint;
+    free(X); free(mean); free(beta);
+}
+
+
 template<typename T, int OUTDIM>// Perform t-SNE
-int TSNE<T, OUTDIM>::run(T* X, int N, int D, T* Y, T perplexity, T theta, int rand_seed,
-               bool skip_random_init, bool verbose, int max_iter, int stop_lying_iter, int mom_switch_iter) {
+int TSNE<T, OUTDIM>::run(const T* inp_X, int N, int D, T* Y, T perplexity, T theta, int rand_seed,
+               bool skip_random_init, bool verbose, int max_iter, int stop_lying_iter, int mom_switch_iter,
+               const TSNEOptions* options, const TSNEAffinities<T>* affinities) {
 
     int no_dims = OUTDIM;
+    TSNEOptions opts;
+    tsne_default_options(&opts);
+    if(options != NULL) opts = *options;
+
     // Set random seed
     if (skip_random_init != true) {
       if(rand_seed > 0) {
@@ -73,341 +211,988 @@ int TSNE<T, OUTDIM>::run(T* X, int N, int D, T* Y, T perplexity, T theta, int ra
     }
     if (verbose) {
         printf("Using no_dims = %d, perplexity = %f, and theta = %f\n", no_dims, perplexity, theta);
+        if(theta != .0) printf("Computing attractive forces with %s kernels\n", getSIMDName(getSIMDLevel()));
     }
     bool exact = (theta == .0) ? true : false;
 
-    // Set learning parameters
+    // Set learning parameters (and keep the wall-clock time of every phase, whether or not the caller asked for it)
+    TSNEStats stats;
+    memset(&stats, 0, sizeof(stats));
+    double run_start = wallTime();
     float total_time = .0;
-    clock_t start, end;
+    double start, end, phase_start;
 	T momentum = .5, final_momentum = .8;
 	T eta = 200.0;
 
-    // Allocate some memory
-    T* dY    = (T*) malloc(N * no_dims * sizeof(T));
-    T* uY    = (T*) malloc(N * no_dims * sizeof(T));
-    T* gains = (T*) malloc(N * no_dims * sizeof(T));
-    if(dY == NULL || uY == NULL || gains == NULL) {
+    // Pin the threads before any large array is touched, so its pages are placed next to the threads that use them
+    if(opts.pin_threads && !pinThreads() && verbose) printf("Warning: could not pin the threads.\n");
+
+    // Allocate some memory (the optimizer state and the forces, zero-filled by all threads)
+    T* dY    = (T*) allocArray(N * no_dims, sizeof(T), opts.huge_pages);
+    T* uY    = (T*) allocArray(N * no_dims, sizeof(T), opts.huge_pages);
+    T* gains = (T*) allocArray(N * no_dims, sizeof(T), opts.huge_pages);
+    T* pos_f = (T*) allocArray(N * no_dims, sizeof(T), opts.huge_pages);
+    T* neg_f = (T*) allocArray(N * no_dims, sizeof(T), opts.huge_pages);
+    if(dY == NULL || uY == NULL || gains == NULL || pos_f == NULL || neg_f == NULL) {
         if (verbose) {
             printf("Memory allocation failed!\n");
         }
+        freeArray(dY); freeArray(uY); freeArray(gains); freeArray(pos_f); freeArray(neg_f);
         return 1;
     }
 
-    for(int i = 0; i < N * no_dims; i++)    uY[i] =  .0;
+    #pragma omp parallel for schedule(static)
     for(int i = 0; i < N * no_dims; i++) gains[i] = 1.0;
 
-    // Normalize input data (to prevent numerical problems)
-    if (verbose) {
-        printf("Computing input similarities...\n");
+    // Initialize solution (randomly, before anything else draws random numbers, so the seed alone determines it whether
+    // or not the input similarities come from the cache)
+    if (skip_random_init != true) {
+        for(int i = 0; i < N * no_dims; i++) Y[i] = randn<T>() * .0001;
     }
 
-    start = clock();
-    zeroMean(X, N, D);
+    // The repulsive forces come from either a space-partitioning tree or the FFT grid, which both keep their buffers
+    // alive across iterations (the grid grows exponentially with the dimension, so maps of more than three dimensions
+    // always use the tree, and its cost does not shrink with N, so small data sets do too)
+    bool use_fft = (opts.repulsion == TSNE_REPULSION_FFT && OUTDIM <= 3 && N >= FFT_MIN_POINTS);
+    if(verbose && opts.repulsion == TSNE_REPULSION_FFT && OUTDIM > 3) printf("FFT repulsion needs a map of up to three dimensions, using the tree instead\n");
+    else if(verbose && opts.repulsion == TSNE_REPULSION_FFT && !use_fft) printf("FFT repulsion needs at least %d points to pay off, using the tree instead\n", FFT_MIN_POINTS);
+    bool wide_boxes = false;
+    bool dual_tree = (opts.repulsion == TSNE_REPULSION_DUAL_TREE);
+    Tree* tree = (exact || use_fft) ? NULL : new Tree();
+    FFTForces<T, OUTDIM>* fft = (exact || !use_fft) ? NULL : new FFTForces<T, OUTDIM>(opts.fft_interp_points);
+
+    // A saved model also needs the normalization and the kernel precisions of the reference points, and checkpoints and
+    // the affinity cache keep the precisions for it
+    bool save_model = (opts.model_file != NULL);
+    bool resume = (opts.resume_file != NULL);
+    CheckpointWriter<T>* checkpoint = (opts.checkpoint_file == NULL || opts.checkpoint_interval <= 0) ? NULL : new CheckpointWriter<T>(opts.checkpoint_file);
+    T* X = NULL; T* mean = NULL; T* beta = NULL;
+    if(save_model || checkpoint != NULL || opts.affinity_cache != NULL) {
+        beta = (T*) malloc(N * sizeof(T));
+        if(save_model) mean = (T*) malloc(D * sizeof(T));
+        if(beta == NULL || (save_model && mean == NULL)) {
+            if (verbose) {
+                printf("Memory allocation failed!\n");
+            }
+            freeRunState(dY, uY, gains, pos_f, neg_f, tree, fft, checkpoint, X, mean, beta);
+            return 1;
+        }
+    }
+
+    // Look up the input similarities of approximate t-SNE in the cache, under a hash of the input and the settings that
+    // determine them
+    start = wallTime();
+    T* P = NULL; unsigned int* row_P = NULL; unsigned int* col_P = NULL; T* val_P = NULL;
+    bool cached = false;
+    bool shared = (!resume && !exact && affinities != NULL);          // precomputed input similarities, owned by the caller
+    string cache_file;
+    if(!resume && !exact && !shared && opts.affinity_cache != NULL) {
+        cache_file = getAffinityCacheFile(opts.affinity_cache, inp_X, N, D, perplexity, opts);
+        cached = loadAffinities(cache_file.c_str(), N, &row_P, &col_P, &val_P, beta, opts.huge_pages);
+        if (verbose) {
+            if(cached) printf("Loaded input similarities from %s\n", cache_file.c_str());
+            else printf("Input similarities are not in the cache yet\n");
+        }
+    }
+
+    // Normalize input data (to prevent numerical problems) in a working buffer, so the input itself is only read
+    // (and may be a read-only memory mapping)
     T max_X = .0;
-    for(int i = 0; i < N * D; i++) {
-        if(fabs(X[i]) > max_X) max_X = fabs(X[i]);
+    if((!resume && !cached && !shared) || save_model) {
+        X = (T*) malloc((size_t) N * D * sizeof(T));
+        if(X == NULL) {
+            if (verbose) {
+                printf("Memory allocation failed!\n");
+            }
+            freeRunState(dY, uY, gains, pos_f, neg_f, tree, fft, checkpoint, X, mean, beta);
+            freeArray(row_P); freeArray(col_P); freeArray(val_P);          // loaded from the cache, if at all
+            return 1;
+        }
+        phase_start = wallTime();
+        memcpy(X, inp_X, (size_t) N * D * sizeof(T));
+        zeroMean(X, N, D, mean);
+        for(size_t i = 0; i < (size_t) N * D; i++) {
+            if(fabs(X[i]) > max_X) max_X = fabs(X[i]);
+        }
+        for(size_t i = 0; i < (size_t) N * D; i++) X[i] /= max_X;
+        stats.centering = wallTime() - phase_start;
+    }
+
+    // The map is centered one iteration late by the fused update, which keeps the current mean of Y in mean_Y
+    T mean_Y[OUTDIM];
+    for(int d = 0; d < OUTDIM; d++) {
+        double sum = .0;
+        for(int n = 0; n < N; n++) sum += Y[n * OUTDIM + d];
+        mean_Y[d] = (T) (sum / N);
+    }
+
+    // Continue from a checkpoint, which holds the input similarities and the state of the optimization
+    int first_iter = 0;
+    bool lying = true;
+    if(resume) {
+        if (verbose) {
+            printf("Resuming from %s...\n", opts.resume_file);
+        }
+        if(!readCheckpoint(opts.resume_file, N, exact, Y, uY, gains, mean_Y, beta, &P, &row_P, &col_P, &val_P, &first_iter, &momentum, &lying, opts.huge_pages, verbose)) {
+            freeRunState(dY, uY, gains, pos_f, neg_f, tree, fft, checkpoint, X, mean, beta);
+            return 1;
+        }
+    }
+
+    // Use the input similarities shared by the runs of a batch, or computed from sparse input (they are only read)
+    else if(shared) {
+        row_P = affinities->row_P;
+        col_P = affinities->col_P;
+        val_P = affinities->val_P;
+        if(beta != NULL) memcpy(beta, affinities->beta, N * sizeof(T));
     }
-    for(int i = 0; i < N * D; i++) X[i] /= max_X;
 
     // Compute input similarities for exact t-SNE
-    T* P; unsigned int* row_P; unsigned int* col_P; T* val_P;
-    if(exact) {
+    else if(exact) {
+        if (verbose) {
+            printf("Computing input similarities...\n");
+        }
 
         // Compute similarities
         if (verbose) {
             printf("Exact?");
         }
-        P = (T*) malloc(N * N * sizeof(T));
+        P = (T*) malloc((size_t) N * N * sizeof(T));
         if(P == NULL) {
             if (verbose) {
                 printf("Memory allocation failed!\n");
             }
+            freeRunState(dY, uY, gains, pos_f, neg_f, tree, fft, checkpoint, X, mean, beta);
             return 1;
         }
-        computeGaussianPerplexity(X, N, D, P, perplexity);
+        phase_start = wallTime();
+        computeGaussianPerplexity(X, N, D, P, perplexity, beta);
+        stats.calibration = wallTime() - phase_start;
 
         // Symmetrize input similarities
         if (verbose) {
             printf("Symmetrizing...\n");
         }
-
-        int nN = 0;
+        phase_start = wallTime();
+        #pragma omp parallel for schedule(dynamic, 16)
         for(int n = 0; n < N; n++) {
-            int mN = (n + 1) * N;
             for(int m = n + 1; m < N; m++) {
-                P[nN + m] += P[mN + n];
-                P[mN + n]  = P[nN + m];
-                mN += N;
+                P[(size_t) n * N + m] += P[(size_t) m * N + n];
+                P[(size_t) m * N + n]  = P[(size_t) n * N + m];
             }
-            nN += N;
         }
-        T sum_P = .0;
-        for(int i = 0; i < N * N; i++) sum_P += P[i];
-        for(int i = 0; i < N * N; i++) P[i] /= sum_P;
+        double sum_P = .0;
+        #pragma omp parallel for reduction(+:sum_P)
+        for(size_t i = 0; i < (size_t) N * N; i++) sum_P += P[i];
+        #pragma omp parallel for
+        for(size_t i = 0; i < (size_t) N * N; i++) P[i] /= (T) sum_P;
+        stats.symmetrization = wallTime() - phase_start;
     }
 
-    // Compute input similarities for approximate t-SNE
-    else {
+    // Compute input similarities for approximate t-SNE (unless they came from the cache)
+    else if(!cached) {
+        if (verbose) {
+            printf("Computing input similarities...\n");
+        }
 
         // Compute asymmetric pairwise input similarities
-        computeGaussianPerplexity(X, N, D, &row_P, &col_P, &val_P, perplexity, (int) (3 * perplexity), verbose);
+        computeGaussianPerplexity(X, N, D, &row_P, &col_P, &val_P, perplexity, (int) (3 * perplexity), verbose, opts, beta, &stats);
 
         // Symmetrize input similarities
-        symmetrizeMatrix(&row_P, &col_P, &val_P, N);
-        T sum_P = .0;
-        for(int i = 0; i < row_P[N]; i++) sum_P += val_P[i];
-        for(int i = 0; i < row_P[N]; i++) val_P[i] /= sum_P;
+        phase_start = wallTime();
+        symmetrizeMatrix(&row_P, &col_P, &val_P, N, opts.huge_pages);
+        double sum_P = .0;
+        int no_elem = (int) row_P[N];
+        #pragma omp parallel for reduction(+:sum_P)
+        for(int i = 0; i < no_elem; i++) sum_P += val_P[i];
+        #pragma omp parallel for
+        for(int i = 0; i < no_elem; i++) val_P[i] /= sum_P;
+        stats.symmetrization = wallTime() - phase_start;
+
+        // Add them to the cache for later runs on the same data
+        if(opts.affinity_cache != NULL) {
+            bool saved = saveAffinities(cache_file.c_str(), N, row_P, col_P, val_P, beta);
+            if (verbose) {
+                if(saved) printf("Saved input similarities to %s\n", cache_file.c_str());
+                else printf("Warning: could not write affinity cache file.\n");
+            }
+        }
     }
-    end = clock();
-
-    // Lie about the P-values
-    if(exact) { for(int i = 0; i < N * N; i++)        P[i] *= 12.0; }
-    else {      for(int i = 0; i < row_P[N]; i++) val_P[i] *= 12.0; }
-
-	// Initialize solution (randomly)
-  if (skip_random_init != true) {
-  	for(int i = 0; i < N * no_dims; i++) Y[i] = randn<T>() * .0001;
-  }
+    if(!save_model) { free(X); X = NULL; }                              // the input is not needed anymore
+    end = wallTime();
 
 	// Perform main training loop
     if (verbose) {
-        if(exact) printf("Input similarities computed in %4.2f seconds!\nLearning embedding...\n", (float) (end - start) / CLOCKS_PER_SEC);
-        else printf("Input similarities computed in %4.2f seconds (sparsity = %f)!\nLearning embedding...\n", (float) (end - start) / CLOCKS_PER_SEC, (T) row_P[N] / ((T) N * (T) N));
+        if(resume) printf("Resumed at iteration %d!\nLearning embedding...\n", first_iter);
+        else if(exact) printf("Input similarities computed in %4.2f seconds!\nLearning embedding...\n", end - start);
+        else if(shared) printf("Using precomputed input similarities (sparsity = %f)!\nLearning embedding...\n", (T) row_P[N] / ((T) N * (T) N));
+        else printf("Input similarities computed in %4.2f seconds (sparsity = %f)!\nLearning embedding...\n", end - start, (T) row_P[N] / ((T) N * (T) N));
     }
-    start = clock();
+    start = wallTime();
 
-	for(int iter = 0; iter < max_iter; iter++) {
 
-        // Compute (approximate) gradient
-        if(exact) computeExactGradient(P, Y, N, dY);
-        else computeGradient(P, row_P, col_P, val_P, Y, N, dY, theta);
+    // The approximate error comes with the gradient of the iteration it is reported at: only the entropy of P is left to add
+    int report_interval = (opts.cost_interval > 0) ? opts.cost_interval : 50;
+    double P_entropy = .0;
+    if(!exact && opts.cost_interval > 0) {
+        #pragma omp parallel for reduction(+:P_entropy)
+        for(unsigned int i = 0; i < row_P[N]; i++) {
+            if(val_P[i] > 0) P_entropy += val_P[i] * log((double) val_P[i]);
+        }
+    }
 
-        // Update gains
-        for(int i = 0; i < N * no_dims; i++) gains[i] = (sign(dY[i]) != sign(uY[i])) ? (gains[i] + .2) : (gains[i] * .8);
-        for(int i = 0; i < N * no_dims; i++) if(gains[i] < .01) gains[i] = .01;
+    // Early stopping compares the gradient norm with the largest one since early exaggeration ended, and the error with
+    // the one of the previous report
+    double max_grad_norm = .0, error = -1.0, last_error = -1.0;
+    int error_iter = -1;
 
-        // Perform gradient update (with momentum and gains)
-        for(int i = 0; i < N * no_dims; i++) uY[i] = momentum * uY[i] - eta * gains[i] * dY[i];
-		for(int i = 0; i < N * no_dims; i++)  Y[i] = Y[i] + uY[i];
+	for(int iter = first_iter; iter < max_iter; iter++) {
 
-        // Make solution zero-mean
-		zeroMean(Y, N, no_dims);
+        // Lie about the P-values (by scaling their forces rather than P itself)
+        T exaggeration = lying ? 12.0 : 1.0;
+        bool exaggerated = lying;
+        bool report = (iter > first_iter && (iter % report_interval == 0 || iter == max_iter - 1));
+        bool eval_cost = report && opts.cost_interval > 0;
 
-        // Stop lying about the P-values after a while, and switch momentum
-        if(iter == stop_lying_iter) {
-            if(exact) { for(int i = 0; i < N * N; i++)        P[i] /= 12.0; }
-            else      { for(int i = 0; i < row_P[N]; i++) val_P[i] /= 12.0; }
+        // Compute (approximate) gradient
+        double cross_entropy = .0;
+        if(exact) {
+            phase_start = wallTime();
+            computeExactGradient(P, Y, N, dY, exaggeration);
+            stats.repulsive += wallTime() - phase_start;
         }
+        else {
+            if(tree != NULL) {
+                phase_start = wallTime();
+                updateTree(tree, Y, N, iter > stop_lying_iter ? opts.refit_threshold : .0);
+                stats.tree_build += wallTime() - phase_start;
+            }
+            computeGradient(tree, fft, dual_tree, row_P, col_P, val_P, Y, N, dY, theta, exaggeration, pos_f, neg_f, eval_cost ? &cross_entropy : NULL, &stats);
+            if(fft != NULL && !wide_boxes && fft->getBoxWidth() > 1.0) {
+                wide_boxes = true;
+                if (verbose) {
+                    printf("Warning: the map has outgrown the FFT grid, its boxes are %.2f wide and the repulsive forces lose accuracy\n", fft->getBoxWidth());
+                }
+            }
+        }
+
+        // Update gains, perform gradient update (with momentum and gains), and make solution zero-mean
+        phase_start = wallTime();
+        double grad_norm = sqrt(updateMap(Y, dY, uY, gains, N, momentum, eta, mean_Y));
+        stats.update += wallTime() - phase_start;
+        stats.iterations++;
+
+        // Stop lying about the P-values after a while, and switch momentum
+        if(lying && iter >= stop_lying_iter) lying = false;
         if(iter == mom_switch_iter) momentum = final_momentum;
+        exaggeration = lying ? 12.0 : 1.0;
 
         // Print out progress
-        if (iter > 0 && (iter % 50 == 0 || iter == max_iter - 1)) {
-            end = clock();
-            T C = .0;
-            if(exact) C = evaluateError(P, Y, N);
-            else      C = evaluateError(row_P, col_P, val_P, Y, N, theta);  // doing approximate computation here!
+        if (report) {
+            end = wallTime();
+            double C = .0;
+            if(eval_cost) {
+                phase_start = wallTime();
+                if(exact) C = evaluateError(P, Y, N, exaggeration);
+                else C = exaggeration * (P_entropy + log((double) exaggeration) + cross_entropy);     // doing approximate computation here!
+                stats.error += wallTime() - phase_start;
+                error = C; error_iter = iter;
+            }
             if (verbose) {
-                if(iter == 0)
-                    printf("Iteration %d: error is %f\n", iter + 1, C);
-                else {
-                    total_time += (float) (end - start) / CLOCKS_PER_SEC;
-                    printf("Iteration %d: error is %f (50 iterations in %4.2f seconds)\n", iter, C, (float) (end - start) / CLOCKS_PER_SEC);
-                }
+                total_time += end - start;
+                if(eval_cost) printf("Iteration %d: error is %f (%d iterations in %4.2f seconds)\n", iter, C, report_interval, end - start);
+                else printf("Iteration %d (%d iterations in %4.2f seconds)\n", iter, report_interval, end - start);
+            }
+			start = wallTime();
+        }
+
+        // Stop once the gradient or the error has flattened out, or when the callback asks for it
+        const char* stop = NULL;
+        if(!exaggerated) {
+            max_grad_norm = max(max_grad_norm, grad_norm);
+            if(opts.grad_tolerance > 0 && grad_norm < opts.grad_tolerance * max_grad_norm) stop = "the gradient has flattened out";
+        }
+        if(eval_cost) {
+            if(!lying && opts.kl_tolerance > 0 && last_error >= 0 && last_error - error < opts.kl_tolerance * last_error) stop = "the error has flattened out";
+            last_error = lying ? -1.0 : error;                                  // exaggerated errors are not comparable
+        }
+        if(opts.callback != NULL) {
+            TSNEProgress progress;
+            progress.iteration = iter;
+            progress.gradient_norm = grad_norm;
+            progress.error = error;
+            progress.error_iteration = error_iter;
+            progress.Y = Y;
+            progress.element_type = (sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64;
+            progress.n = N;
+            progress.no_dims = no_dims;
+            if(opts.callback(&progress, opts.callback_data) != 0) stop = "the callback asked to stop";
+        }
+        if(stop != NULL) {
+            if (verbose) {
+                printf("Stopped at iteration %d: %s\n", iter, stop);
             }
-			start = clock();
+            break;
+        }
+
+        // Save a checkpoint in the background (the optimizer continues as soon as the map and its state are copied)
+        if(checkpoint != NULL && (iter + 1) % opts.checkpoint_interval == 0 && iter + 1 < max_iter) {
+            CheckpointHeader header;
+            memset(&header, 0, sizeof(header));
+            memcpy(header.magic, "BHTC", 4);
+            header.version = 2;
+            header.element_type = (sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64;
+            header.n = N;
+            header.no_dims = no_dims;
+            header.exact = exact ? 1 : 0;
+            header.iter = iter + 1;
+            header.lying = lying ? 1 : 0;
+            header.momentum = momentum;
+            header.no_elem = exact ? (unsigned long long) N * N : row_P[N];
+            checkpoint->write(header, Y, uY, gains, mean_Y, beta, exact ? P : val_P, row_P, col_P);
         }
     }
-    end = clock(); total_time += (float) (end - start) / CLOCKS_PER_SEC;
+    end = wallTime(); total_time += end - start;
+    for(int n = 0; n < N; n++) {
+        for(int d = 0; d < OUTDIM; d++) Y[n * OUTDIM + d] -= mean_Y[d];
+    }
+    if(checkpoint != NULL) {
+        if(!checkpoint->wait() && verbose) printf("Warning: could not write checkpoint file.\n");
+        delete checkpoint;
+    }
 
     // Clean up memory
-    free(dY);
-    free(uY);
-    free(gains);
+    freeArray(dY);
+    freeArray(uY);
+    freeArray(gains);
+    freeArray(pos_f);
+    freeArray(neg_f);
     if(exact) free(P);
     else {
-        free(row_P); row_P = NULL;
-        free(col_P); col_P = NULL;
-        free(val_P); val_P = NULL;
+        delete tree;
+        delete fft;
+        if(!shared) {
+            freeArray(row_P);
+            freeArray(col_P);
+            freeArray(val_P);
+        }
+        row_P = NULL; col_P = NULL; val_P = NULL;
     }
 
     if (verbose) {
         printf("Fitting performed in %4.2f seconds.\n", total_time);
     }
 
+    // Save the model
+    bool saved = !save_model || saveModel(opts.model_file, X, N, D, mean, max_X, beta, Y, perplexity, theta);
+    free(X); X = NULL;
+    free(mean); mean = NULL;
+    free(beta); beta = NULL;
+    if(!saved) {
+        if (verbose) {
+            printf("Error: could not write model file.\n");
+        }
+        return 1;
+    }
+    if (save_model && verbose) {
+        printf("Saved the model to %s\n", opts.model_file);
+    }
+    stats.total = wallTime() - run_start;
+    if(opts.stats != NULL) *opts.stats = stats;
+
     return 0;
 }
 
 
-// Compute gradient of the t-SNE cost function (using Barnes-Hut algorithm)
+// Places new points into the map of a saved model: every new point gets a row of input similarities to its nearest
+// reference points (calibrated to the given perplexity, or the one of the model if it is not positive), starts at the
+// weighted mean of those neighbors in the map, and is then optimized against the fixed reference map on its own, so the
+// cost grows with the number of new points rather than with the size of the model
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::computeGradient(T* P, unsigned int* inp_row_P, unsigned int* inp_col_P, T* inp_val_P, T* Y, int N, T* dC, T theta)
-{
+int TSNE<T, OUTDIM>::transform(const TSNEModel<T, OUTDIM>* model, const T* inp_X, int N, T* Y, T perplexity, int max_iter, bool verbose) {
 
-    // Construct space-partitioning tree on current map
-    SPTree<T, OUTDIM>* tree = new SPTree<T, OUTDIM>(Y, N);
+    int D = model->D;
+    if(perplexity <= .0) perplexity = model->perplexity;
+    if(model->N < 3 * perplexity) {
+        if (verbose) {
+            printf("Perplexity too large for the number of reference points!\n");
+        }
+        return 1;
+    }
+    int K = (int) (3 * perplexity);
+    T theta = (model->theta > .0) ? model->theta : .5;                 // exact models still place points approximately
 
-    // Compute all terms required for t-SNE gradient
-    T sum_Q = .0;
-    T* pos_f = (T*) calloc(N * OUTDIM, sizeof(T));
-    T* neg_f = (T*) calloc(N * OUTDIM, sizeof(T));
-    if(pos_f == NULL || neg_f == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    // Set learning parameters
+    float total_time = .0;
+    double start, end;
+    T momentum = .5, final_momentum = .8;
+    T eta = 1.0;
+    int mom_switch_iter = max_iter / 4;
 
-    tree->computeEdgeForces(inp_row_P, inp_col_P, inp_val_P, N, pos_f);
+    // Allocate some memory
+    unsigned int* col_P = (unsigned int*) malloc((size_t) N * K * sizeof(unsigned int));
+    T* val_P = (T*) malloc((size_t) N * K * sizeof(T));
+    T* uY    = (T*) malloc(N * OUTDIM * sizeof(T));
+    T* gains = (T*) malloc(N * OUTDIM * sizeof(T));
+    if(col_P == NULL || val_P == NULL || uY == NULL || gains == NULL) {
+        if (verbose) {
+            printf("Memory allocation failed!\n");
+        }
+        free(col_P); free(val_P); free(uY); free(gains);
+        return 1;
+    }
+    for(int i = 0; i < N * OUTDIM; i++)    uY[i] =  .0;
+    for(int i = 0; i < N * OUTDIM; i++) gains[i] = 1.0;
 
-    #pragma omp parallel for schedule(guided) reduction(+:sum_Q)
-    for(int n = 0; n < N; n++) {
-        sum_Q += tree->computeNonEdgeForces(n, theta, neg_f + n * OUTDIM);
+    // Normalize every new point like the reference data, find its neighbors and calibrate its Gaussian kernel
+    if (verbose) {
+        printf("Computing input similarities to the %d reference points...\n", model->N);
     }
+    start = wallTime();
+    #pragma omp parallel
+    {
+        T* x = (T*) malloc(D * sizeof(T));
+        int* indices = (int*) malloc(K * sizeof(int));
+        T* distances = (T*) malloc(K * sizeof(T));
+        if(x == NULL || indices == NULL || distances == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+
+        #pragma omp for schedule(dynamic, 64)
+        for(int n = 0; n < N; n++) {
+            for(int d = 0; d < D; d++) x[d] = (inp_X[(size_t) n * D + d] - model->mean[d]) / model->scale;
+            model->index->search((const T*) x, K, indices, distances);
+            T* P_n = val_P + (size_t) n * K;
+            computeGaussianRow(distances, K, perplexity, P_n);
+
+            // Start at the weighted mean of the neighbors in the map
+            for(int d = 0; d < OUTDIM; d++) Y[n * OUTDIM + d] = .0;
+            for(int k = 0; k < K; k++) {
+                col_P[(size_t) n * K + k] = (unsigned int) indices[k];
+                for(int d = 0; d < OUTDIM; d++) Y[n * OUTDIM + d] += P_n[k] * model->Y[indices[k] * OUTDIM + d];
+            }
+        }
+        free(x);
+        free(indices);
+        free(distances);
+    }
+    end = wallTime();
+    if (verbose) {
+        printf("Input similarities computed in %4.2f seconds!\nPlacing %d points...\n", end - start, N);
+    }
+    start = wallTime();
+
+    // Every new point only interacts with the reference points, so each one minimizes the divergence between its own
+    // row of input similarities and its row of (normalized) map similarities
+    for(int iter = 0; iter < max_iter; iter++) {
+        bool report = (iter > 0 && (iter % 50 == 0 || iter == max_iter - 1));
+        double C = .0;
+        #pragma omp parallel for schedule(guided) reduction(+:C)
+        for(int n = 0; n < N; n++) {
+            T* y = Y + n * OUTDIM;
+            const T* P_n = val_P + (size_t) n * K;
+            const unsigned int* col_n = col_P + (size_t) n * K;
+
+            // Attractive forces of the neighbors and repulsive forces of the whole reference map
+            T attr[OUTDIM] = {}, neg_f[OUTDIM] = {};
+            for(int k = 0; k < K; k++) {
+                T diff[OUTDIM];
+                T D_nm = 1.0;
+                for(int d = 0; d < OUTDIM; d++) { diff[d] = y[d] - model->Y[col_n[k] * OUTDIM + d]; D_nm += diff[d] * diff[d]; }
+                T mult = P_n[k] / D_nm;
+                for(int d = 0; d < OUTDIM; d++) attr[d] += mult * diff[d];
+                if(report && P_n[k] > numeric_limits<T>::min()) C += P_n[k] * log(P_n[k] * D_nm);
+            }
+            T sum_Q = model->map_tree->computeNonEdgeForces((const T*) y, theta, neg_f);
+            if(report) C += log(sum_Q);
+
+            // Perform gradient update (with momentum and gains)
+            for(int d = 0; d < OUTDIM; d++) {
+                int i = n * OUTDIM + d;
+                T dY = attr[d] - (neg_f[d] / sum_Q);
+                gains[i] = (sign(dY) != sign(uY[i])) ? (gains[i] + (T) .2) : (gains[i] * (T) .8);
+                if(gains[i] < (T) .01) gains[i] = .01;
+                uY[i] = momentum * uY[i] - eta * gains[i] * dY;
+                y[d] += uY[i];
+            }
+        }
+        if(iter == mom_switch_iter) momentum = final_momentum;
 
-    // Compute final t-SNE gradient
-    for(int i = 0; i < N * OUTDIM; i++) {
-        dC[i] = pos_f[i] - (neg_f[i] / sum_Q);
+        // Print out progress (the error is the mean divergence of the rows of the new points)
+        if (report) {
+            end = wallTime();
+            total_time += end - start;
+            if (verbose) {
+                printf("Iteration %d: error is %f (50 iterations in %4.2f seconds)\n", iter, C / N, end - start);
+            }
+            start = wallTime();
+        }
     }
-    free(pos_f);
-    free(neg_f);
-    delete tree;
+    end = wallTime(); total_time += end - start;
+
+    // Clean up memory
+    free(col_P); col_P = NULL;
+    free(val_P); val_P = NULL;
+    free(uY); uY = NULL;
+    free(gains); gains = NULL;
+
+    if (verbose) {
+        printf("Placement performed in %4.2f seconds.\n", total_time);
+    }
+    return 0;
 }
 
-// Compute gradient of the t-SNE cost function (exact)
+
+// Returns the name of the cache file for the input similarities of a data set: the hash covers the input as given and
+// all settings that change P (the random seed of approximate neighbors is left out, as it only changes which few
+// neighbors are missed)
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::computeExactGradient(T* P, T* Y, int N, T* dC) {
+string TSNE<T, OUTDIM>::getAffinityCacheFile(const char* directory, const T* X, int N, int D, T perplexity, const TSNEOptions& opts) {
+    unsigned long long key = hashBytes(X, (size_t) N * D * sizeof(T));
+    double settings[6] = {(double) N, (double) D, (double) sizeof(T), (double) perplexity, (double) opts.neighbors, .0};
+    if(opts.neighbors == TSNE_NEIGHBORS_APPROXIMATE) settings[5] = opts.knn_trees * 1000.0 + opts.knn_iterations;
+    key = mixBits(key ^ hashBytes(settings, sizeof(settings)));
+    char name[64];
+    sprintf(name, "affinities_%016llx.bin", key);
+    string filename = directory;
+    if(!filename.empty() && filename[filename.size() - 1] != '/' && filename[filename.size() - 1] != '\\') filename += '/';
+    return filename + name;
+}
 
-	// Make sure the current gradient contains zeros
-	for(int i = 0; i < N * OUTDIM; i++) dC[i] = 0.0;
 
-    // Compute the squared Euclidean distance matrix
-    T* DD = (T*) malloc(N * N * sizeof(T));
-    if(DD == NULL) { printf("Memory allocation failed!\n"); exit(1); }
-    computeSquaredEuclideanDistance(Y, N, OUTDIM, DD);
+// Loads cached input similarities (P is allocated here, as in computeGaussianPerplexity); returns false if the file
+// does not exist or does not match
+template<typename T, int OUTDIM>
+bool TSNE<T, OUTDIM>::loadAffinities(const char* filename, int N, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, T* beta, int huge_pages) {
+    size_t size;
+    const char* contents = map_file(filename, &size);
+    if(contents == NULL) return false;
+
+    // Check the header and the size of the arrays behind it
+    AffinityCacheHeader header;
+    bool valid = size >= sizeof(header);
+    if(valid) {
+        memcpy(&header, contents, sizeof(header));
+        valid = memcmp(header.magic, "BHTP", 4) == 0 && header.version == 1 &&
+                header.element_type == ((sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64) && header.n == N &&
+                size >= sizeof(header) + (header.no_elem + N) * sizeof(T) + (N + 1 + header.no_elem) * sizeof(unsigned int);
+    }
+    if(!valid) {
+        unmap_file(contents, size);
+        return false;
+    }
 
-    // Compute Q-matrix and normalization sum
-    T* Q    = (T*) malloc(N * N * sizeof(T));
-    if(Q == NULL) { printf("Memory allocation failed!\n"); exit(1); }
-    T sum_Q = .0;
-    int nN = 0;
-    for(int n = 0; n < N; n++) {
-    	for(int m = 0; m < N; m++) {
-            if(n != m) {
-                Q[nN + m] = 1 / (1 + DD[nN + m]);
-                sum_Q += Q[nN + m];
-            }
+    // Copy the matrix (it is changed in place later on)
+    *_row_P = (unsigned int*) allocArray(N + 1, sizeof(unsigned int), huge_pages);
+    *_col_P = (unsigned int*) allocArray(header.no_elem, sizeof(unsigned int), huge_pages);
+    *_val_P = (T*) allocArray(header.no_elem, sizeof(T), huge_pages);
+    if(*_row_P == NULL || *_col_P == NULL || *_val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    const T* data = (const T*) (contents + sizeof(header));
+    const unsigned int* indices = (const unsigned int*) (data + header.no_elem + N);
+    memcpy(*_val_P, data, header.no_elem * sizeof(T));
+    if(beta != NULL) memcpy(beta, data + header.no_elem, N * sizeof(T));
+    memcpy(*_row_P, indices, (N + 1) * sizeof(unsigned int));
+    memcpy(*_col_P, indices + N + 1, header.no_elem * sizeof(unsigned int));
+    unmap_file(contents, size);
+    return true;
+}
+
+
+// Writes input similarities to the cache (through a temporary file, so concurrent runs never see a partial file)
+template<typename T, int OUTDIM>
+bool TSNE<T, OUTDIM>::saveAffinities(const char* filename, int N, const unsigned int* row_P, const unsigned int* col_P, const T* val_P, const T* beta) {
+    AffinityCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BHTP", 4);
+    header.version = 1;
+    header.element_type = (sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64;
+    header.n = N;
+    header.no_elem = row_P[N];
+
+    string temp_filename = string(filename) + ".tmp";
+    FILE *h;
+    if((h = fopen(temp_filename.c_str(), "wb")) == NULL) return false;
+    bool ok = fwrite(&header, sizeof(header), 1, h) == 1 &&
+              fwrite(val_P, sizeof(T), header.no_elem, h) == header.no_elem &&
+              fwrite(beta, sizeof(T), N, h) == (size_t) N &&
+              fwrite(row_P, sizeof(unsigned int), N + 1, h) == (size_t) N + 1 &&
+              fwrite(col_P, sizeof(unsigned int), header.no_elem, h) == header.no_elem;
+    if(fclose(h) != 0) ok = false;
+#ifdef _WIN32
+    if(ok) remove(filename);
+#endif
+    if(!ok || rename(temp_filename.c_str(), filename) != 0) {
+        remove(temp_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+// Restores the input similarities and the state of the optimization from a checkpoint of a run on the same number of
+// points with the same output dimensionality and method (P is allocated here, as in computeGaussianPerplexity)
+template<typename T, int OUTDIM>
+bool TSNE<T, OUTDIM>::readCheckpoint(const char* filename, int N, bool exact, T* Y, T* uY, T* gains, T* mean_Y, T* beta, T** P, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, int* iter, T* momentum, bool* lying, int huge_pages, bool verbose) {
+    size_t size;
+    const char* contents = map_file(filename, &size);
+    if(contents == NULL) {
+        if (verbose) {
+            printf("Error: could not open checkpoint file.\n");
         }
-        nN += N;
+        return false;
     }
 
-	// Perform the computation of the gradient
-    nN = 0;
-    int nD = 0;
-	for(int n = 0; n < N; n++) {
-        int mD = 0;
-    	for(int m = 0; m < N; m++) {
-            if(n != m) {
-                T mult = (P[nN + m] - (Q[nN + m] / sum_Q)) * Q[nN + m];
-                for(int d = 0; d < OUTDIM; d++) {
-                    dC[nD + d] += (Y[nD + d] - Y[mD + d]) * mult;
-                }
-            }
-            mD +=OUTDIM;
-		}
-        nN += N;
-        nD +=OUTDIM;
-	}
+    // Check the header and the size of the arrays behind it
+    CheckpointHeader header;
+    bool valid = size >= sizeof(header);
+    if(valid) {
+        memcpy(&header, contents, sizeof(header));
+        size_t no_state = (size_t) 3 * N * OUTDIM + OUTDIM + N;
+        valid = memcmp(header.magic, "BHTC", 4) == 0 && header.version == 2 &&
+                header.element_type == ((sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64) &&
+                header.n == N && header.no_dims == OUTDIM && header.exact == (exact ? 1 : 0) &&
+                (!exact || header.no_elem == (unsigned long long) N * N) &&
+                size >= sizeof(header) + (no_state + header.no_elem) * sizeof(T) +
+                        (exact ? 0 : (N + 1 + header.no_elem) * sizeof(unsigned int));
+    }
+    if(!valid) {
+        if (verbose) {
+            printf("Error: checkpoint file does not match this run.\n");
+        }
+        unmap_file(contents, size);
+        return false;
+    }
 
-    // Free memory
-    free(DD); DD = NULL;
-    free(Q);  Q  = NULL;
+    // Copy the state of the optimization
+    size_t size_Y = (size_t) N * OUTDIM;
+    const T* data = (const T*) (contents + sizeof(header));
+    memcpy(Y, data, size_Y * sizeof(T));                data += size_Y;
+    memcpy(uY, data, size_Y * sizeof(T));               data += size_Y;
+    memcpy(gains, data, size_Y * sizeof(T));            data += size_Y;
+    memcpy(mean_Y, data, OUTDIM * sizeof(T));           data += OUTDIM;
+    if(beta != NULL) memcpy(beta, data, N * sizeof(T));
+    data += N;
+    *iter = header.iter;
+    *momentum = header.momentum;
+    *lying = (header.lying != 0);
+
+    // Copy the input similarities (they are changed in place later on)
+    if(exact) {
+        *P = (T*) malloc((size_t) N * N * sizeof(T));
+        if(*P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+        memcpy(*P, data, (size_t) N * N * sizeof(T));
+    }
+    else {
+        *_row_P = (unsigned int*) allocArray(N + 1, sizeof(unsigned int), huge_pages);
+        *_col_P = (unsigned int*) allocArray(header.no_elem, sizeof(unsigned int), huge_pages);
+        *_val_P = (T*) allocArray(header.no_elem, sizeof(T), huge_pages);
+        if(*_row_P == NULL || *_col_P == NULL || *_val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+        const unsigned int* indices = (const unsigned int*) (data + header.no_elem);
+        memcpy(*_val_P, data, header.no_elem * sizeof(T));
+        memcpy(*_row_P, indices, (N + 1) * sizeof(unsigned int));
+        memcpy(*_col_P, indices + N + 1, header.no_elem * sizeof(unsigned int));
+    }
+    unmap_file(contents, size);
+    return true;
 }
 
 
-// Evaluate t-SNE cost function (exactly)
+// Writes a model file: the header, followed by the mean of the input, the kernel precisions, the map, the radii of a
+// vantage-point tree over the normalized input, the normalized input and the row order of the tree (see TSNEModelHeader)
 template<typename T, int OUTDIM>
-T TSNE<T, OUTDIM>::evaluateError(T* P, T* Y, int N) {
+bool TSNE<T, OUTDIM>::saveModel(const char* filename, const T* X, int N, int D, const T* mean, T scale, const T* beta, const T* Y, T perplexity, T theta) {
+
+    // Build the neighbor search over the reference data, so loading the model does not have to
+    VpTree<T, EuclideanDistance<T> >* tree = new VpTree<T, EuclideanDistance<T> >(EuclideanDistance<T>(X, D));
+    tree->create(N);
+    int* items = (int*) malloc(N * sizeof(int));
+    T* thresholds = (T*) malloc(N * sizeof(T));
+    if(items == NULL || thresholds == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    tree->save(items, thresholds);
+    delete tree;
 
-    // Compute the squared Euclidean distance matrix
-    T* DD = (T*) malloc(N * N * sizeof(T));
-    T* Q = (T*) malloc(N * N * sizeof(T));
-    if(DD == NULL || Q == NULL) { printf("Memory allocation failed!\n"); exit(1); }
-    computeSquaredEuclideanDistance(Y, N, OUTDIM, DD);
+    FILE *h;
+    if((h = fopen(filename, "wb")) == NULL) {
+        free(items); free(thresholds);
+        return false;
+    }
+    TSNEModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BHTM", 4);
+    header.version = 1;
+    header.element_type = (sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64;
+    header.n = N;
+    header.d = D;
+    header.no_dims = OUTDIM;
+    header.perplexity = perplexity;
+    header.theta = theta;
+    header.scale = scale;
+    bool ok = fwrite(&header, sizeof(header), 1, h) == 1 &&
+              fwrite(mean, sizeof(T), D, h) == (size_t) D &&
+              fwrite(beta, sizeof(T), N, h) == (size_t) N &&
+              fwrite(Y, sizeof(T), (size_t) N * OUTDIM, h) == (size_t) N * OUTDIM &&
+              fwrite(thresholds, sizeof(T), N, h) == (size_t) N &&
+              fwrite(X, sizeof(T), (size_t) N * D, h) == (size_t) N * D &&
+              fwrite(items, sizeof(int), N, h) == (size_t) N;
+    if(fclose(h) != 0) ok = false;
+    free(items); items = NULL;
+    free(thresholds); thresholds = NULL;
+    return ok;
+}
 
-    // Compute Q-matrix and normalization sum
-    int nN = 0;
-    T sum_Q = DBL_MIN;
-    for(int n = 0; n < N; n++) {
-    	for(int m = 0; m < N; m++) {
-            if(n != m) {
-                Q[nN + m] = 1 / (1 + DD[nN + m]);
-                sum_Q += Q[nN + m];
+
+// Restores a model from the contents of a model file whose header was checked by the caller (the arrays are used in place)
+template<typename T, int OUTDIM>
+TSNEModel<T, OUTDIM>* TSNE<T, OUTDIM>::loadModel(const char* contents) {
+    TSNEModelHeader header;
+    memcpy(&header, contents, sizeof(header));
+    TSNEModel<T, OUTDIM>* model = new TSNEModel<T, OUTDIM>();
+    int N = model->N = header.n;
+    int D = model->D = header.d;
+    model->perplexity = header.perplexity;
+    model->theta = header.theta;
+    model->scale = header.scale;
+
+    // Locate the arrays
+    const T* data = (const T*) (contents + sizeof(header));
+    model->mean = data;                 data += D;
+    model->beta = data;                 data += N;
+    model->Y = data;                    data += (size_t) N * OUTDIM;
+    const T* thresholds = data;         data += N;
+    model->X = data;                    data += (size_t) N * D;
+    const int* items = (const int*) data;
+
+    // Restore the neighbor search, and build the tree of the reference map once for all later transforms
+    model->index = new VpTree<T, EuclideanDistance<T> >(EuclideanDistance<T>(model->X, D));
+    model->index->load(N, items, thresholds);
+    model->map_Y = (T*) malloc((size_t) N * OUTDIM * sizeof(T));
+    if(model->map_Y == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    memcpy(model->map_Y, model->Y, (size_t) N * OUTDIM * sizeof(T));
+    model->map_tree = new Tree();
+    model->map_tree->build(model->map_Y, N);
+    return model;
+}
+
+
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::freeModel(TSNEModel<T, OUTDIM>* model) {
+    delete model->index;
+    delete model->map_tree;
+    free(model->map_Y);
+    delete model;
+}
+
+
+// Brings the space-partitioning tree up to date with the current map, either by refitting the previous tree or by rebuilding it
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::updateTree(Tree* tree, T* Y, int N, double refit_threshold)
+{
+    if(refit_threshold > .0) tree->refit(Y, N, refit_threshold);
+    else tree->build(Y, N);
+}
+
+
+// Compute gradient of the t-SNE cost function (using Barnes-Hut algorithm on a tree that is up to date with Y, or the FFT grid;
+// pos_f and neg_f are N x OUTDIM work arrays, and dC holds the copy of Y for the attractive forces until the gradient is written)
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::computeGradient(Tree* tree, FFTForces<T, OUTDIM>* fft, bool dual_tree, unsigned int* inp_row_P, unsigned int* inp_col_P, T* inp_val_P, T* Y, int N, T* dC, T theta, T exaggeration, T* pos_f, T* neg_f, double* cross_entropy, TSNEStats* stats)
+{
+
+    // Compute all terms required for t-SNE gradient
+    double sum_Q = .0;
+    double start = wallTime();
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N * OUTDIM; i++) { pos_f[i] = .0; neg_f[i] = .0; }
+    computeEdgeForces<T, OUTDIM>(inp_row_P, inp_col_P, inp_val_P, Y, N, pos_f, dC);          // dC is only written below
+    double middle = wallTime();
+    sum_Q = computeNonEdgeForces(tree, fft, dual_tree, Y, N, theta, neg_f);
+    if(stats != NULL) {
+        stats->attractive += middle - start;
+        stats->repulsive += wallTime() - middle;
+    }
+
+    // Compute final t-SNE gradient
+    T inv_sum_Q = (T) (1.0 / sum_Q);
+    #pragma omp parallel for schedule(static)
+    for(int i = 0; i < N * OUTDIM; i++) {
+        dC[i] = exaggeration * pos_f[i] - neg_f[i] * inv_sum_Q;
+    }
+
+    // If requested, reuse the normalization term for the cross-entropy -sum_ij p_ij log(q_ij) of the (unexaggerated) P and
+    // the current map, which costs one more pass over the edges
+    if(cross_entropy != NULL) {
+        start = wallTime();
+        double sum_log = .0;
+        #pragma omp parallel for schedule(guided) reduction(+:sum_log)
+        for(int n = 0; n < N; n++) {
+            const T* y_n = Y + n * OUTDIM;
+            for(unsigned int i = inp_row_P[n]; i < inp_row_P[n + 1]; i++) {
+                const T* y_m = Y + inp_col_P[i] * OUTDIM;
+                T D = .0;
+                for(int d = 0; d < OUTDIM; d++) D += (y_n[d] - y_m[d]) * (y_n[d] - y_m[d]);
+                sum_log += inp_val_P[i] * log1p((double) D);
             }
-            else Q[nN + m] = DBL_MIN;
         }
-        nN += N;
+        *cross_entropy = sum_log + log(sum_Q);
+        if(stats != NULL) stats->error += wallTime() - start;
     }
-    for(int i = 0; i < N * N; i++) Q[i] /= sum_Q;
+}
 
-    // Sum t-SNE error
-    T C = .0;
-	for(int n = 0; n < N * N; n++) {
-        C += P[n] * log((P[n] + FLT_MIN) / (Q[n] + FLT_MIN));
-	}
+// Compute the repulsive forces and their normalization term with the tree (per point or dual-tree) or the FFT grid (returns sum_Q)
+template<typename T, int OUTDIM>
+double TSNE<T, OUTDIM>::computeNonEdgeForces(Tree* tree, FFTForces<T, OUTDIM>* fft, bool dual_tree, T* Y, int N, T theta, T* neg_f)
+{
+    if(fft != NULL) return fft->computeNonEdgeForces(Y, N, neg_f);
+    if(dual_tree) return tree->computeNonEdgeForces(theta, neg_f);
 
-    // Clean up memory
-    free(DD);
-    free(Q);
-	return C;
+    double sum_Q = .0;
+    #pragma omp parallel for schedule(guided) reduction(+:sum_Q)
+    for(int n = 0; n < N; n++) {
+        sum_Q += tree->computeNonEdgeForces(n, theta, neg_f + n * OUTDIM);
+    }
+    return sum_Q;
 }
 
-// Evaluate t-SNE cost function (approximately)
+// Compute gradient of the t-SNE cost function (exact, tile by tile without N x N temporaries)
 template<typename T, int OUTDIM>
-T TSNE<T, OUTDIM>::evaluateError(unsigned int* row_P, unsigned int* col_P, T* val_P, T* Y, int N, T theta)
-{
+void TSNE<T, OUTDIM>::computeExactGradient(T* P, T* Y, int N, T* dC, T exaggeration) {
+
+    // Copy the map into one array per dimension, so the inner loops vectorize
+    T* Y_soa = (T*) malloc((size_t) N * OUTDIM * sizeof(T));
+    T* rep_f = (T*) malloc((size_t) N * OUTDIM * sizeof(T));
+    if(Y_soa == NULL || rep_f == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    for(int n = 0; n < N; n++) {
+        for(int d = 0; d < OUTDIM; d++) Y_soa[(size_t) d * N + n] = Y[n * OUTDIM + d];
+    }
 
-    // Get estimate of normalization term
-    SPTree<T, OUTDIM>* tree = new SPTree<T, OUTDIM>(Y, N);
-    T buff[OUTDIM];
-    T sum_Q = .0;
-    for(int n = 0; n < N; n++)  {
-        sum_Q += tree->computeNonEdgeForces(n, theta, buff);
+    // Since q_nm = 1 / (1 + |y_n - y_m|^2) only gets normalized at the end, the attractive and repulsive parts of
+    // the gradient are summed separately in a single pass over the tiles
+    double sum_Q = .0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:sum_Q)
+    for(int first = 0; first < N; first += EXACT_TILE_ROWS) {
+        int last = min(first + EXACT_TILE_ROWS, N);
+        T attr[EXACT_TILE_ROWS][OUTDIM] = {};
+        T rep[EXACT_TILE_ROWS][OUTDIM] = {};
+        for(int col = 0; col < N; col += EXACT_TILE_COLS) {
+            int col_end = min(col + EXACT_TILE_COLS, N);
+            for(int n = first; n < last; n++) {
+                const T* P_n = P + (size_t) n * N;
+                T y_n[OUTDIM], a[OUTDIM] = {}, r[OUTDIM] = {};
+                for(int d = 0; d < OUTDIM; d++) y_n[d] = Y[n * OUTDIM + d];
+                T row_Q = .0;
+                for(int m = col; m < col_end; m++) {
+                    T diff[OUTDIM];
+                    T D = 1.0;
+                    for(int d = 0; d < OUTDIM; d++) { diff[d] = y_n[d] - Y_soa[(size_t) d * N + m]; D += diff[d] * diff[d]; }
+                    T q = 1 / D;
+                    row_Q += q;
+                    T mult_attr = P_n[m] * q;
+                    T mult_rep = q * q;
+                    for(int d = 0; d < OUTDIM; d++) { a[d] += mult_attr * diff[d]; r[d] += mult_rep * diff[d]; }
+                }
+                sum_Q += row_Q;
+                for(int d = 0; d < OUTDIM; d++) { attr[n - first][d] += a[d]; rep[n - first][d] += r[d]; }
+            }
+        }
+        for(int n = first; n < last; n++) {
+            for(int d = 0; d < OUTDIM; d++) { dC[n * OUTDIM + d] = exaggeration * attr[n - first][d]; rep_f[n * OUTDIM + d] = rep[n - first][d]; }
+        }
     }
+    sum_Q -= N;                                                     // every point contributed q_nn = 1 to its own row
+
+    // Compute final t-SNE gradient
+    T inv_sum_Q = (T) (1.0 / sum_Q);
+    for(int i = 0; i < N * OUTDIM; i++) dC[i] -= rep_f[i] * inv_sum_Q;
+
+    // Free memory
+    free(Y_soa); Y_soa = NULL;
+    free(rep_f); rep_f = NULL;
+}
+
+
+// Evaluate t-SNE cost function (exactly, tile by tile without N x N temporaries)
+template<typename T, int OUTDIM>
+double TSNE<T, OUTDIM>::evaluateError(T* P, T* Y, int N, T exaggeration) {
 
-    // Loop over all edges to compute t-SNE error
-    int ind1, ind2;
-    T C = .0, Q;
+    // Copy the map into one array per dimension, so the inner loops vectorize
+    T* Y_soa = (T*) malloc((size_t) N * OUTDIM * sizeof(T));
+    if(Y_soa == NULL) { printf("Memory allocation failed!\n"); exit(1); }
     for(int n = 0; n < N; n++) {
-        ind1 = n * OUTDIM;
-        for(int i = row_P[n]; i < row_P[n + 1]; i++) {
-            Q = .0;
-            ind2 = col_P[i] * OUTDIM;
-            for(int d = 0; d < OUTDIM; d++) buff[d]  = Y[ind1 + d];
-            for(int d = 0; d < OUTDIM; d++) buff[d] -= Y[ind2 + d];
-            for(int d = 0; d < OUTDIM; d++) Q += buff[d] * buff[d];
-            Q = (1.0 / (1.0 + Q)) / sum_Q;
-            C += val_P[i] * log((val_P[i] + FLT_MIN) / (Q + FLT_MIN));
+        for(int d = 0; d < OUTDIM; d++) Y_soa[(size_t) d * N + n] = Y[n * OUTDIM + d];
+    }
+
+    // Compute the normalization sum in a first pass
+    double sum_Q = .0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:sum_Q)
+    for(int first = 0; first < N; first += EXACT_TILE_ROWS) {
+        int last = min(first + EXACT_TILE_ROWS, N);
+        for(int col = 0; col < N; col += EXACT_TILE_COLS) {
+            int col_end = min(col + EXACT_TILE_COLS, N);
+            for(int n = first; n < last; n++) {
+                T y_n[OUTDIM];
+                for(int d = 0; d < OUTDIM; d++) y_n[d] = Y[n * OUTDIM + d];
+                T row_Q = .0;
+                for(int m = col; m < col_end; m++) {
+                    T D = 1.0;
+                    for(int d = 0; d < OUTDIM; d++) { T diff = y_n[d] - Y_soa[(size_t) d * N + m]; D += diff * diff; }
+                    row_Q += 1 / D;
+                }
+                sum_Q += row_Q;
+            }
+        }
+    }
+    sum_Q -= N;                                                     // every point contributed q_nn = 1 to its own row
+
+    // Sum t-SNE error in a second pass (with Q_nm = 1 / (D_nm * sum_Q))
+    double C = .0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:C)
+    for(int first = 0; first < N; first += EXACT_TILE_ROWS) {
+        int last = min(first + EXACT_TILE_ROWS, N);
+        for(int col = 0; col < N; col += EXACT_TILE_COLS) {
+            int col_end = min(col + EXACT_TILE_COLS, N);
+            for(int n = first; n < last; n++) {
+                const T* P_n = P + (size_t) n * N;
+                T y_n[OUTDIM];
+                for(int d = 0; d < OUTDIM; d++) y_n[d] = Y[n * OUTDIM + d];
+                double row_C = .0;
+                for(int m = col; m < col_end; m++) {
+                    T D = 1.0;
+                    for(int d = 0; d < OUTDIM; d++) { T diff = y_n[d] - Y_soa[(size_t) d * N + m]; D += diff * diff; }
+                    if(m != n) row_C += P_n[m] * log((exaggeration * P_n[m] + FLT_MIN) * D * sum_Q);
+                }
+                C += row_C;
+            }
         }
     }
 
     // Clean up memory
-    return C;
+    free(Y_soa); Y_soa = NULL;
+    return exaggeration * C;
 }
 
-
 // Compute input similarities with a fixed perplexity
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, T* P, T perplexity) {
+void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, T* P, T perplexity, T* beta_out) {
 
-	// Compute the squared Euclidean distance matrix
-	T* DD = (T*) malloc(N * N * sizeof(T));
+	// Compute the Gaussian kernel row by row (each row computes its own distances)
+    #pragma omp parallel
+    {
+    T* DD = (T*) malloc(N * sizeof(T));
     if(DD == NULL) { printf("Memory allocation failed!\n"); exit(1); }
-	computeSquaredEuclideanDistance(X, N, D, DD);
-
-	// Compute the Gaussian kernel row by row
-    int nN = 0;
+    #pragma omp for schedule(dynamic, 16)
 	for(int n = 0; n < N; n++) {
+        T* P_n = P + (size_t) n * N;
+        const T* X_n = X + (size_t) n * D;
+        for(int m = 0; m < N; m++) {
+            const T* X_m = X + (size_t) m * D;
+            T dd = .0;
+            for(int d = 0; d < D; d++) dd += (X_n[d] - X_m[d]) * (X_n[d] - X_m[d]);
+            DD[m] = dd;
+        }
 
 		// Initialize some variables
 		bool found = false;
 		T beta = 1.0;
-		T min_beta = -DBL_MAX;
-		T max_beta =  DBL_MAX;
+		T min_beta = -numeric_limits<T>::max();
+		T max_beta =  numeric_limits<T>::max();
 		T tol = 1e-5;
         T sum_P;
 
@@ -416,14 +1201,14 @@ void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, T* P, T perp
 		while(!found && iter < 200) {
 
 			// Compute Gaussian kernel row
-			for(int m = 0; m < N; m++) P[nN + m] = exp(-beta * DD[nN + m]);
-			P[nN + n] = DBL_MIN;
+			for(int m = 0; m < N; m++) P_n[m] = exp(-beta * DD[m]);
+			P_n[n] = numeric_limits<T>::min();
 
 			// Compute entropy of current row
-			sum_P = DBL_MIN;
-			for(int m = 0; m < N; m++) sum_P += P[nN + m];
+			sum_P = numeric_limits<T>::min();
+			for(int m = 0; m < N; m++) sum_P += P_n[m];
 			T H = 0.0;
-			for(int m = 0; m < N; m++) H += beta * (DD[nN + m] * P[nN + m]);
+			for(int m = 0; m < N; m++) H += beta * (DD[m] * P_n[m]);
 			H = (H / sum_P) + log(sum_P);
 
 			// Evaluate whether the entropy is within the tolerance level
@@ -434,14 +1219,14 @@ void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, T* P, T perp
 			else {
 				if(Hdiff > 0) {
 					min_beta = beta;
-					if(max_beta == DBL_MAX || max_beta == -DBL_MAX)
+					if(max_beta == numeric_limits<T>::max() || max_beta == -numeric_limits<T>::max())
 						beta *= 2.0;
 					else
 						beta = (beta + max_beta) / 2.0;
 				}
 				else {
 					max_beta = beta;
-					if(min_beta == -DBL_MAX || min_beta == DBL_MAX)
+					if(min_beta == -numeric_limits<T>::max() || min_beta == numeric_limits<T>::max())
 						beta /= 2.0;
 					else
 						beta = (beta + min_beta) / 2.0;
@@ -453,236 +1238,511 @@ void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, T* P, T perp
 		}
 
 		// Row normalize P
-		for(int m = 0; m < N; m++) P[nN + m] /= sum_P;
-        nN += N;
+		for(int m = 0; m < N; m++) P_n[m] /= sum_P;
+        if(beta_out != NULL) beta_out[n] = beta;
 	}
 
 	// Clean up memory
 	free(DD); DD = NULL;
+    }
 }
 
 
-// Compute input similarities with a fixed perplexity using ball trees (this function allocates memory another function should free)
+// Compute input similarities with a fixed perplexity using ball trees or an approximate neighbor graph (this function allocates memory another function should free)
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, T perplexity, int K, bool verbose) {
+void TSNE<T, OUTDIM>::computeGaussianPerplexity(T* X, int N, int D, unsigned int** _row_P, unsigned int** _col_P, T** _val_P, T perplexity, int K, bool verbose, const TSNEOptions& opts, T* beta, TSNEStats* stats) {
 
     if(perplexity > K) printf("Perplexity should be lower than K!\n");
 
+    // Find the nearest neighbors and their squared distances, and calibrate a Gaussian kernel over them in every row
+    T* dist_P = NULL;
+    double start = wallTime();
+    computeNeighbors(EuclideanDistance<T>(X, D), N, K, verbose, opts, _row_P, _col_P, &dist_P);
+    double middle = wallTime();
+    *_val_P = (T*) malloc((size_t) N * K * sizeof(T));
+    if(*_val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    calibrateRows(*_row_P, dist_P, N, perplexity, *_val_P, beta);
+    free(dist_P);
+    if(stats != NULL) {
+        stats->knn += middle - start;
+        stats->calibration += wallTime() - middle;
+    }
+}
+
+
+// Find the K nearest neighbors of every point with a ball tree or an approximate neighbor graph under the given (squared)
+// distance; stores them as the rows of a sparse matrix with their squared distances as values (this function allocates
+// memory another function should free)
+template<typename T, int OUTDIM>
+template<typename Distance>
+void TSNE<T, OUTDIM>::computeNeighbors(const Distance& distance, int N, int K, bool verbose, const TSNEOptions& opts, unsigned int** _row_P, unsigned int** _col_P, T** _dist_P) {
+
     // Allocate the memory we need
     *_row_P = (unsigned int*)    malloc((N + 1) * sizeof(unsigned int));
-    *_col_P = (unsigned int*)    calloc(N * K, sizeof(unsigned int));
-    *_val_P = (T*) calloc(N * K, sizeof(T));
-    if(*_row_P == NULL || *_col_P == NULL || *_val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    *_col_P = (unsigned int*)    calloc((size_t) N * K, sizeof(unsigned int));
+    *_dist_P = (T*) calloc((size_t) N * K, sizeof(T));
+    if(*_row_P == NULL || *_col_P == NULL || *_dist_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
     unsigned int* row_P = *_row_P;
     unsigned int* col_P = *_col_P;
-    T* val_P = *_val_P;
-    T* cur_P = (T*) malloc((N - 1) * sizeof(T));
-    if(cur_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    T* dist_P = *_dist_P;
     row_P[0] = 0;
     for(int n = 0; n < N; n++) row_P[n + 1] = row_P[n] + (unsigned int) K;
 
-    // Build ball tree on data set
-    VpTree<DataPoint<T>, T, euclidean_distance>* tree = new VpTree<DataPoint<T>, T, euclidean_distance>();
-    vector<DataPoint<T> > obj_X(N, DataPoint<T>(D, -1, X));
-    for(int n = 0; n < N; n++) obj_X[n] = DataPoint<T>(D, n, X + n * D);
-    tree->create(obj_X);
+    // Build ball tree on data set, or the approximate neighbor graph (both only store row indices into X)
+    bool approximate = (opts.neighbors == TSNE_NEIGHBORS_APPROXIMATE);
+    VpTree<T, Distance>* tree = NULL;
+    NNDescent<T, Distance>* graph = NULL;
+    if(approximate) {
+        if (verbose) {
+            printf("Building approximate neighbor graph...\n");
+        }
+        graph = new NNDescent<T, Distance>(distance);
+        graph->create(N, K, opts.knn_trees, opts.knn_iterations, (unsigned int) rand());
+    }
+    else {
+        tree = new VpTree<T, Distance>(distance);
+        tree->create(N);
+        if (verbose) {
+            printf("Building tree...\n");
+        }
+    }
 
-    // Loop over all points to find nearest neighbors
-    if (verbose) {
-        printf("Building tree...\n");
+    // Loop over all points to find nearest neighbors (every thread searches the tree and fills in its own rows)
+    #pragma omp parallel
+    {
+        int* indices = (int*) malloc((K + 1) * sizeof(int));
+        T* distances = (T*) malloc((K + 1) * sizeof(T));
+        if(indices == NULL || distances == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+
+        #pragma omp for schedule(dynamic, 64)
+        for(int n = 0; n < N; n++) {
+
+            if (verbose && !approximate) {
+                if(n % 10000 == 0) printf(" - point %d of %d\n", n, N);
+            }
+
+            // Find nearest neighbors (the tree returns the point itself first)
+            if(approximate) graph->getNeighbors(n, indices + 1, distances + 1);
+            else tree->search(n, K + 1, indices, distances);
+            for(int m = 0; m < K; m++) {
+                col_P[row_P[n] + m] = (unsigned int) indices[m + 1];
+                dist_P[row_P[n] + m] = distances[m + 1];
+            }
+        }
+        free(indices);
+        free(distances);
     }
-    vector<DataPoint<T> > indices;
-    vector<T> distances;
+
+    // Check the approximate neighbors against exact search on a sample of the points
+    if(approximate && verbose && opts.knn_recall_sample > 0) {
+        int samples = min(opts.knn_recall_sample, N);
+        printf("Approximate neighbors have a recall of %f (measured on %d points)\n", measureRecall(distance, N, row_P, col_P, samples), samples);
+    }
+
+    // Clean up memory
+    delete tree;
+    delete graph;
+}
+
+
+// Calibrate a Gaussian kernel over the squared neighbor distances of every row to the given perplexity, and store the
+// row-normalized kernels in val_P (and their precisions in beta, if not NULL)
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::calibrateRows(const unsigned int* row_P, const T* dist_P, int N, T perplexity, T* val_P, T* beta) {
+    #pragma omp parallel for schedule(dynamic, 64)
     for(int n = 0; n < N; n++) {
+        T beta_n = computeGaussianRow(dist_P + row_P[n], row_P[n + 1] - row_P[n], perplexity, val_P + row_P[n]);
+        if(beta != NULL) beta[n] = beta_n;
+    }
+}
+
+
+// Computes the input similarities of approximate t-SNE for several perplexities (given in the affinities) from a single
+// neighbor search: every row keeps its 3 * perplexity nearest of the 3 * max(perplexity) neighbors that were found, and
+// the kernels are calibrated again (release the results with freeAffinities)
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::computeAffinities(const T* inp_X, int N, int D, TSNEAffinities<T>* affinities, int no_affinities, bool verbose,
+                                        const TSNEOptions& opts) {
+
+    // Normalize input data as run() does
+    T* X = (T*) malloc((size_t) N * D * sizeof(T));
+    if(X == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    memcpy(X, inp_X, (size_t) N * D * sizeof(T));
+    zeroMean(X, N, D);
+    T max_X = .0;
+    for(size_t i = 0; i < (size_t) N * D; i++) {
+        if(fabs(X[i]) > max_X) max_X = fabs(X[i]);
+    }
+    for(size_t i = 0; i < (size_t) N * D; i++) X[i] /= max_X;
+
+    // Find the neighbors for the largest perplexity
+    int K = 0;
+    for(int a = 0; a < no_affinities; a++) K = max(K, (int) (3 * affinities[a].perplexity));
+    unsigned int* row_P = NULL; unsigned int* col_P = NULL; T* dist_P = NULL;
+    computeNeighbors(EuclideanDistance<T>(X, D), N, K, verbose, opts, &row_P, &col_P, &dist_P);
+    free(X); X = NULL;
 
+    for(int a = 0; a < no_affinities; a++) {
+        TSNEAffinities<T>& result = affinities[a];
         if (verbose) {
-            if(n % 10000 == 0) printf(" - point %d of %d\n", n, N);
-        }
-
-        // Find nearest neighbors
-        indices.clear();
-        distances.clear();
-        tree->search(obj_X[n], K + 1, &indices, &distances);
-
-        // Initialize some variables for binary search
-        bool found = false;
-        T beta = 1.0;
-        T min_beta = -DBL_MAX;
-        T max_beta =  DBL_MAX;
-        T tol = 1e-5;
-
-        // Iterate until we found a good perplexity
-        int iter = 0; T sum_P;
-        while(!found && iter < 200) {
-
-            // Compute Gaussian kernel row
-            for(int m = 0; m < K; m++) cur_P[m] = exp(-beta * distances[m + 1] * distances[m + 1]);
-
-            // Compute entropy of current row
-            sum_P = DBL_MIN;
-            for(int m = 0; m < K; m++) sum_P += cur_P[m];
-            T H = .0;
-            for(int m = 0; m < K; m++) H += beta * (distances[m + 1] * distances[m + 1] * cur_P[m]);
-            H = (H / sum_P) + log(sum_P);
-
-            // Evaluate whether the entropy is within the tolerance level
-            T Hdiff = H - log(perplexity);
-            if(Hdiff < tol && -Hdiff < tol) {
-                found = true;
-            }
-            else {
-                if(Hdiff > 0) {
-                    min_beta = beta;
-                    if(max_beta == DBL_MAX || max_beta == -DBL_MAX)
-                        beta *= 2.0;
-                    else
-                        beta = (beta + max_beta) / 2.0;
-                }
-                else {
-                    max_beta = beta;
-                    if(min_beta == -DBL_MAX || min_beta == DBL_MAX)
-                        beta /= 2.0;
-                    else
-                        beta = (beta + min_beta) / 2.0;
+            printf("Computing input similarities for perplexity %f...\n", result.perplexity);
+        }
+
+        // Keep the nearest neighbors of every row (they are sorted by distance)
+        int K_a = (int) (3 * result.perplexity);
+        unsigned int* row_A = (unsigned int*) malloc((N + 1) * sizeof(unsigned int));
+        unsigned int* col_A = (unsigned int*) malloc((size_t) N * K_a * sizeof(unsigned int));
+        T* dist_A = (T*) malloc((size_t) N * K_a * sizeof(T));
+        T* val_A = (T*) malloc((size_t) N * K_a * sizeof(T));
+        result.beta = (T*) malloc(N * sizeof(T));
+        if(row_A == NULL || col_A == NULL || dist_A == NULL || val_A == NULL || result.beta == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+        row_A[0] = 0;
+        for(int n = 0; n < N; n++) row_A[n + 1] = row_A[n] + (unsigned int) K_a;
+        #pragma omp parallel for schedule(static)
+        for(int n = 0; n < N; n++) {
+            memcpy(col_A + row_A[n], col_P + row_P[n], K_a * sizeof(unsigned int));
+            memcpy(dist_A + row_A[n], dist_P + row_P[n], K_a * sizeof(T));
+        }
+
+        // Calibrate, symmetrize and normalize them as run() does
+        calibrateRows(row_A, dist_A, N, result.perplexity, val_A, result.beta);
+        free(dist_A); dist_A = NULL;
+        symmetrizeMatrix(&row_A, &col_A, &val_A, N, opts.huge_pages);
+        double sum_P = .0;
+        int no_elem = (int) row_A[N];
+        #pragma omp parallel for reduction(+:sum_P)
+        for(int i = 0; i < no_elem; i++) sum_P += val_A[i];
+        #pragma omp parallel for
+        for(int i = 0; i < no_elem; i++) val_A[i] /= sum_P;
+        result.row_P = row_A;
+        result.col_P = col_A;
+        result.val_P = val_A;
+    }
+
+    // Clean up memory
+    free(row_P);
+    free(col_P);
+    free(dist_P);
+}
+
+// Computes the input similarities of approximate t-SNE with the perplexity given in the affinities for a sparse N x D
+// matrix in compressed sparse row format (column indices increasing within every row). The neighbor search works on the
+// non-zeros directly, so the input is neither densified nor centered, and the memory stays proportional to the number of
+// non-zeros and neighbors. Cosine distances are computed as squared Euclidean distances between the rows scaled to unit
+// length, which are twice the cosine distances and give the same kernels (release the results with freeAffinities)
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::computeSparseAffinities(const unsigned int* row_ptr, const unsigned int* col_idx, const T* values, int N, int metric,
+                                              TSNEAffinities<T>* affinities, bool verbose, const TSNEOptions& opts, TSNEStats* stats) {
+
+    // Scale the rows to unit length for cosine distances (rows without non-zeros stay empty)
+    double start = wallTime();
+    T* unit_values = NULL;
+    if(metric == TSNE_METRIC_COSINE) {
+        unit_values = (T*) malloc(max(row_ptr[N], 1u) * sizeof(T));
+        if(unit_values == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(int n = 0; n < N; n++) {
+            double norm = .0;
+            for(unsigned int i = row_ptr[n]; i < row_ptr[n + 1]; i++) norm += (double) values[i] * values[i];
+            T scale = (norm > .0) ? (T) (1.0 / sqrt(norm)) : (T) .0;
+            for(unsigned int i = row_ptr[n]; i < row_ptr[n + 1]; i++) unit_values[i] = values[i] * scale;
+        }
+    }
+
+    // Find the nearest neighbors, and calibrate, symmetrize and normalize them as run() does
+    int K = (int) (3 * affinities->perplexity);
+    unsigned int* row_P = NULL; unsigned int* col_P = NULL; T* dist_P = NULL;
+    double middle = wallTime();
+    computeNeighbors(SparseEuclideanDistance<T>(row_ptr, col_idx, unit_values != NULL ? unit_values : values), N, K, verbose, opts,
+                     &row_P, &col_P, &dist_P);
+    free(unit_values); unit_values = NULL;
+    double calibration_start = wallTime();
+    T* val_P = (T*) malloc((size_t) N * K * sizeof(T));
+    affinities->beta = (T*) malloc(N * sizeof(T));
+    if(val_P == NULL || affinities->beta == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    calibrateRows(row_P, dist_P, N, affinities->perplexity, val_P, affinities->beta);
+    free(dist_P); dist_P = NULL;
+    double symmetrization_start = wallTime();
+    symmetrizeMatrix(&row_P, &col_P, &val_P, N, opts.huge_pages);
+    double sum_P = .0;
+    int no_elem = (int) row_P[N];
+    #pragma omp parallel for reduction(+:sum_P)
+    for(int i = 0; i < no_elem; i++) sum_P += val_P[i];
+    #pragma omp parallel for
+    for(int i = 0; i < no_elem; i++) val_P[i] /= sum_P;
+    affinities->row_P = row_P;
+    affinities->col_P = col_P;
+    affinities->val_P = val_P;
+    if(stats != NULL) {
+        stats->centering += middle - start;
+        stats->knn += calibration_start - middle;
+        stats->calibration += symmetrization_start - calibration_start;
+        stats->symmetrization += wallTime() - symmetrization_start;
+    }
+}
+
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::freeAffinities(TSNEAffinities<T>* affinities) {
+    freeArray(affinities->row_P); affinities->row_P = NULL;
+    freeArray(affinities->col_P); affinities->col_P = NULL;
+    freeArray(affinities->val_P); affinities->val_P = NULL;
+    free(affinities->beta); affinities->beta = NULL;
+}
+
+
+// Returns the fraction of the true nearest neighbors that appear in the rows of P, for evenly spaced sample points
+template<typename T, int OUTDIM>
+template<typename Distance>
+T TSNE<T, OUTDIM>::measureRecall(const Distance& distance, int N, unsigned int* row_P, unsigned int* col_P, int samples) {
+    int found = 0, total = 0;
+    #pragma omp parallel reduction(+:found,total)
+    {
+        vector<pair<T, int> > candidates(N);
+        #pragma omp for schedule(dynamic, 1)
+        for(int s = 0; s < samples; s++) {
+            int n = (int) ((size_t) s * N / samples);
+            int K = row_P[n + 1] - row_P[n];
+
+            // Find the exact neighbors by brute force
+            for(int m = 0; m < N; m++) candidates[m] = pair<T, int>(m == n ? numeric_limits<T>::max() : distance(n, m), m);
+            nth_element(candidates.begin(), candidates.begin() + K, candidates.end());
+            for(int k = 0; k < K; k++) {
+                for(unsigned int i = row_P[n]; i < row_P[n + 1]; i++) {
+                    if(col_P[i] == (unsigned int) candidates[k].second) { found++; break; }
                 }
             }
-
-            // Update iteration counter
-            iter++;
+            total += K;
         }
+    }
+    return total == 0 ? 1.0 : (T) found / total;
+}
 
-        // Row-normalize current row of P and store in matrix
-        for(unsigned int m = 0; m < K; m++) cur_P[m] /= sum_P;
-        for(unsigned int m = 0; m < K; m++) {
-            col_P[row_P[n] + m] = (unsigned int) indices[m + 1].index();
-            val_P[row_P[n] + m] = cur_P[m];
+
+// Finds the precision of a Gaussian kernel over the given squared distances such that the row attains the specified
+// perplexity (binary search), and stores the row-normalized kernel in cur_P; returns the precision (beta)
+template<typename T, int OUTDIM>
+T TSNE<T, OUTDIM>::computeGaussianRow(const T* dist_sq, int K, T perplexity, T* cur_P) {
+
+    // Initialize some variables for binary search
+    bool found = false;
+    T beta = 1.0;
+    T min_beta = -numeric_limits<T>::max();
+    T max_beta =  numeric_limits<T>::max();
+    T tol = 1e-5;
+
+    // Iterate until we found a good perplexity
+    int iter = 0; T sum_P;
+    while(!found && iter < 200) {
+
+        // Compute Gaussian kernel row
+        for(int m = 0; m < K; m++) cur_P[m] = exp(-beta * dist_sq[m]);
+
+        // Compute entropy of current row
+        sum_P = numeric_limits<T>::min();
+        for(int m = 0; m < K; m++) sum_P += cur_P[m];
+        T H = .0;
+        for(int m = 0; m < K; m++) H += beta * (dist_sq[m] * cur_P[m]);
+        H = (H / sum_P) + log(sum_P);
+
+        // Evaluate whether the entropy is within the tolerance level
+        T Hdiff = H - log(perplexity);
+        if(Hdiff < tol && -Hdiff < tol) {
+            found = true;
         }
+        else {
+            if(Hdiff > 0) {
+                min_beta = beta;
+                if(max_beta == numeric_limits<T>::max() || max_beta == -numeric_limits<T>::max())
+                    beta *= 2.0;
+                else
+                    beta = (beta + max_beta) / 2.0;
+            }
+            else {
+                max_beta = beta;
+                if(min_beta == -numeric_limits<T>::max() || min_beta == numeric_limits<T>::max())
+                    beta /= 2.0;
+                else
+                    beta = (beta + min_beta) / 2.0;
+            }
+        }
+
+        // Update iteration counter
+        iter++;
     }
 
-    // Clean up memory
-    obj_X.clear();
-    free(cur_P);
-    delete tree;
+    // Row-normalize current row of P
+    for(int m = 0; m < K; m++) cur_P[m] /= sum_P;
+    return beta;
 }
 
 
-// Symmetrizes a sparse matrix
+// Sorts the entries of every row of a sparse matrix by column index
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::symmetrizeMatrix(unsigned int** _row_P, unsigned int** _col_P, T** _val_P, int N) {
+void TSNE<T, OUTDIM>::sortRows(const unsigned int* row_P, unsigned int* col_P, T* val_P, int N) {
+    #pragma omp parallel
+    {
+        vector<pair<unsigned int, T> > row;
+        #pragma omp for schedule(dynamic, 64)
+        for(int n = 0; n < N; n++) {
+            row.clear();
+            for(unsigned int i = row_P[n]; i < row_P[n + 1]; i++) row.push_back(pair<unsigned int, T>(col_P[i], val_P[i]));
+            sort(row.begin(), row.end());
+            for(unsigned int i = row_P[n]; i < row_P[n + 1]; i++) {
+                col_P[i] = row[i - row_P[n]].first;
+                val_P[i] = row[i - row_P[n]].second;
+            }
+        }
+    }
+}
+
+
+// Symmetrizes a sparse matrix (by merging the sorted rows of the matrix and of its transpose)
+template<typename T, int OUTDIM>
+void TSNE<T, OUTDIM>::symmetrizeMatrix(unsigned int** _row_P, unsigned int** _col_P, T** _val_P, int N, int huge_pages) {
 
     // Get sparse matrix
     unsigned int* row_P = *_row_P;
     unsigned int* col_P = *_col_P;
     T* val_P = *_val_P;
+    unsigned int no_elem = row_P[N];
+
+    // Count the number of elements in every column
+    unsigned int* row_T = (unsigned int*) calloc(N + 1, sizeof(unsigned int));
+    unsigned int* col_T = (unsigned int*) malloc(no_elem * sizeof(unsigned int));
+    T* val_T = (T*) malloc(no_elem * sizeof(T));
+    if(row_T == NULL || col_T == NULL || val_T == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    #pragma omp parallel for
+    for(unsigned int i = 0; i < no_elem; i++) {
+        #pragma omp atomic
+        row_T[col_P[i] + 1]++;
+    }
+    for(int n = 0; n < N; n++) row_T[n + 1] += row_T[n];
 
-    // Count number of elements and row counts of symmetric matrix
-    int* row_counts = (int*) calloc(N, sizeof(int));
-    if(row_counts == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    // Scatter the elements into the rows of the transpose (the order within a row is fixed by sorting below)
+    unsigned int* offset = (unsigned int*) malloc(N * sizeof(unsigned int));
+    if(offset == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    memcpy(offset, row_T, N * sizeof(unsigned int));
+    #pragma omp parallel for schedule(dynamic, 64)
     for(int n = 0; n < N; n++) {
-        for(int i = row_P[n]; i < row_P[n + 1]; i++) {
-
-            // Check whether element (col_P[i], n) is present
-            bool present = false;
-            for(int m = row_P[col_P[i]]; m < row_P[col_P[i] + 1]; m++) {
-                if(col_P[m] == n) present = true;
-            }
-            if(present) row_counts[n]++;
-            else {
-                row_counts[n]++;
-                row_counts[col_P[i]]++;
-            }
+        for(unsigned int i = row_P[n]; i < row_P[n + 1]; i++) {
+            unsigned int pos;
+            #pragma omp atomic capture
+            pos = offset[col_P[i]]++;
+            col_T[pos] = (unsigned int) n;
+            val_T[pos] = val_P[i];
         }
     }
-    int no_elem = 0;
-    for(int n = 0; n < N; n++) no_elem += row_counts[n];
+    free(offset); offset = NULL;
 
-    // Allocate memory for symmetrized matrix
-    unsigned int* sym_row_P = (unsigned int*) malloc((N + 1) * sizeof(unsigned int));
-    unsigned int* sym_col_P = (unsigned int*) malloc(no_elem * sizeof(unsigned int));
-    T* sym_val_P = (T*) malloc(no_elem * sizeof(T));
-    if(sym_row_P == NULL || sym_col_P == NULL || sym_val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    // Sort the rows of both matrices by column index
+    sortRows(row_P, col_P, val_P, N);
+    sortRows(row_T, col_T, val_T, N);
 
-    // Construct new row indices for symmetric matrix
+    // Count the elements in the union of every row of P and the same row of its transpose
+    unsigned int* sym_row_P = (unsigned int*) allocArray(N + 1, sizeof(unsigned int), huge_pages);
+    if(sym_row_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
     sym_row_P[0] = 0;
-    for(int n = 0; n < N; n++) sym_row_P[n + 1] = sym_row_P[n] + (unsigned int) row_counts[n];
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(int n = 0; n < N; n++) {
+        unsigned int i = row_P[n], j = row_T[n], count = 0;
+        while(i < row_P[n + 1] || j < row_T[n + 1]) {
+            if(j == row_T[n + 1] || (i < row_P[n + 1] && col_P[i] < col_T[j])) i++;
+            else if(i == row_P[n + 1] || col_T[j] < col_P[i]) j++;
+            else { i++; j++; }
+            count++;
+        }
+        sym_row_P[n + 1] = count;
+    }
+    for(int n = 0; n < N; n++) sym_row_P[n + 1] += sym_row_P[n];
 
-    // Fill the result matrix
-    int* offset = (int*) calloc(N, sizeof(int));
-    if(offset == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    // Allocate memory for symmetrized matrix
+    unsigned int* sym_col_P = (unsigned int*) allocArray(sym_row_P[N], sizeof(unsigned int), huge_pages);
+    T* sym_val_P = (T*) allocArray(sym_row_P[N], sizeof(T), huge_pages);
+    if(sym_col_P == NULL || sym_val_P == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+
+    // Fill the result matrix with (P + P^T) / 2
+    #pragma omp parallel for schedule(dynamic, 64)
     for(int n = 0; n < N; n++) {
-        for(unsigned int i = row_P[n]; i < row_P[n + 1]; i++) {                                  // considering element(n, col_P[i])
-
-            // Check whether element (col_P[i], n) is present
-            bool present = false;
-            for(unsigned int m = row_P[col_P[i]]; m < row_P[col_P[i] + 1]; m++) {
-                if(col_P[m] == n) {
-                    present = true;
-                    if(n <= col_P[i]) {                                                 // make sure we do not add elements twice
-                        sym_col_P[sym_row_P[n]        + offset[n]]        = col_P[i];
-                        sym_col_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = n;
-                        sym_val_P[sym_row_P[n]        + offset[n]]        = val_P[i] + val_P[m];
-                        sym_val_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = val_P[i] + val_P[m];
-                    }
-                }
+        unsigned int i = row_P[n], j = row_T[n], k = sym_row_P[n];
+        while(i < row_P[n + 1] || j < row_T[n + 1]) {
+            if(j == row_T[n + 1] || (i < row_P[n + 1] && col_P[i] < col_T[j])) {
+                sym_col_P[k] = col_P[i];
+                sym_val_P[k] = val_P[i] / 2.0;
+                i++;
             }
-
-            // If (col_P[i], n) is not present, there is no addition involved
-            if(!present) {
-                sym_col_P[sym_row_P[n]        + offset[n]]        = col_P[i];
-                sym_col_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = n;
-                sym_val_P[sym_row_P[n]        + offset[n]]        = val_P[i];
-                sym_val_P[sym_row_P[col_P[i]] + offset[col_P[i]]] = val_P[i];
+            else if(i == row_P[n + 1] || col_T[j] < col_P[i]) {
+                sym_col_P[k] = col_T[j];
+                sym_val_P[k] = val_T[j] / 2.0;
+                j++;
             }
-
-            // Update offsets
-            if(!present || (present && n <= col_P[i])) {
-                offset[n]++;
-                if(col_P[i] != n) offset[col_P[i]]++;
+            else {
+                sym_col_P[k] = col_P[i];
+                sym_val_P[k] = (val_P[i] + val_T[j]) / 2.0;
+                i++; j++;
             }
+            k++;
         }
     }
 
-    // Divide the result by two
-    for(int i = 0; i < no_elem; i++) sym_val_P[i] /= 2.0;
-
     // Return symmetrized matrices
     free(*_row_P); *_row_P = sym_row_P;
     free(*_col_P); *_col_P = sym_col_P;
     free(*_val_P); *_val_P = sym_val_P;
 
     // Free up some memery
-    free(offset); offset = NULL;
-    free(row_counts); row_counts  = NULL;
+    free(row_T); row_T = NULL;
+    free(col_T); col_T = NULL;
+    free(val_T); val_T = NULL;
 }
 
-// Compute squared Euclidean distance matrix
+// Performs the gradient update (with momentum and gains) in a single parallel pass over the optimizer state; the pass
+// also subtracts the mean the map had before the update, and leaves the mean of the new map in mean_Y (the gradient
+// only depends on differences in the map, so centering it one iteration late does not change the optimization); returns
+// the squared norm of the gradient
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::computeSquaredEuclideanDistance(T* X, int N, int D, T* DD) {
-    const T* XnD = X;
-    for(int n = 0; n < N; ++n, XnD += D) {
-        const T* XmD = XnD + D;
-        T* curr_elem = &DD[n*N + n];
-        *curr_elem = 0.0;
-        T* curr_elem_sym = curr_elem + N;
-        for(int m = n + 1; m < N; ++m, XmD+=D, curr_elem_sym+=N) {
-            *(++curr_elem) = 0.0;
-            for(int d = 0; d < D; ++d) {
-                *curr_elem += (XnD[d] - XmD[d]) * (XnD[d] - XmD[d]);
+double TSNE<T, OUTDIM>::updateMap(T* Y, const T* dY, T* uY, T* gains, int N, T momentum, T eta, T* mean_Y) {
+    T shift[OUTDIM];
+    double sum[OUTDIM], grad_sq = .0;
+    for(int d = 0; d < OUTDIM; d++) { shift[d] = mean_Y[d]; sum[d] = .0; }
+
+    #pragma omp parallel
+    {
+        double local_sum[OUTDIM], local_grad_sq = .0;
+        for(int d = 0; d < OUTDIM; d++) local_sum[d] = .0;
+
+        #pragma omp for schedule(static)
+        for(int n = 0; n < N; n++) {
+            for(int d = 0; d < OUTDIM; d++) {
+                int i = n * OUTDIM + d;
+                T gain = (sign(dY[i]) != sign(uY[i])) ? (gains[i] + (T) .2) : (gains[i] * (T) .8);
+                if(gain < (T) .01) gain = .01;
+                gains[i] = gain;
+                uY[i] = momentum * uY[i] - eta * gain * dY[i];
+                Y[i] += uY[i] - shift[d];
+                local_sum[d] += Y[i];
+                local_grad_sq += dY[i] * dY[i];
             }
-            *curr_elem_sym = *curr_elem;
+        }
+
+        #pragma omp critical
+        {
+            for(int d = 0; d < OUTDIM; d++) sum[d] += local_sum[d];
+            grad_sq += local_grad_sq;
         }
     }
+    for(int d = 0; d < OUTDIM; d++) mean_Y[d] = (T) (sum[d] / N);
+    return grad_sq;
 }
 
 
 // Makes data zero-mean
 template<typename T, int OUTDIM>
-void TSNE<T, OUTDIM>::zeroMean(T* X, int N, int D) {
+void TSNE<T, OUTDIM>::zeroMean(T* X, int N, int D, T* mean_out) {
 
 	// Compute data mean
 	T* mean = (T*) calloc(D, sizeof(T));
     if(mean == NULL) { printf("Memory allocation failed!\n"); exit(1); }
-    int nD = 0;
+    size_t nD = 0;
 	for(int n = 0; n < N; n++) {
 		for(int d = 0; d < D; d++) {
 			mean[d] += X[nD + d];
@@ -701,6 +1761,7 @@ void TSNE<T, OUTDIM>::zeroMean(T* X, int N, int D) {
 		}
         nD += D;
 	}
+    if(mean_out != NULL) memcpy(mean_out, mean, D * sizeof(T));
     free(mean); mean = NULL;
 }
 
@@ -723,15 +1784,388 @@ T randn() {
 
 
 
+// The element type and output dimensionality of a loaded model select the TSNEModel that model points to
+struct TSNEModelFile {
+    int element_type;
+    int no_dims;
+    void* model;
+    const char* contents;           // the mapped model file
+    size_t size;
+};
+
+// Maps a model file saved by a run with TSNEOptions::model_file, and restores its search structures (NULL on failure)
+// Note: the result should be released with tsne_free_model
+TSNEModelFile* tsne_load_model(const char* filename, bool verbose) {
+    size_t size;
+    const char* contents = map_file(filename, &size);
+    if(contents == NULL) {
+        if (verbose) {
+            printf("Error: could not open model file.\n");
+        }
+        return NULL;
+    }
+
+    // Check the header and the size of the arrays behind it
+    TSNEModelHeader header;
+    bool valid = size >= sizeof(header);
+    if(valid) {
+        memcpy(&header, contents, sizeof(header));
+        size_t element_size = (header.element_type == ELEMENT_FLOAT32) ? sizeof(float) : sizeof(double);
+        valid = memcmp(header.magic, "BHTM", 4) == 0 && header.version == 1 &&
+                (header.element_type == ELEMENT_FLOAT32 || header.element_type == ELEMENT_FLOAT64) &&
+                header.no_dims >= 2 && header.no_dims <= TSNE_MAX_OUT_DIMS && header.n > 0 && header.d > 0 &&
+                size >= sizeof(header) + ((size_t) header.d + (size_t) header.n * (2 + header.no_dims + header.d)) * element_size +
+                        (size_t) header.n * sizeof(int);
+    }
+    if(!valid) {
+        if (verbose) {
+            printf("Error: unsupported or truncated model file.\n");
+        }
+        unmap_file(contents, size);
+        return NULL;
+    }
+
+    TSNEModelFile* model = new TSNEModelFile();
+    model->element_type = header.element_type;
+    model->no_dims = header.no_dims;
+    model->contents = contents;
+    model->size = size;
+    if(header.element_type == ELEMENT_FLOAT32) {
+        switch(header.no_dims) {
+            case 2: model->model = TSNE<float, 2>::loadModel(contents); break;
+            case 3: model->model = TSNE<float, 3>::loadModel(contents); break;
+            case 4: model->model = TSNE<float, 4>::loadModel(contents); break;
+            case 5: model->model = TSNE<float, 5>::loadModel(contents); break;
+            case 6: model->model = TSNE<float, 6>::loadModel(contents); break;
+            case 7: model->model = TSNE<float, 7>::loadModel(contents); break;
+            case 8: model->model = TSNE<float, 8>::loadModel(contents); break;
+            case 9: model->model = TSNE<float, 9>::loadModel(contents); break;
+            case 10: model->model = TSNE<float, 10>::loadModel(contents); break;
+        }
+    }
+    else {
+        switch(header.no_dims) {
+            case 2: model->model = TSNE<double, 2>::loadModel(contents); break;
+            case 3: model->model = TSNE<double, 3>::loadModel(contents); break;
+            case 4: model->model = TSNE<double, 4>::loadModel(contents); break;
+            case 5: model->model = TSNE<double, 5>::loadModel(contents); break;
+            case 6: model->model = TSNE<double, 6>::loadModel(contents); break;
+            case 7: model->model = TSNE<double, 7>::loadModel(contents); break;
+            case 8: model->model = TSNE<double, 8>::loadModel(contents); break;
+            case 9: model->model = TSNE<double, 9>::loadModel(contents); break;
+            case 10: model->model = TSNE<double, 10>::loadModel(contents); break;
+        }
+    }
+    if (verbose) {
+        printf("Loaded a model of %d points (%d to %d dimensions)\n", header.n, header.d, header.no_dims);
+    }
+    return model;
+}
+
+void tsne_free_model(TSNEModelFile* model) {
+    if(model == NULL) return;
+    if(model->element_type == ELEMENT_FLOAT32) {
+        switch(model->no_dims) {
+            case 2: TSNE<float, 2>::freeModel((TSNEModel<float, 2>*) model->model); break;
+            case 3: TSNE<float, 3>::freeModel((TSNEModel<float, 3>*) model->model); break;
+            case 4: TSNE<float, 4>::freeModel((TSNEModel<float, 4>*) model->model); break;
+            case 5: TSNE<float, 5>::freeModel((TSNEModel<float, 5>*) model->model); break;
+            case 6: TSNE<float, 6>::freeModel((TSNEModel<float, 6>*) model->model); break;
+            case 7: TSNE<float, 7>::freeModel((TSNEModel<float, 7>*) model->model); break;
+            case 8: TSNE<float, 8>::freeModel((TSNEModel<float, 8>*) model->model); break;
+            case 9: TSNE<float, 9>::freeModel((TSNEModel<float, 9>*) model->model); break;
+            case 10: TSNE<float, 10>::freeModel((TSNEModel<float, 10>*) model->model); break;
+        }
+    }
+    else {
+        switch(model->no_dims) {
+            case 2: TSNE<double, 2>::freeModel((TSNEModel<double, 2>*) model->model); break;
+            case 3: TSNE<double, 3>::freeModel((TSNEModel<double, 3>*) model->model); break;
+            case 4: TSNE<double, 4>::freeModel((TSNEModel<double, 4>*) model->model); break;
+            case 5: TSNE<double, 5>::freeModel((TSNEModel<double, 5>*) model->model); break;
+            case 6: TSNE<double, 6>::freeModel((TSNEModel<double, 6>*) model->model); break;
+            case 7: TSNE<double, 7>::freeModel((TSNEModel<double, 7>*) model->model); break;
+            case 8: TSNE<double, 8>::freeModel((TSNEModel<double, 8>*) model->model); break;
+            case 9: TSNE<double, 9>::freeModel((TSNEModel<double, 9>*) model->model); break;
+            case 10: TSNE<double, 10>::freeModel((TSNEModel<double, 10>*) model->model); break;
+        }
+    }
+    unmap_file(model->contents, model->size);
+    delete model;
+}
+
+
+template<typename T>
+int run_tSNE(const T *inputData, T *outputData, int N, int in_dims, int out_dims, int max_iter, T theta, T perplexity, int rand_seed, bool verbose,
+             const TSNEOptions* options=NULL) {
+
+  // Run double data in single precision (with double accumulators) if requested
+  if (sizeof(T) != sizeof(float) && options != NULL && options->single_precision) {
+    float* X = (float*) malloc((size_t) N * in_dims * sizeof(float));
+    float* Y = (float*) malloc((size_t) N * out_dims * sizeof(float));
+    if (X == NULL || Y == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    for (size_t i = 0; i < (size_t) N * in_dims; i++) X[i] = (float) inputData[i];
+    for (size_t i = 0; i < (size_t) N * out_dims; i++) Y[i] = (float) outputData[i];
+    int res = run_tSNE<float>(X, Y, N, in_dims, out_dims, max_iter, (float) theta, (float) perplexity, rand_seed, verbose, options);
+    for (size_t i = 0; i < (size_t) N * out_dims; i++) outputData[i] = Y[i];
+    free(X); free(Y);
+    return res;
+  }
+
+  switch (out_dims) {
+    case 2: return TSNE<T, 2>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 3: return TSNE<T, 3>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 4: return TSNE<T, 4>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 5: return TSNE<T, 5>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 6: return TSNE<T, 6>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 7: return TSNE<T, 7>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 8: return TSNE<T, 8>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 9: return TSNE<T, 9>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    case 10: return TSNE<T, 10>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, options);
+    default:
+      printf ("currently supports out_dims from 2 to %d only", TSNE_MAX_OUT_DIMS);
+      return 2;
+  }
+}
+
+
+// Checks that a sparse N x D matrix is in compressed sparse row format, with increasing column indices in every row
+static bool isValidSparseMatrix(const unsigned int* row_ptr, const unsigned int* col_idx, int N, int D) {
+  if (N <= 0 || row_ptr[0] != 0) return false;
+  bool valid = true;
+  #pragma omp parallel for reduction(&&:valid)
+  for (int n = 0; n < N; n++) {
+    if (row_ptr[n + 1] < row_ptr[n]) { valid = false; continue; }
+    for (unsigned int i = row_ptr[n]; i < row_ptr[n + 1]; i++) {
+      if (col_idx[i] >= (unsigned int) D || (i > row_ptr[n] && col_idx[i] <= col_idx[i - 1])) { valid = false; break; }
+    }
+  }
+  return valid;
+}
+
+
+// Runs approximate t-SNE on a sparse N x D matrix in compressed sparse row format: row n has the non-zeros
+// values[row_ptr[n] .. row_ptr[n + 1] - 1] in the columns col_idx[row_ptr[n] .. row_ptr[n + 1] - 1], in increasing order.
+// The distances between rows are Euclidean or cosine distances (see TSNEMetric). The input is not densified, so the
+// memory grows with the number of non-zeros rather than with N x D.
+// Note: exact t-SNE (theta = 0) needs dense input, and the model and affinity cache settings of the options are not used
+template<typename T>
+int run_tSNE_sparse(const unsigned int *row_ptr, const unsigned int *col_idx, const T *values, T *outputData, int N, int in_dims, int metric,
+                    int out_dims, int max_iter, T theta, T perplexity, int rand_seed, bool verbose, const TSNEOptions* options=NULL) {
+
+  TSNEOptions opts;
+  tsne_default_options(&opts);
+  if (options != NULL) opts = *options;
+  opts.model_file = NULL;
+  opts.affinity_cache = NULL;
+
+  // Run double data in single precision (with double accumulators) if requested
+  if (sizeof(T) != sizeof(float) && opts.single_precision) {
+    size_t nnz = N > 0 ? row_ptr[N] : 0;
+    float* float_values = (float*) malloc(max(nnz, (size_t) 1) * sizeof(float));
+    float* Y = (float*) malloc((size_t) N * out_dims * sizeof(float));
+    if (float_values == NULL || Y == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    for (size_t i = 0; i < nnz; i++) float_values[i] = (float) values[i];
+    for (size_t i = 0; i < (size_t) N * out_dims; i++) Y[i] = (float) outputData[i];
+    int res = run_tSNE_sparse<float>(row_ptr, col_idx, float_values, Y, N, in_dims, metric, out_dims, max_iter, (float) theta, (float) perplexity,
+                                     rand_seed, verbose, &opts);
+    for (size_t i = 0; i < (size_t) N * out_dims; i++) outputData[i] = Y[i];
+    free(float_values); free(Y);
+    return res;
+  }
+
+  if (out_dims < 2 || out_dims > TSNE_MAX_OUT_DIMS) {
+    printf ("currently supports out_dims from 2 to %d only", TSNE_MAX_OUT_DIMS);
+    return 2;
+  }
+  if (theta == .0 || (metric != TSNE_METRIC_EUCLIDEAN && metric != TSNE_METRIC_COSINE) || !isValidSparseMatrix(row_ptr, col_idx, N, in_dims)) {
+    if (verbose) {
+      printf("Error: sparse input needs theta > 0, a known metric and a valid matrix in compressed sparse row format.\n");
+    }
+    return 1;
+  }
+  if (N - 1 < 3 * perplexity) {
+    if (verbose) {
+      printf("Perplexity too large for the number of data points!\n");
+    }
+    return 1;
+  }
+
+  // Compute the input similarities from the sparse rows (unless the run continues from a checkpoint, which holds them),
+  // and pass them to run() as precomputed ones; the approximate neighbor search draws its seed from rand() as in run()
+  TSNEStats affinity_stats;
+  memset(&affinity_stats, 0, sizeof(affinity_stats));
+  double start = wallTime();
+  TSNEAffinities<T> affinities;
+  memset(&affinities, 0, sizeof(affinities));
+  affinities.perplexity = perplexity;
+  bool resume = (opts.resume_file != NULL);
+  if (!resume) {
+    if (verbose) {
+      printf("Computing input similarities from %u non-zeros (%s distance)...\n", row_ptr[N], metric == TSNE_METRIC_COSINE ? "cosine" : "Euclidean");
+    }
+    srand(rand_seed > 0 ? (unsigned int) rand_seed : 0xDEADBEEF);
+    TSNE<T, 2>::computeSparseAffinities(row_ptr, col_idx, values, N, metric, &affinities, verbose, opts, &affinity_stats);
+  }
+  double affinity_time = wallTime() - start;
+
+  // Perform the optimization, and add the time of the input similarities to its statistics
+  TSNEStats stats;
+  memset(&stats, 0, sizeof(stats));
+  TSNEStats* caller_stats = opts.stats;
+  opts.stats = &stats;
+  const TSNEAffinities<T>* shared = resume ? NULL : &affinities;
+  int res = 2;
+  switch (out_dims) {
+    case 2: res = TSNE<T, 2>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 3: res = TSNE<T, 3>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 4: res = TSNE<T, 4>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 5: res = TSNE<T, 5>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 6: res = TSNE<T, 6>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 7: res = TSNE<T, 7>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 8: res = TSNE<T, 8>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 9: res = TSNE<T, 9>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+    case 10: res = TSNE<T, 10>::run(NULL, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter, 250, 250, &opts, shared); break;
+  }
+  stats.centering += affinity_stats.centering;
+  stats.knn += affinity_stats.knn;
+  stats.calibration += affinity_stats.calibration;
+  stats.symmetrization += affinity_stats.symmetrization;
+  stats.total += affinity_time;
+  if (caller_stats != NULL) *caller_stats = stats;
+  if (!resume) TSNE<T, 2>::freeAffinities(&affinities);
+  return res;
+}
+
+
+// Runs several optimizations on the same data: approximate runs with the same perplexity share their input similarities,
+// and all of them come from one neighbor search. The runs follow each other (each one using all threads), or run
+// concurrently (one thread each) if requested. Returns 0 if every run succeeded.
+// Note: the model, checkpoint, resume, affinity cache, stats and callback settings of the options are not used
+template<typename T>
+int run_tSNE_batch(const T *inputData, int N, int in_dims, TSNEBatchRun* runs, int no_runs, bool concurrent, bool verbose,
+                   const TSNEOptions* options=NULL) {
+
+  TSNEOptions opts;
+  tsne_default_options(&opts);
+  if (options != NULL) opts = *options;
+  opts.model_file = NULL;
+  opts.checkpoint_file = NULL;
+  opts.resume_file = NULL;
+  opts.affinity_cache = NULL;
+  opts.stats = NULL;
+  opts.callback = NULL;
+
+  // Run double data in single precision (with double accumulators) if requested
+  if (sizeof(T) != sizeof(float) && opts.single_precision) {
+    float* X = (float*) malloc((size_t) N * in_dims * sizeof(float));
+    if (X == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    for (size_t i = 0; i < (size_t) N * in_dims; i++) X[i] = (float) inputData[i];
+    vector<TSNEBatchRun> float_runs(runs, runs + no_runs);
+    for (int r = 0; r < no_runs; r++) {
+      float_runs[r].Y = malloc((size_t) N * max(runs[r].out_dims, 1) * sizeof(float));
+      if (float_runs[r].Y == NULL) { printf("Memory allocation failed!\n"); exit(1); }
+    }
+    int res = run_tSNE_batch<float>(X, N, in_dims, float_runs.data(), no_runs, concurrent, verbose, &opts);
+    for (int r = 0; r < no_runs; r++) {
+      if (float_runs[r].result == 0) {
+        for (size_t i = 0; i < (size_t) N * runs[r].out_dims; i++) ((T*) runs[r].Y)[i] = ((float*) float_runs[r].Y)[i];
+      }
+      runs[r].result = float_runs[r].result;
+      runs[r].stats = float_runs[r].stats;
+      free(float_runs[r].Y);
+    }
+    free(X);
+    return res;
+  }
+
+  // Compute the input similarities of every perplexity of the approximate runs, from one neighbor search
+  vector<TSNEAffinities<T> > affinities;
+  vector<int> run_affinities(no_runs, -1);
+  for (int r = 0; r < no_runs; r++) {
+    if (runs[r].theta == .0 || N - 1 < 3 * runs[r].perplexity) continue;      // run() computes or rejects these itself
+    for (size_t a = 0; a < affinities.size() && run_affinities[r] < 0; a++) {
+      if (affinities[a].perplexity == (T) runs[r].perplexity) run_affinities[r] = (int) a;
+    }
+    if (run_affinities[r] < 0) {
+      TSNEAffinities<T> shared;
+      memset(&shared, 0, sizeof(shared));
+      shared.perplexity = (T) runs[r].perplexity;
+      run_affinities[r] = (int) affinities.size();
+      affinities.push_back(shared);
+    }
+  }
+  // (the approximate neighbor search draws its seed from rand(), and the similarities do not depend on the output
+  // dimensionality)
+  srand(0xDEADBEEF);
+  if (!affinities.empty()) TSNE<T, 2>::computeAffinities(inputData, N, in_dims, affinities.data(), (int) affinities.size(), verbose, opts);
+
+  // Initialize the maps in order (as run() would for the same seed), since the random numbers are not thread-safe
+  for (int r = 0; r < no_runs; r++) {
+    if (runs[r].out_dims < 2 || runs[r].out_dims > TSNE_MAX_OUT_DIMS) continue;
+    srand(runs[r].rand_seed > 0 ? (unsigned int) runs[r].rand_seed : 0xDEADBEEF);
+    for (int i = 0; i < N * runs[r].out_dims; i++) ((T*) runs[r].Y)[i] = randn<T>() * .0001;
+  }
+
+  // Perform the optimizations
+  int failed = 0;
+  #pragma omp parallel for schedule(dynamic, 1) reduction(+:failed) if(concurrent)
+  for (int r = 0; r < no_runs; r++) {
+    TSNEOptions run_opts = opts;
+    run_opts.stats = &runs[r].stats;
+    if (concurrent) run_opts.pin_threads = 0;
+    const TSNEAffinities<T>* shared = (run_affinities[r] < 0) ? NULL : &affinities[run_affinities[r]];
+    bool run_verbose = verbose && !concurrent;
+    memset(&runs[r].stats, 0, sizeof(TSNEStats));
+    switch (runs[r].out_dims) {
+      case 2: runs[r].result = TSNE<T, 2>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 3: runs[r].result = TSNE<T, 3>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 4: runs[r].result = TSNE<T, 4>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 5: runs[r].result = TSNE<T, 5>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 6: runs[r].result = TSNE<T, 6>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 7: runs[r].result = TSNE<T, 7>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 8: runs[r].result = TSNE<T, 8>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 9: runs[r].result = TSNE<T, 9>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      case 10: runs[r].result = TSNE<T, 10>::run(inputData, N, in_dims, (T*) runs[r].Y, (T) runs[r].perplexity, (T) runs[r].theta, runs[r].rand_seed,
+                                                true, run_verbose, runs[r].max_iter, 250, 250, &run_opts, shared); break;
+      default: runs[r].result = 2;
+    }
+    if (runs[r].result != 0) failed++;
+    if (verbose && concurrent) printf("Run %d finished in %4.2f seconds (result %d)\n", r, runs[r].stats.total, runs[r].result);
+  }
+
+  // Clean up memory
+  for (size_t a = 0; a < affinities.size(); a++) TSNE<T, 2>::freeAffinities(&affinities[a]);
+  return failed == 0 ? 0 : 1;
+}
+
+
 template<typename T>
-int run_tSNE(T *inputData, T *outputData, int N, int in_dims, int out_dims, int max_iter, T theta, T perplexity, int rand_seed, bool verbose) {
-
-  if (out_dims == 2) {
-	  return TSNE<T, 2>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter);
-  } else if (out_dims == 3) {
-    return TSNE<T, 3>::run(inputData, N, in_dims, outputData, perplexity, theta, rand_seed, false, verbose, max_iter);
-  } else {
-    printf ("currently supports out_dims == 2 only");
+int transform_tSNE(TSNEModelFile* model, const T *inputData, T *outputData, int N, int max_iter, T perplexity, bool verbose) {
+
+  int element_type = (sizeof(T) == sizeof(float)) ? ELEMENT_FLOAT32 : ELEMENT_FLOAT64;
+  if (model == NULL || model->element_type != element_type) {
+    printf ("the model was saved with another element type");
     return 2;
   }
+  switch (model->no_dims) {
+    case 2: return TSNE<T, 2>::transform((const TSNEModel<T, 2>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 3: return TSNE<T, 3>::transform((const TSNEModel<T, 3>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 4: return TSNE<T, 4>::transform((const TSNEModel<T, 4>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 5: return TSNE<T, 5>::transform((const TSNEModel<T, 5>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 6: return TSNE<T, 6>::transform((const TSNEModel<T, 6>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 7: return TSNE<T, 7>::transform((const TSNEModel<T, 7>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 8: return TSNE<T, 8>::transform((const TSNEModel<T, 8>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 9: return TSNE<T, 9>::transform((const TSNEModel<T, 9>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    case 10: return TSNE<T, 10>::transform((const TSNEModel<T, 10>*) model->model, inputData, N, outputData, perplexity, max_iter, verbose);
+    default: return 2;
+  }
 }
@@ -8,4 +8,43 @@ extern "C" {
     int run_tSNE_float32(float *inputData, float *outputData, int Nsamples, int in_dims, int out_dims, int max_iter, float theta, float perplexity, int rand_seed, bool verbose) {
     	return run_tSNE<float>(inputData, outputData, Nsamples, in_dims, out_dims, max_iter, theta, perplexity, rand_seed, verbose);
     }
+
+    // Same as above, with additional settings (NULL selects the defaults, see tsne_default_options)
+    int run_tSNE_float64_ex(double *inputData, double *outputData, int Nsamples, int in_dims, int out_dims, int max_iter, double theta, double perplexity, int rand_seed, bool verbose, const TSNEOptions* options) {
+    	return run_tSNE<double>(inputData, outputData, Nsamples, in_dims, out_dims, max_iter, theta, perplexity, rand_seed, verbose, options);
+    }
+
+    int run_tSNE_float32_ex(float *inputData, float *outputData, int Nsamples, int in_dims, int out_dims, int max_iter, float theta, float perplexity, int rand_seed, bool verbose, const TSNEOptions* options) {
+    	return run_tSNE<float>(inputData, outputData, Nsamples, in_dims, out_dims, max_iter, theta, perplexity, rand_seed, verbose, options);
+    }
+
+    // Runs approximate t-SNE on a sparse matrix in compressed sparse row format (column indices increasing within every
+    // row), with Euclidean or cosine distances between the rows (see TSNEMetric)
+    int run_tSNE_sparse_float64(unsigned int *row_ptr, unsigned int *col_idx, double *values, double *outputData, int Nsamples, int in_dims, int metric, int out_dims, int max_iter, double theta, double perplexity, int rand_seed, bool verbose, const TSNEOptions* options) {
+    	return run_tSNE_sparse<double>(row_ptr, col_idx, values, outputData, Nsamples, in_dims, metric, out_dims, max_iter, theta, perplexity, rand_seed, verbose, options);
+    }
+
+    int run_tSNE_sparse_float32(unsigned int *row_ptr, unsigned int *col_idx, float *values, float *outputData, int Nsamples, int in_dims, int metric, int out_dims, int max_iter, float theta, float perplexity, int rand_seed, bool verbose, const TSNEOptions* options) {
+    	return run_tSNE_sparse<float>(row_ptr, col_idx, values, outputData, Nsamples, in_dims, metric, out_dims, max_iter, theta, perplexity, rand_seed, verbose, options);
+    }
+
+    // Runs several optimizations on the same data (see TSNEBatchRun), with one neighbor search for all of them and one
+    // set of input similarities per perplexity; concurrent runs use one thread each
+    int run_tSNE_batch_float64(double *inputData, int Nsamples, int in_dims, TSNEBatchRun* runs, int no_runs, bool concurrent, bool verbose, const TSNEOptions* options) {
+    	return run_tSNE_batch<double>(inputData, Nsamples, in_dims, runs, no_runs, concurrent, verbose, options);
+    }
+
+    int run_tSNE_batch_float32(float *inputData, int Nsamples, int in_dims, TSNEBatchRun* runs, int no_runs, bool concurrent, bool verbose, const TSNEOptions* options) {
+    	return run_tSNE_batch<float>(inputData, Nsamples, in_dims, runs, no_runs, concurrent, verbose, options);
+    }
+
+    // Places new points into the map of a model loaded with tsne_load_model (a non-positive perplexity selects the one
+    // the model was trained with; the element type has to match the model)
+    int transform_tSNE_float64(TSNEModelFile* model, double *inputData, double *outputData, int Nsamples, int max_iter, double perplexity, bool verbose) {
+    	return transform_tSNE<double>(model, inputData, outputData, Nsamples, max_iter, perplexity, verbose);
+    }
+
+    int transform_tSNE_float32(TSNEModelFile* model, float *inputData, float *outputData, int Nsamples, int max_iter, float perplexity, bool verbose) {
+    	return transform_tSNE<float>(model, inputData, outputData, Nsamples, max_iter, perplexity, verbose);
+    }
 }
@@ -37,7 +37,6 @@
 #include <algorithm>
 #include <vector>
 #include <stdio.h>
-#include <queue>
 #include <limits>
 #include <cmath>
 
@@ -45,118 +44,133 @@
 #ifndef VPTREE_H
 #define VPTREE_H
 
+// Squared Euclidean distances between the rows of a dense N x D matrix (the matrix is not copied)
 template<typename T>
-class DataPoint
+class EuclideanDistance
 {
-    int _ind;
+    const T* _X;
+    int _D;
 
 public:
-    T* _x;
-    int _D;
-    DataPoint() {
-        _D = 1;
-        _ind = -1;
-        _x = NULL;
-    }
-    DataPoint(int D, int ind, T* x) {
-        _D = D;
-        _ind = ind;
-        _x = (T*) malloc(_D * sizeof(T));
-        for(int d = 0; d < _D; d++) _x[d] = x[d];
-    }
-    DataPoint(const DataPoint<T>& other) {                     // this makes a deep copy -- should not free anything
-        if(this != &other) {
-            _D = other.dimensionality();
-            _ind = other.index();
-            _x = (T*) malloc(_D * sizeof(T));
-            for(int d = 0; d < _D; d++) _x[d] = other.x(d);
+    EuclideanDistance(const T* X, int D) : _X(X), _D(D) {}
+
+    // Distance between a point and row j (with independent partial sums, so long rows pipeline and vectorize)
+    T operator()(const T* x1, int j) const {
+        const T* x2 = _X + (size_t) j * _D;
+        T dd[4] = {.0, .0, .0, .0};
+        int d = 0;
+        for(; d + 4 <= _D; d += 4) {
+            for(int k = 0; k < 4; k++) dd[k] += (x1[d + k] - x2[d + k]) * (x1[d + k] - x2[d + k]);
         }
+        for(; d < _D; d++) dd[0] += (x1[d] - x2[d]) * (x1[d] - x2[d]);
+        return (dd[0] + dd[1]) + (dd[2] + dd[3]);
     }
-    ~DataPoint() { if(_x != NULL) free(_x); }
-    DataPoint& operator= (const DataPoint<T>& other) {         // asignment should free old object
-        if(this != &other) {
-            if(_x != NULL) free(_x);
-            _D = other.dimensionality();
-            _ind = other.index();
-            _x = (T*) malloc(_D * sizeof(T));
-            for(int d = 0; d < _D; d++) _x[d] = other.x(d);
-        }
-        return *this;
+
+    // Distance between rows i and j
+    T operator()(int i, int j) const {
+        return (*this)(_X + (size_t) i * _D, j);
     }
-    int index() const { return _ind; }
-    int dimensionality() const { return _D; }
-    T x(int d) const { return _x[d]; }
 };
 
+
+// Squared Euclidean distances between the rows of a sparse N x D matrix in compressed sparse row format, with the
+// column indices of every row in increasing order (the matrix is not copied)
 template<typename T>
-T euclidean_distance(const DataPoint<T> &t1, const DataPoint<T> &t2) {
-    T dd = .0;
-    T* x1 = t1._x;
-    T* x2 = t2._x;
-    T diff;
-    for(int d = 0; d < t1._D; d++) {
-        diff = (x1[d] - x2[d]);
-        dd += diff * diff;
+class SparseEuclideanDistance
+{
+    const unsigned int* _row_ptr;
+    const unsigned int* _col_idx;
+    const T* _values;
+
+public:
+    SparseEuclideanDistance(const unsigned int* row_ptr, const unsigned int* col_idx, const T* values) :
+        _row_ptr(row_ptr), _col_idx(col_idx), _values(values) {}
+
+    // Distance between rows i and j (merges their non-zeros, so it costs the number of non-zeros of both rows)
+    T operator()(int i, int j) const {
+        unsigned int a = _row_ptr[i], a_end = _row_ptr[i + 1];
+        unsigned int b = _row_ptr[j], b_end = _row_ptr[j + 1];
+        T dd = .0;
+        while(a < a_end && b < b_end) {
+            if(_col_idx[a] == _col_idx[b]) { dd += (_values[a] - _values[b]) * (_values[a] - _values[b]); a++; b++; }
+            else if(_col_idx[a] < _col_idx[b]) { dd += _values[a] * _values[a]; a++; }
+            else { dd += _values[b] * _values[b]; b++; }
+        }
+        for(; a < a_end; a++) dd += _values[a] * _values[a];
+        for(; b < b_end; b++) dd += _values[b] * _values[b];
+        return dd;
     }
-    return sqrt(dd);
-}
+};
 
 
-template<typename T, typename T2, T2 (*distance)( const T&, const T& )>
+// Vantage-point tree over the row indices of a data set; Distance returns squared distances between rows (and queries)
+template<typename T, typename Distance>
 class VpTree
 {
 public:
 
-    // Default constructor
-    VpTree() : _root(0) {}
+    // Constructor (the distance functor refers to the caller's data, which must outlive the tree)
+    VpTree(const Distance& distance) : _distance(distance), _root(0) {}
 
     // Destructor
     ~VpTree() {
         delete _root;
     }
 
-    // Function to create a new VpTree from data
-    void create(const std::vector<T>& items) {
+    // Function to create a new VpTree over rows 0..N-1
+    void create(int N) {
         delete _root;
-        _items = items;
-        _root = buildFromPoints(0, items.size());
+        _items.resize(N);
+        for(int n = 0; n < N; n++) _items[n] = n;
+        _root = buildFromPoints(0, N);
     }
 
-    // Function that uses the tree to find the k nearest neighbors of target
-    void search(const T& target, int k, std::vector<T>* results, std::vector<T2>* distances)
+    // Stores the tree in two arrays of N entries: the row order of the points and the radius of the node at every
+    // position (the shape of the tree follows from N alone, see buildFromPoints)
+    void save(int* items, T* thresholds) const {
+        for(size_t i = 0; i < _items.size(); i++) items[i] = _items[i];
+        save(_root, thresholds);
+    }
+
+    // Restores a tree stored by save over rows 0..N-1 (without computing any distances)
+    void load(int N, const int* items, const T* thresholds) {
+        delete _root;
+        _items.assign(items, items + N);
+        _root = loadFromArrays(0, N, thresholds);
+    }
+
+    // Function that uses the tree to find the k nearest neighbors of target (a row index or a point), and stores their
+    // row indices and squared distances in increasing order of distance (safe to call from several threads at once)
+    template<typename Query>
+    void search(const Query& target, int k, int* indices, T* distances) const
     {
 
-        // Use a priority queue to store intermediate results on
-        std::priority_queue<HeapItem> heap;
+        // The result buffers hold a max-heap on the distances during the search
+        int size = 0;
 
         // Variable that tracks the distance to the farthest point in our results
-        _tau = DBL_MAX;
+        T tau = std::numeric_limits<T>::max();
 
         // Perform the search
-        search(_root, target, k, heap);
-
-        // Gather final results
-        results->clear(); distances->clear();
-        while(!heap.empty()) {
-            results->push_back(_items[heap.top().index]);
-            distances->push_back(heap.top().dist);
-            heap.pop();
-        }
+        search(_root, target, k, indices, distances, size, tau);
 
-        // Results are in reverse order
-        std::reverse(results->begin(), results->end());
-        std::reverse(distances->begin(), distances->end());
+        // Sort the results by popping the farthest points off the heap
+        for(int i = size - 1; i > 0; i--) {
+            std::swap(indices[0], indices[i]);
+            std::swap(distances[0], distances[i]);
+            siftDown(indices, distances, 0, i);
+        }
     }
 
 private:
-    std::vector<T> _items;
-    T2 _tau;
+    Distance _distance;
+    std::vector<int> _items;
 
     // Single node of a VP tree (has a point and radius; left children are closer to point than the radius)
     struct Node
     {
         int index;              // index of point in node
-        T2 threshold;       // radius(?)
+        T threshold;            // radius(?)
         Node* left;             // points closer by than threshold
         Node* right;            // points farther away than threshold
 
@@ -170,23 +184,13 @@ private:
     }* _root;
 
 
-    // An item on the intermediate result queue
-    struct HeapItem {
-        HeapItem( int index, T2 dist) :
-        index(index), dist(dist) {}
-        int index;
-        T2 dist;
-        bool operator<(const HeapItem& o) const {
-            return dist < o.dist;
-        }
-    };
-
     // Distance comparator for use in std::nth_element
     struct DistanceComparator
     {
-        const T& item;
-        DistanceComparator(const T& item) : item(item) {}
-        bool operator()(const T& a, const T& b) {
+        const Distance& distance;
+        int item;
+        DistanceComparator(const Distance& distance, int item) : distance(distance), item(item) {}
+        bool operator()(int a, int b) {
             return distance(item, a) < distance(item, b);
         }
     };
@@ -205,7 +209,7 @@ private:
         if (upper - lower > 1) {      // if we did not arrive at leaf yet
 
             // Choose an arbitrary point and move it to the start
-            int i = (int) ((T2)rand() / RAND_MAX * (upper - lower - 1)) + lower;
+            int i = (int) ((T)rand() / RAND_MAX * (upper - lower - 1)) + lower;
             std::swap(_items[lower], _items[i]);
 
             // Partition around the median distance
@@ -213,10 +217,10 @@ private:
             std::nth_element(_items.begin() + lower + 1,
                              _items.begin() + median,
                              _items.begin() + upper,
-                             DistanceComparator(_items[lower]));
+                             DistanceComparator(_distance, _items[lower]));
 
             // Threshold of the new node will be the distance to the median
-            node->threshold = distance(_items[lower], _items[median]);
+            node->threshold = sqrt(_distance(_items[lower], _items[median]));
 
             // Recursively build tree
             node->index = lower;
@@ -228,19 +232,80 @@ private:
         return node;
     }
 
-    // Helper function that searches the tree
-    void search(Node* node, const T& target, int k, std::priority_queue<HeapItem>& heap)
+    // Function that (recursively) stores the radii of the nodes at their positions
+    void save(const Node* node, T* thresholds) const
+    {
+        if(node == NULL) return;
+        thresholds[node->index] = node->threshold;
+        save(node->left, thresholds);
+        save(node->right, thresholds);
+    }
+
+    // Function that (recursively) rebuilds the nodes of a stored tree, with the same split positions as buildFromPoints
+    Node* loadFromArrays(int lower, int upper, const T* thresholds)
+    {
+        if (upper == lower) {
+            return NULL;
+        }
+        Node* node = new Node();
+        node->index = lower;
+        if (upper - lower > 1) {
+            int median = (upper + lower) / 2;
+            node->threshold = thresholds[lower];
+            node->left = loadFromArrays(lower + 1, median, thresholds);
+            node->right = loadFromArrays(median, upper, thresholds);
+        }
+        return node;
+    }
+
+    // Restores the max-heap property below position i of a heap of the given size
+    static void siftDown(int* indices, T* distances, int i, int size)
+    {
+        while(true) {
+            int largest = i;
+            int left = 2 * i + 1, right = 2 * i + 2;
+            if(left  < size && distances[left]  > distances[largest]) largest = left;
+            if(right < size && distances[right] > distances[largest]) largest = right;
+            if(largest == i) return;
+            std::swap(indices[i], indices[largest]);
+            std::swap(distances[i], distances[largest]);
+            i = largest;
+        }
+    }
+
+    // Adds a result to the heap, dropping the farthest one if the heap already holds k results
+    static void push(int* indices, T* distances, int& size, int k, int index, T dist)
+    {
+        if(size == k) {
+            indices[0] = index;
+            distances[0] = dist;
+            siftDown(indices, distances, 0, size);
+            return;
+        }
+        int i = size++;
+        while(i > 0 && distances[(i - 1) / 2] < dist) {
+            indices[i] = indices[(i - 1) / 2];
+            distances[i] = distances[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        indices[i] = index;
+        distances[i] = dist;
+    }
+
+    // Helper function that searches the tree (tau is the distance to the farthest point in the results so far)
+    template<typename Query>
+    void search(Node* node, const Query& target, int k, int* indices, T* distances, int& size, T& tau) const
     {
         if(node == NULL) return;     // indicates that we're done here
 
         // Compute distance between target and current node
-        T2 dist = distance(_items[node->index], target);
+        T dist_sq = _distance(target, _items[node->index]);
+        T dist = sqrt(dist_sq);
 
         // If current node within radius tau
-        if(dist < _tau) {
-            if(heap.size() == k) heap.pop();                 // remove furthest node from result list (if we already have k results)
-            heap.push(HeapItem(node->index, dist));           // add current node to result list
-            if(heap.size() == k) _tau = heap.top().dist;     // update value of tau (farthest point in result list)
+        if(dist < tau) {
+            push(indices, distances, size, k, _items[node->index], dist_sq);   // add current node to result list (replacing the farthest one if we already have k results)
+            if(size == k) tau = sqrt(distances[0]);                             // update value of tau (farthest point in result list)
         }
 
         // Return if we arrived at a leaf
@@ -250,22 +315,22 @@ private:
 
         // If the target lies within the radius of ball
         if(dist < node->threshold) {
-            if(dist - _tau <= node->threshold) {         // if there can still be neighbors inside the ball, recursively search left child first
-                search(node->left, target, k, heap);
+            if(dist - tau <= node->threshold) {         // if there can still be neighbors inside the ball, recursively search left child first
+                search(node->left, target, k, indices, distances, size, tau);
             }
 
-            if(dist + _tau >= node->threshold) {         // if there can still be neighbors outside the ball, recursively search right child
-                search(node->right, target, k, heap);
+            if(dist + tau >= node->threshold) {         // if there can still be neighbors outside the ball, recursively search right child
+                search(node->right, target, k, indices, distances, size, tau);
             }
 
         // If the target lies outsize the radius of the ball
         } else {
-            if(dist + _tau >= node->threshold) {         // if there can still be neighbors outside the ball, recursively search right child first
-                search(node->right, target, k, heap);
+            if(dist + tau >= node->threshold) {         // if there can still be neighbors outside the ball, recursively search right child first
+                search(node->right, target, k, indices, distances, size, tau);
             }
 
-            if (dist - _tau <= node->threshold) {         // if there can still be neighbors inside the ball, recursively search left child
-                search(node->left, target, k, heap);
+            if (dist - tau <= node->threshold) {         // if there can still be neighbors inside the ball, recursively search left child
+                search(node->left, target, k, indices, distances, size, tau);
             }
         }
     }